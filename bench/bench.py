@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+"""Run the div benchmark corpus and compare it against a baseline.
+
+Each program is run a number of times, and each run reports, through
+-time-phases-json, how long went to compiling and how long to running the
+code, with the peak resident set size taken from the kernel.  The summary of
+every metric, per program, is written as JSON.  Given a baseline, a summary
+written earlier the same way, the script exits with status 1 if any metric
+has grown by more than the threshold: the fastest run's times, which noise
+disturbs least, and the median peak memory.
+
+The corpus is the .div files next to this script, and a large set of
+formulas generated afresh, the same every time, for compile time.
+"""
+
+import argparse
+import json
+import os
+import random
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# What is compared against the baseline: which statistic of each metric,
+# and the smallest change in it that counts, below which timer and allocator
+# noise dominate.  Other processes only ever make a run slower, so the
+# fastest run is the steadiest measure of time.
+METRICS = {
+    "compile_ms": ("min", 2.0),
+    "run_ms": ("min", 2.0),
+    "wall_ms": ("min", 5.0),
+    "peak_rss_kb": ("median", 1024.0),
+}
+
+
+def generate_formulas(path, count=2000, seed=1):
+    """Write count formulas of two variables, each calling at most one
+    earlier one so that evaluating the last does not take exponential time,
+    and a loop that evaluates the last."""
+    rng = random.Random(seed)
+
+    def expr(depth, callee):
+        if depth == 0 or (depth < 5 and rng.random() < 0.2):
+            return rng.choice(["a", "b", str(rng.randint(1, 9))])
+        kind = rng.random()
+        if kind < 0.15 and callee is not None:
+            return "f%d(%s, %s)" % (callee, expr(depth - 1, None),
+                                    expr(depth - 1, None))
+        if kind < 0.3:
+            return "(if %s < %s then %s else %s)" % (
+                expr(depth - 1, None), expr(depth - 1, None),
+                expr(depth - 1, callee), expr(depth - 1, None))
+        return "(%s %s %s)" % (expr(depth - 1, callee), rng.choice("+-*"),
+                               expr(depth - 1, None))
+
+    with open(path, "w") as f:
+        f.write("# %d generated formulas.\n\n" % count)
+        for i in range(count):
+            callee = rng.randrange(i) if i else None
+            f.write("def f%d(a b)\n  %s;\n\n" % (i, expr(5, callee)))
+        f.write("def evaluate(n)\n  var s = 0 in\n"
+                "    (for i = 0, i < n in s = s + f%d(i, 0 - i)) + s;\n\n"
+                "evaluate(1000);\n" % (count - 1))
+
+
+def corpus(workdir):
+    """The programs to run, as (name, path) pairs."""
+    programs = []
+    for name in sorted(os.listdir(BENCH_DIR)):
+        if name.endswith(".div"):
+            programs.append((name[:-4], os.path.join(BENCH_DIR, name)))
+    formulas = os.path.join(workdir, "formulas.div")
+    generate_formulas(formulas)
+    programs.append(("formulas", formulas))
+    return programs
+
+
+def run_once(div, flags, path, workdir):
+    """Run div on path once and return its metrics."""
+    phases = os.path.join(workdir, "phases.json")
+    command = [div] + flags + ["-time-phases-json=" + phases, path]
+    start = time.perf_counter()
+    proc = subprocess.Popen(command, stdin=subprocess.DEVNULL,
+                            stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall_ms = (time.perf_counter() - start) * 1000
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if proc.returncode:
+        raise RuntimeError("%s exited with status %d" %
+                           (" ".join(command), proc.returncode))
+    with open(phases) as f:
+        session = json.load(f)["session"]
+    return {
+        "compile_ms": session["total"] - session["run"],
+        "run_ms": session["run"],
+        "wall_ms": wall_ms,
+        "peak_rss_kb": float(usage.ru_maxrss),
+    }
+
+
+def summarize(samples):
+    """The mean, median, spread and variance of each metric's samples."""
+    summary = {}
+    for metric in METRICS:
+        values = [s[metric] for s in samples]
+        summary[metric] = {
+            "mean": statistics.mean(values),
+            "median": statistics.median(values),
+            "min": min(values),
+            "max": max(values),
+            "stdev": statistics.stdev(values) if len(values) > 1 else 0.0,
+            "variance":
+                statistics.variance(values) if len(values) > 1 else 0.0,
+        }
+    return summary
+
+
+def compare(results, baseline, threshold):
+    """Every metric that has grown on the baseline by more than threshold
+    percent, and by more than the noise."""
+    regressions = []
+    for name, metrics in sorted(results.items()):
+        base = baseline.get("programs", {}).get(name)
+        if base is None:
+            continue
+        for metric, (stat, noise) in METRICS.items():
+            old = base[metric][stat]
+            new = metrics[metric][stat]
+            if new - old > noise and new > old * (1 + threshold / 100):
+                regressions.append({
+                    "program": name,
+                    "metric": metric,
+                    "statistic": stat,
+                    "baseline": old,
+                    "current": new,
+                    "change_percent":
+                        100 * (new - old) / old if old else None,
+                })
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--div", default="dist/div",
+                        help="the div binary (default dist/div)")
+    parser.add_argument("--runs", type=int, default=5,
+                        help="runs of each program (default 5)")
+    parser.add_argument("--flags", default="",
+                        help="options to give div, e.g. '-O3 -tiered'")
+    parser.add_argument("--only", action="append", default=[],
+                        help="run only this program; may be repeated")
+    parser.add_argument("--output", help="write the results here as well")
+    parser.add_argument("--baseline",
+                        help="compare against the results in this file")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="the growth, in percent, in the fastest "
+                             "run's times or the median peak memory that "
+                             "is a regression (default 10)")
+    args = parser.parse_args()
+    if args.runs < 1:
+        parser.error("--runs must be at least 1")
+
+    flags = args.flags.split()
+    results = {}
+    with tempfile.TemporaryDirectory(prefix="div-bench-") as workdir:
+        for name, path in corpus(workdir):
+            if args.only and name not in args.only:
+                continue
+            try:
+                samples = [run_once(args.div, flags, path, workdir)
+                           for _ in range(args.runs)]
+            except (OSError, RuntimeError) as e:
+                print("error: %s" % e, file=sys.stderr)
+                return 2
+            results[name] = summarize(samples)
+            print("%-12s compile %8.2f ms  run %8.2f ms  rss %8.0f KB" %
+                  (name, results[name]["compile_ms"]["median"],
+                   results[name]["run_ms"]["median"],
+                   results[name]["peak_rss_kb"]["median"]),
+                  file=sys.stderr)
+
+    report = {"div": args.div, "flags": flags, "runs": args.runs,
+              "programs": results}
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        if baseline.get("flags") != flags:
+            print("warning: the baseline was run with flags %r" %
+                  baseline.get("flags"), file=sys.stderr)
+        report["baseline"] = args.baseline
+        report["threshold_percent"] = args.threshold
+        report["regressions"] = compare(results, baseline, args.threshold)
+
+    text = json.dumps(report, indent=2, sort_keys=True) + "\n"
+    sys.stdout.write(text)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text)
+
+    for r in report.get("regressions", []):
+        print("regression: %s %s %s %.2f -> %.2f" %
+              (r["program"], r["statistic"], r["metric"], r["baseline"],
+               r["current"]),
+              file=sys.stderr)
+    return 1 if report.get("regressions") else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,21 +1,37 @@
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/Analysis/BasicAliasAnalysis.h"
 #include "llvm/Analysis/Passes.h"
 #include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
-#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/FormatVariadic.h"
 #include "llvm/Support/Host.h"
 #include "llvm/Support/TargetSelect.h"
-#include "llvm/Transforms/Scalar.h"
+#include "llvm/Support/ThreadPool.h"
 #include <cctype>
+#include <chrono>
 #include <cstdio>
-#include <map>
 #include <string>
 #include <vector>
+#include "div/aot.hh"
+#include "div/callstats.hh"
+#include "div/flatast.hh"
 #include "div/jit.hh"
+#include "div/number.hh"
+#include "div/operators.hh"
+#include "div/perfcount.hh"
+#include "div/profiler.hh"
+#include "div/scan.hh"
+#include "div/source.hh"
+#include "div/split.hh"
+#include "div/symbol.hh"
+#include "div/timing.hh"
+#include "div/worklist.hh"
 
 using namespace llvm;
 using namespace llvm::orc;
@@ -49,7 +65,13 @@ enum Token {
   tok_unary = -12,
 
   // var definition
-  tok_var = -13
+  tok_var = -13,
+
+  // malformed input, already diagnosed by the lexer
+  tok_error = -14,
+
+  // a REPL command, a line holding only ':' and its name
+  tok_command = -15
 };
 
 std::string getTokName(int Tok) {
@@ -80,133 +102,302 @@ std::string getTokName(int Tok) {
     return "unary";
   case tok_var:
     return "var";
+  case tok_error:
+    return "error";
+  case tok_command:
+    return "command";
   }
   return std::string(1, (char)Tok);
 }
 
+/// Keywords - The reserved words, laid out by KeywordSlots so that
+/// keywordHash sends each to its own slot.  Identifiers are matched against
+/// the single keyword in their slot, if any.
+struct Keyword {
+  const char *Spelling;
+  int Tok;
+};
+static constexpr Keyword Keywords[] = {
+    {"def", tok_def},       {"extern", tok_extern}, {"if", tok_if},
+    {"then", tok_then},     {"else", tok_else},     {"for", tok_for},
+    {"in", tok_in},         {"binary", tok_binary}, {"unary", tok_unary},
+    {"var", tok_var},
+};
+enum { NumKeywords = sizeof(Keywords) / sizeof(Keywords[0]) };
+
+/// keywordHash - Perfect over Keywords; every keyword has at least two chars.
+static constexpr unsigned keywordHash(const char *S, size_t Len) {
+  return (Len + (unsigned char)S[0] * 7 + (unsigned char)S[1]) & 15;
+}
+
+static constexpr size_t constStrLen(const char *S) {
+  return *S ? 1 + constStrLen(S + 1) : 0;
+}
+
+struct KeywordTable {
+  signed char Slots[16];
+  unsigned NumFilled;
+
+  constexpr KeywordTable() : Slots(), NumFilled(0) {
+    for (auto &Slot : Slots)
+      Slot = -1;
+    for (int K = 0; K != NumKeywords; ++K) {
+      const char *S = Keywords[K].Spelling;
+      signed char &Slot = Slots[keywordHash(S, constStrLen(S))];
+      NumFilled += Slot == -1;
+      Slot = K;
+    }
+  }
+};
+static constexpr KeywordTable KeywordSlots;
+static_assert(KeywordSlots.NumFilled == NumKeywords,
+              "keywordHash is no longer perfect over the keyword set");
+
+/// getKeyword - Return the token for Ident if it is a keyword, otherwise
+/// tok_identifier.
+static int getKeyword(StringRef Ident) {
+  if (Ident.size() < 2 || Ident.size() > 6)
+    return tok_identifier;
+  int K = KeywordSlots.Slots[keywordHash(Ident.data(), Ident.size())];
+  if (K < 0 || Ident != Keywords[K].Spelling)
+    return tok_identifier;
+  return Keywords[K].Tok;
+}
+
 namespace {
 class PrototypeAST;
 class ExprAST;
 }
 
+struct SourceLocation {
+  size_t Offset;
+};
+
 struct DebugInfo {
+  /// Enabled - Whether to generate debug info at all, under -g.  Without it
+  /// there is no DIBuilder, and the functions below do nothing.
+  bool Enabled = false;
+  /// FileName, Directory - The source file, as the compile unit names it.
+  std::string FileName = "<stdin>";
+  std::string Directory = ".";
   DICompileUnit *TheCU;
   DIType *DblTy;
   std::vector<DIScope *> LexicalBlocks;
 
   void emitLocation(ExprAST *AST);
+  void emitLocation(SourceLocation Loc);
   DIType *getDoubleTy();
 } KSDbgInfo;
 
-struct SourceLocation {
-  int Line;
-  int Col;
-};
-static SourceLocation CurLoc;
-static SourceLocation LexLoc = {1, 0};
+// The lexer and parser state below is per thread, so that several threads can
+// each parse a piece of the same file (see ParseInParallel).
 
-static int advance() {
-  int LastChar = getchar();
+static thread_local SourceLocation CurLoc;
 
-  if (LastChar == '\n' || LastChar == '\r') {
-    LexLoc.Line++;
-    LexLoc.Col = 0;
-  } else
-    LexLoc.Col++;
-  return LastChar;
+/// TheSource - The text being lexed, and LexPos the offset of the next
+/// character the lexer has not yet consumed.  A thread parsing one piece of
+/// the text stops at LexLimit as if the input ended there.
+static std::unique_ptr<SourceBuffer> TheSource;
+static thread_local size_t LexPos;
+static thread_local size_t LexLimit = SIZE_MAX;
+
+/// Identifiers - Every identifier seen so far, interned.  A thread parsing a
+/// piece of the text interns through its own ChunkSymbols instead.
+static SymbolTable Identifiers;
+static thread_local SymbolCache *ChunkSymbols;
+
+/// internSymbol - Intern a name from whichever thread is parsing.
+template <typename... ArgTys> static SymbolID internSymbol(ArgTys... Args) {
+  return ChunkSymbols ? ChunkSymbols->intern(Args...)
+                      : Identifiers.intern(Args...);
 }
 
-static std::string IdentifierStr; // Filled in if tok_identifier
-static double NumVal;             // Filled in if tok_number
+static thread_local StringRef IdentifierStr; // Filled in if tok_identifier
+static thread_local SymbolID IdentifierSym;  // Filled in if tok_identifier
+static thread_local double NumVal;           // Filled in if tok_number
+
+/// Diags - Where a thread parsing a piece of the text collects its error
+/// messages, to be replayed in source order.  Null to print them right away.
+static thread_local raw_ostream *Diags;
+static raw_ostream &diags() { return Diags ? *Diags : errs(); }
+
+/// peekChar - Return the next unconsumed character, or EOF at end of input.
+static int peekChar() {
+  if (LexPos == LexLimit ||
+      (LexPos == TheSource->size() && !TheSource->fill()))
+    return EOF;
+  return (unsigned char)TheSource->begin()[LexPos];
+}
+
+/// lexWhile - Advance LexPos with Scan, which returns the end of the run it
+/// was asked to skip, pulling in more input whenever the run reaches the end
+/// of the buffer.
+static void lexWhile(const char *(*Scan)(const char *, const char *)) {
+  while (true) {
+    const char *End =
+        TheSource->begin() + std::min(LexLimit, TheSource->size());
+    const char *Cur = Scan(TheSource->begin() + LexPos, End);
+    LexPos = Cur - TheSource->begin();
+    if (Cur != End || LexPos == LexLimit || !TheSource->fill())
+      return;
+  }
+}
+
+/// lexCommand - If the ':' at Start is alone on its line but for the name of
+/// a REPL command and whitespace, consume the line, point IdentifierStr at
+/// the name and return true.  Anywhere else ':' is just a character, which a
+/// program may define as an operator.
+static bool lexCommand(size_t Start) {
+  const char *Text = TheSource->begin();
+  for (size_t I = Start; I != 0 && Text[I - 1] != '\n'; --I)
+    if (Text[I - 1] != ' ' && Text[I - 1] != '\t' && Text[I - 1] != '\r')
+      return false;
+
+  LexPos = Start + 1;
+  lexWhile(scanIdentifier);
+  size_t NameEnd = LexPos;
+  int C;
+  while ((C = peekChar()) == ' ' || C == '\t' || C == '\r')
+    ++LexPos;
+  StringRef Name = TheSource->slice(Start + 1, NameEnd);
+  if ((C == '\n' || C == EOF) && Name == "stats") {
+    IdentifierStr = Name;
+    return true;
+  }
+  LexPos = Start;
+  return false;
+}
 
-/// gettok - Return the next token from standard input.
+/// gettok - Return the next token from the source buffer.
 static int gettok() {
-  static int LastChar = ' ';
-
-  // Skip any whitespace.
-  while (isspace(LastChar))
-    LastChar = advance();
-
-  CurLoc = LexLoc;
-
-  if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
-    IdentifierStr = LastChar;
-    while (isalnum((LastChar = advance())))
-      IdentifierStr += LastChar;
-
-    if (IdentifierStr == "def")
-      return tok_def;
-    if (IdentifierStr == "extern")
-      return tok_extern;
-    if (IdentifierStr == "if")
-      return tok_if;
-    if (IdentifierStr == "then")
-      return tok_then;
-    if (IdentifierStr == "else")
-      return tok_else;
-    if (IdentifierStr == "for")
-      return tok_for;
-    if (IdentifierStr == "in")
-      return tok_in;
-    if (IdentifierStr == "binary")
-      return tok_binary;
-    if (IdentifierStr == "unary")
-      return tok_unary;
-    if (IdentifierStr == "var")
-      return tok_var;
-    return tok_identifier;
+  int LastChar;
+  while (true) {
+    // Skip any whitespace.
+    lexWhile(scanSpace);
+
+    LastChar = peekChar();
+    if (LastChar != '#')
+      break;
+
+    // Comment until end of line.
+    lexWhile(scanComment);
   }
 
-  if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
-    std::string NumStr;
-    do {
-      NumStr += LastChar;
-      LastChar = advance();
-    } while (isdigit(LastChar) || LastChar == '.');
+  CurLoc = {LexPos};
+  size_t TokStart = LexPos;
 
-    NumVal = strtod(NumStr.c_str(), nullptr);
-    return tok_number;
+  if (isCharClass(LastChar, CC_Alpha)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
+    lexWhile(scanIdentifier);
+    IdentifierStr = TheSource->slice(TokStart, LexPos);
+
+    int Tok = getKeyword(IdentifierStr);
+    if (Tok == tok_identifier)
+      IdentifierSym = internSymbol(IdentifierStr);
+    return Tok;
   }
 
-  if (LastChar == '#') {
-    // Comment until end of line.
-    do
-      LastChar = advance();
-    while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+  if (isCharClass(LastChar, CC_Digit | CC_Dot)) { // Number: see number.hh
+    lexWhile(scanNumber);
+
+    // A sign straight after a decimal exponent is part of the literal.
+    StringRef Text = TheSource->slice(TokStart, LexPos);
+    if ((Text.endswith("e") || Text.endswith("E")) &&
+        !Text.startswith_insensitive("0x")) {
+      int Sign = peekChar();
+      if (Sign == '+' || Sign == '-') {
+        ++LexPos;
+        lexWhile(scanNumber);
+        Text = TheSource->slice(TokStart, LexPos);
+      }
+    }
 
-    if (LastChar != EOF)
-      return gettok();
+    if (Text == ".")
+      return '.';
+    if (!parseNumber(Text, NumVal)) {
+      diags() << "Error: malformed number literal '" << Text << "'\n";
+      return tok_error;
+    }
+    return tok_number;
   }
 
   // Check for end of file.  Don't eat the EOF.
   if (LastChar == EOF)
     return tok_eof;
 
+  if (LastChar == ':' && lexCommand(TokStart))
+    return tok_command;
+
   // Otherwise, just return the character as its ascii value.
-  int ThisChar = LastChar;
-  LastChar = advance();
-  return ThisChar;
+  ++LexPos;
+  return LastChar;
 }
 
 //===----------------------------------------------------------------------===//
 // Abstract Syntax Tree (aka Parse Tree)
 //===----------------------------------------------------------------------===//
+
+/// ASTArena - Holds the expression nodes of the top-level item being parsed.
+/// The driver resets it once the item has been code generated, or has failed
+/// to parse, which frees every node in one go.  A thread parsing a piece of
+/// the text points it at an arena that lives as long as the piece.
+static BumpPtrAllocator ItemArena;
+static thread_local BumpPtrAllocator *ASTArena = &ItemArena;
+static thread_local size_t NumASTNodes;
+
+/// newNode - Allocate an expression node in ASTArena.
+template <typename T, typename... ArgTys> static T *newNode(ArgTys &&...Args) {
+  ++NumASTNodes;
+  return new (ASTArena->Allocate<T>()) T(std::forward<ArgTys>(Args)...);
+}
+
+/// copyToArena - Move a list the parser has built up into ASTArena.
+template <typename T> static ArrayRef<T> copyToArena(ArrayRef<T> Elts) {
+  T *Mem = ASTArena->Allocate<T>(Elts.size());
+  std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+  return makeArrayRef(Mem, Elts.size());
+}
+
 namespace {
 
 raw_ostream &indent(raw_ostream &O, int size) {
   return O << std::string(size, ' ');
 }
 
-/// ExprAST - Base class for all expression nodes.
+class ExprAST;
+typedef CodegenStack<ExprAST *> ExprStack;
+typedef CodegenFrame<ExprAST *> ExprFrame;
+typedef CodegenStep<ExprAST *> ExprStep;
+
+/// ExprAST - Base class for all expression nodes.  Nodes are allocated in
+/// ASTArena and released with it, never destroyed one by one, so no node may
+/// own anything that needs a destructor.  Each knows its kind, for isa<> and
+/// cast<>, since LLVM is built without RTTI.
 class ExprAST {
+public:
+  enum ExprKind {
+    EK_Number,
+    EK_Variable,
+    EK_Unary,
+    EK_Binary,
+    EK_Call,
+    EK_If,
+    EK_For,
+    EK_Var
+  };
+
+private:
+  ExprKind Kind;
   SourceLocation Loc;
 
 public:
-  ExprAST(SourceLocation Loc = CurLoc) : Loc(Loc) {}
-  virtual ~ExprAST() {}
-  virtual Value *codegen() = 0;
-  int getLine() const { return Loc.Line; }
-  int getCol() const { return Loc.Col; }
+  ExprAST(ExprKind Kind, SourceLocation Loc = CurLoc) : Kind(Kind), Loc(Loc) {}
+  ExprKind getKind() const { return Kind; }
+  /// codegen - Take the next step generating code for this node, whose frame
+  /// is F, given V, the value of the operand asked for last (see runCodegen).
+  virtual ExprStep codegen(ExprStack &S, ExprFrame &F, Value *V) = 0;
+  SourceLocation getLoc() const { return Loc; }
+  int getLine() const { return TheSource->getLineAndColumn(Loc.Offset).first; }
+  int getCol() const { return TheSource->getLineAndColumn(Loc.Offset).second; }
   virtual raw_ostream &dump(raw_ostream &out, int ind) {
     return out << ':' << getLine() << ':' << getCol() << '\n';
   }
@@ -217,36 +408,37 @@ class NumberExprAST : public ExprAST {
   double Val;
 
 public:
-  NumberExprAST(double Val) : Val(Val) {}
+  NumberExprAST(double Val) : ExprAST(EK_Number), Val(Val) {}
   raw_ostream &dump(raw_ostream &out, int ind) override {
     return ExprAST::dump(out << Val, ind);
   }
-  Value *codegen() override;
+  ExprStep codegen(ExprStack &S, ExprFrame &F, Value *V) override;
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
 class VariableExprAST : public ExprAST {
-  std::string Name;
+  SymbolID Name;
 
 public:
-  VariableExprAST(SourceLocation Loc, const std::string &Name)
-      : ExprAST(Loc), Name(Name) {}
-  const std::string &getName() const { return Name; }
-  Value *codegen() override;
+  VariableExprAST(SourceLocation Loc, SymbolID Name)
+      : ExprAST(EK_Variable, Loc), Name(Name) {}
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Variable; }
+  SymbolID getName() const { return Name; }
+  ExprStep codegen(ExprStack &S, ExprFrame &F, Value *V) override;
   raw_ostream &dump(raw_ostream &out, int ind) override {
-    return ExprAST::dump(out << Name, ind);
+    return ExprAST::dump(out << Identifiers.getName(Name), ind);
   }
 };
 
 /// UnaryExprAST - Expression class for a unary operator.
 class UnaryExprAST : public ExprAST {
   char Opcode;
-  std::unique_ptr<ExprAST> Operand;
+  ExprAST *Operand;
 
 public:
-  UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
-      : Opcode(Opcode), Operand(std::move(Operand)) {}
-  Value *codegen() override;
+  UnaryExprAST(char Opcode, ExprAST *Operand)
+      : ExprAST(EK_Unary), Opcode(Opcode), Operand(Operand) {}
+  ExprStep codegen(ExprStack &S, ExprFrame &F, Value *V) override;
   raw_ostream &dump(raw_ostream &out, int ind) override {
     ExprAST::dump(out << "unary" << Opcode, ind);
     Operand->dump(out, ind + 1);
@@ -257,13 +449,12 @@ public:
 /// BinaryExprAST - Expression class for a binary operator.
 class BinaryExprAST : public ExprAST {
   char Op;
-  std::unique_ptr<ExprAST> LHS, RHS;
+  ExprAST *LHS, *RHS;
 
 public:
-  BinaryExprAST(SourceLocation Loc, char Op, std::unique_ptr<ExprAST> LHS,
-                std::unique_ptr<ExprAST> RHS)
-      : ExprAST(Loc), Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-  Value *codegen() override;
+  BinaryExprAST(SourceLocation Loc, char Op, ExprAST *LHS, ExprAST *RHS)
+      : ExprAST(EK_Binary, Loc), Op(Op), LHS(LHS), RHS(RHS) {}
+  ExprStep codegen(ExprStack &S, ExprFrame &F, Value *V) override;
   raw_ostream &dump(raw_ostream &out, int ind) override {
     ExprAST::dump(out << "binary" << Op, ind);
     LHS->dump(indent(out, ind) << "LHS:", ind + 1);
@@ -274,16 +465,15 @@ public:
 
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST {
-  std::string Callee;
-  std::vector<std::unique_ptr<ExprAST>> Args;
+  SymbolID Callee;
+  ArrayRef<ExprAST *> Args;
 
 public:
-  CallExprAST(SourceLocation Loc, const std::string &Callee,
-              std::vector<std::unique_ptr<ExprAST>> Args)
-      : ExprAST(Loc), Callee(Callee), Args(std::move(Args)) {}
-  Value *codegen() override;
+  CallExprAST(SourceLocation Loc, SymbolID Callee, ArrayRef<ExprAST *> Args)
+      : ExprAST(EK_Call, Loc), Callee(Callee), Args(Args) {}
+  ExprStep codegen(ExprStack &S, ExprFrame &F, Value *V) override;
   raw_ostream &dump(raw_ostream &out, int ind) override {
-    ExprAST::dump(out << "call " << Callee, ind);
+    ExprAST::dump(out << "call " << Identifiers.getName(Callee), ind);
     for (const auto &Arg : Args)
       Arg->dump(indent(out, ind + 1), ind + 1);
     return out;
@@ -292,14 +482,12 @@ public:
 
 /// IfExprAST - Expression class for if/then/else.
 class IfExprAST : public ExprAST {
-  std::unique_ptr<ExprAST> Cond, Then, Else;
+  ExprAST *Cond, *Then, *Else;
 
 public:
-  IfExprAST(SourceLocation Loc, std::unique_ptr<ExprAST> Cond,
-            std::unique_ptr<ExprAST> Then, std::unique_ptr<ExprAST> Else)
-      : ExprAST(Loc), Cond(std::move(Cond)), Then(std::move(Then)),
-        Else(std::move(Else)) {}
-  Value *codegen() override;
+  IfExprAST(SourceLocation Loc, ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+      : ExprAST(EK_If, Loc), Cond(Cond), Then(Then), Else(Else) {}
+  ExprStep codegen(ExprStack &S, ExprFrame &F, Value *V) override;
   raw_ostream &dump(raw_ostream &out, int ind) override {
     ExprAST::dump(out << "if", ind);
     Cond->dump(indent(out, ind) << "Cond:", ind + 1);
@@ -311,16 +499,15 @@ public:
 
 /// ForExprAST - Expression class for for/in.
 class ForExprAST : public ExprAST {
-  std::string VarName;
-  std::unique_ptr<ExprAST> Start, End, Step, Body;
+  SymbolID VarName;
+  ExprAST *Start, *End, *Step, *Body;
 
 public:
-  ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
-             std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-             std::unique_ptr<ExprAST> Body)
-      : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-        Step(std::move(Step)), Body(std::move(Body)) {}
-  Value *codegen() override;
+  ForExprAST(SymbolID VarName, ExprAST *Start, ExprAST *End, ExprAST *Step,
+             ExprAST *Body)
+      : ExprAST(EK_For), VarName(VarName), Start(Start), End(End), Step(Step),
+        Body(Body) {}
+  ExprStep codegen(ExprStack &S, ExprFrame &F, Value *V) override;
   raw_ostream &dump(raw_ostream &out, int ind) override {
     ExprAST::dump(out << "for", ind);
     Start->dump(indent(out, ind) << "Cond:", ind + 1);
@@ -333,19 +520,19 @@ public:
 
 /// VarExprAST - Expression class for var/in
 class VarExprAST : public ExprAST {
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
-  std::unique_ptr<ExprAST> Body;
+  ArrayRef<std::pair<SymbolID, ExprAST *>> VarNames;
+  ExprAST *Body;
 
 public:
-  VarExprAST(
-      std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-      std::unique_ptr<ExprAST> Body)
-      : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
-  Value *codegen() override;
+  VarExprAST(ArrayRef<std::pair<SymbolID, ExprAST *>> VarNames, ExprAST *Body)
+      : ExprAST(EK_Var), VarNames(VarNames), Body(Body) {}
+  ExprStep codegen(ExprStack &S, ExprFrame &F, Value *V) override;
   raw_ostream &dump(raw_ostream &out, int ind) override {
     ExprAST::dump(out << "var", ind);
     for (const auto &NamedVar : VarNames)
-      NamedVar.second->dump(indent(out, ind) << NamedVar.first << ':', ind + 1);
+      NamedVar.second->dump(
+          indent(out, ind) << Identifiers.getName(NamedVar.first) << ':',
+          ind + 1);
     Body->dump(indent(out, ind) << "Body:", ind + 1);
     return out;
   }
@@ -355,48 +542,157 @@ public:
 /// which captures its name, and its argument names (thus implicitly the number
 /// of arguments the function takes), as well as if it is an operator.
 class PrototypeAST {
-  std::string Name;
-  std::vector<std::string> Args;
+  SymbolID Name;
+  std::vector<SymbolID> Args;
   bool IsOperator;
   unsigned Precedence; // Precedence if a binary op.
-  int Line;
+  SourceLocation Loc;
 
 public:
-  PrototypeAST(SourceLocation Loc, const std::string &Name,
-               std::vector<std::string> Args, bool IsOperator = false,
+  PrototypeAST(SourceLocation Loc, SymbolID Name, std::vector<SymbolID> Args,
+               bool IsOperator = false,
                unsigned Prec = 0)
       : Name(Name), Args(std::move(Args)), IsOperator(IsOperator),
-        Precedence(Prec), Line(Loc.Line) {}
+        Precedence(Prec), Loc(Loc) {}
   Function *codegen();
-  const std::string &getName() const { return Name; }
+  StringRef getName() const { return Identifiers.getName(Name); }
+  SymbolID getSymbol() const { return Name; }
+  ArrayRef<SymbolID> getArgs() const { return Args; }
 
   bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
   bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
 
   char getOperatorName() const {
     assert(isUnaryOp() || isBinaryOp());
-    return Name[Name.size() - 1];
+    return getName().back();
   }
 
   unsigned getBinaryPrecedence() const { return Precedence; }
-  int getLine() const { return Line; }
+  int getLine() const { return TheSource->getLineAndColumn(Loc.Offset).first; }
+};
+
+/// TreeBuilder - Has the parser build its expressions as a tree of ExprAST
+/// nodes in ASTArena, code generated through their virtual codegen().
+struct TreeBuilder {
+  typedef ExprAST *Expr;
+
+  static Expr number(double Val) { return newNode<NumberExprAST>(Val); }
+  static Expr variable(SourceLocation Loc, SymbolID Name) {
+    return newNode<VariableExprAST>(Loc, Name);
+  }
+  static Expr unary(char Opcode, Expr Operand) {
+    return newNode<UnaryExprAST>(Opcode, Operand);
+  }
+  static Expr binary(SourceLocation Loc, char Op, Expr LHS, Expr RHS) {
+    return newNode<BinaryExprAST>(Loc, Op, LHS, RHS);
+  }
+  static Expr call(SourceLocation Loc, SymbolID Callee, ArrayRef<Expr> Args) {
+    return newNode<CallExprAST>(Loc, Callee, copyToArena(Args));
+  }
+  static Expr ifExpr(SourceLocation Loc, Expr Cond, Expr Then, Expr Else) {
+    return newNode<IfExprAST>(Loc, Cond, Then, Else);
+  }
+  static Expr forExpr(SymbolID VarName, Expr Start, Expr End, Expr Step,
+                      Expr Body) {
+    return newNode<ForExprAST>(VarName, Start, End, Step, Body);
+  }
+  static Expr varExpr(ArrayRef<std::pair<SymbolID, Expr>> VarNames,
+                      Expr Body) {
+    return newNode<VarExprAST>(copyToArena(VarNames), Body);
+  }
+
+  /// foldConstants - Nothing to do; IRBuilder folds constant operands as the
+  /// tree is code generated.
+  static void foldConstants() {}
+  static Value *codegen(Expr E) {
+    return runCodegen(E, [](ExprStack &S, ExprFrame &F, Value *V) {
+      return F.E->codegen(S, F, V);
+    });
+  }
+  static SourceLocation getLoc(Expr E) { return E->getLoc(); }
+  static raw_ostream &dump(raw_ostream &out, Expr E, int ind) {
+    return E ? E->dump(out, ind) : out << "null\n";
+  }
+
+  /// reset - Free every node built so far.
+  static void reset() { ASTArena->Reset(); }
+};
+
+/// FlatNodes - The flat expressions of the top-level item being parsed, or
+/// like ASTArena, of the piece of text this thread is parsing.
+static FlatAST ItemFlatNodes;
+static thread_local FlatAST *FlatNodes = &ItemFlatNodes;
+
+/// FlatBuilder - Has the parser append its expressions to FlatNodes, which
+/// are folded and code generated by switching on the node kind.  Nodes record
+/// the same locations the ExprAST constructors would.
+struct FlatBuilder {
+  typedef NodeRef Expr;
+
+  static Expr number(double Val) {
+    ++NumASTNodes;
+    return FlatNodes->addNumber(CurLoc.Offset, Val);
+  }
+  static Expr variable(SourceLocation Loc, SymbolID Name) {
+    ++NumASTNodes;
+    return FlatNodes->addVariable(Loc.Offset, Name);
+  }
+  static Expr unary(char Opcode, Expr Operand) {
+    ++NumASTNodes;
+    return FlatNodes->addUnary(CurLoc.Offset, Opcode, Operand);
+  }
+  static Expr binary(SourceLocation Loc, char Op, Expr LHS, Expr RHS) {
+    ++NumASTNodes;
+    return FlatNodes->addBinary(Loc.Offset, Op, LHS, RHS);
+  }
+  static Expr call(SourceLocation Loc, SymbolID Callee, ArrayRef<Expr> Args) {
+    ++NumASTNodes;
+    return FlatNodes->addCall(Loc.Offset, Callee, Args);
+  }
+  static Expr ifExpr(SourceLocation Loc, Expr Cond, Expr Then, Expr Else) {
+    ++NumASTNodes;
+    return FlatNodes->addIf(Loc.Offset, Cond, Then, Else);
+  }
+  static Expr forExpr(SymbolID VarName, Expr Start, Expr End, Expr Step,
+                      Expr Body) {
+    ++NumASTNodes;
+    return FlatNodes->addFor(CurLoc.Offset, VarName, Start, End, Step, Body);
+  }
+  static Expr varExpr(ArrayRef<std::pair<SymbolID, Expr>> VarNames,
+                      Expr Body) {
+    ++NumASTNodes;
+    return FlatNodes->addVar(CurLoc.Offset, VarNames, Body);
+  }
+
+  static void foldConstants() { FlatNodes->foldConstants(); }
+  static Value *codegen(Expr E);
+
+  typedef CodegenStack<NodeRef> Stack;
+  typedef CodegenFrame<NodeRef> Frame;
+  typedef CodegenStep<NodeRef> Step;
+  static Step codegenStep(Stack &S, Frame &F, Value *V);
+  static SourceLocation getLoc(Expr E) { return {FlatNodes->getLoc(E)}; }
+  static raw_ostream &dump(raw_ostream &out, Expr E, int ind);
+
+  static void reset() { FlatNodes->clear(); }
 };
 
-/// FunctionAST - This class represents a function definition itself.
-class FunctionAST {
+/// FunctionAST - This class represents a function definition itself, with a
+/// body built by B.
+template <typename B> class FunctionAST {
   std::unique_ptr<PrototypeAST> Proto;
-  std::unique_ptr<ExprAST> Body;
+  typename B::Expr Body;
 
 public:
-  FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-              std::unique_ptr<ExprAST> Body)
-      : Proto(std::move(Proto)), Body(std::move(Body)) {}
+  FunctionAST(std::unique_ptr<PrototypeAST> Proto, typename B::Expr Body)
+      : Proto(std::move(Proto)), Body(Body) {}
   Function *codegen();
+  const PrototypeAST &getProto() const { return *Proto; }
   raw_ostream &dump(raw_ostream &out, int ind) {
     indent(out, ind) << "FunctionAST\n";
     ++ind;
     indent(out, ind) << "Body:";
-    return Body ? Body->dump(out, ind) : out << "null\n";
+    return B::dump(out, Body, ind);
   }
 };
 } // end anonymous namespace
@@ -407,29 +703,34 @@ public:
 
 /// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
 /// token the parser is looking at.  getNextToken reads another token from the
-/// lexer and updates CurTok with its results.
-static int CurTok;
-static int getNextToken() { return CurTok = gettok(); }
+/// lexer and updates CurTok with its results.  With phase timing on, the time
+/// it takes is charged to lexing.
+static thread_local int CurTok;
+static int getNextToken() {
+  if (!TheTimer.Enabled)
+    return CurTok = gettok();
+  PhaseClock::time_point Start = PhaseClock::now();
+  CurTok = gettok();
+  PhaseScope::chargeLexing((PhaseClock::now() - Start).count());
+  return CurTok;
+}
+
+/// ItemStart - The offset of the top-level item being parsed, which decides
+/// which user-defined operators it can see.
+static thread_local uint64_t ItemStart = UINT64_MAX;
 
-/// BinopPrecedence - This holds the precedence for each binary operator that is
-/// defined.
-static std::map<char, int> BinopPrecedence;
+/// Operators - This holds the precedence and properties of each binary
+/// operator that is defined.
+static OperatorTable Operators;
 
 /// GetTokPrecedence - Get the precedence of the pending binary operator token.
 static int GetTokPrecedence() {
-  if (!isascii(CurTok))
-    return -1;
-
-  // Make sure it's a declared binop.
-  int TokPrec = BinopPrecedence[CurTok];
-  if (TokPrec <= 0)
-    return -1;
-  return TokPrec;
+  return Operators.getPrecedence(CurTok, ItemStart);
 }
 
 /// LogError* - These are little helper functions for error handling.
-std::unique_ptr<ExprAST> LogError(const char *Str) {
-  fprintf(stderr, "Error: %s\n", Str);
+std::nullptr_t LogError(const char *Str) {
+  diags() << "Error: " << Str << '\n';
   return nullptr;
 }
 
@@ -438,281 +739,390 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
   return nullptr;
 }
 
-static std::unique_ptr<ExprAST> ParseExpression();
-
-/// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-  auto Result = std::make_unique<NumberExprAST>(NumVal);
-  getNextToken(); // consume the number
-  return std::move(Result);
-}
+/// ExprParser - Parses an expression with an explicit stack in place of
+/// recursive descent, so that nesting depth costs heap rather than C++ stack.
+/// Each frame on the stack is a construct waiting for the operand being
+/// parsed, at the point where the recursive parser would have called itself;
+/// once the operand is complete, the frame on top takes it.
+template <typename B> class ExprParser {
+  typedef typename B::Expr Expr;
+
+  struct Frame {
+    enum FrameKind { Binary, Unary, Paren, Call, If, For, Var } Kind;
+    unsigned Stage = 0;
+    int MinPrec = 0;     // Binary: the loosest operator it may consume.
+    int Op = 0;          // Binary, Unary: the pending operator.
+    int OpPrec = 0;      // Binary: the pending operator's precedence.
+    SourceLocation Loc;  // Binary: the operator's location; Call, If: its own.
+    SymbolID Name = 0;   // Call: the callee; For, Var: the variable.
+    size_t Saved = 0;    // Call, Var: where its entries in Args/Vars start.
+    Expr Ops[3] = {};    // Operands taken so far.
+
+    explicit Frame(FrameKind Kind) : Kind(Kind), Loc(CurLoc) {}
+  };
+
+  SmallVector<Frame, 16> Stack;
+  SmallVector<Expr, 8> Args;
+  SmallVector<std::pair<SymbolID, Expr>, 4> Vars;
+
+  /// beginExpression - Push a frame for a nested expression.  Returns true,
+  /// for "parse the unary expression it starts with next".
+  bool beginExpression() {
+    Stack.push_back(Frame(Frame::Binary));
+    return true;
+  }
 
-/// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-  getNextToken(); // eat (.
-  auto V = ParseExpression();
-  if (!V)
-    return nullptr;
+  /// enter - Push F, which waits for the nested expression begun after it.
+  bool enter(const Frame &F) {
+    Stack.push_back(F);
+    return beginExpression();
+  }
 
-  if (CurTok != ')')
-    return LogError("expected ')'");
-  getNextToken(); // eat ).
-  return V;
-}
+  /// fail - Report an error.  Leaves E null, which ends the parse.
+  bool fail(Expr &E, const char *Str) {
+    E = LogError(Str);
+    return false;
+  }
 
-/// identifierexpr
-///   ::= identifier
-///   ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string IdName = IdentifierStr;
+  // Each parse function below either completes an operand, storing it in E
+  // and returning false, or pushes frames and returns true, to parse next the
+  // unary expression that starts the operand the innermost frame waits for.
 
-  SourceLocation LitLoc = CurLoc;
+  /// numberexpr ::= number
+  bool parseNumberExpr(Expr &E) {
+    E = B::number(NumVal);
+    getNextToken(); // consume the number
+    return false;
+  }
 
-  getNextToken(); // eat identifier.
+  /// parenexpr ::= '(' expression ')'
+  bool parseParenExpr() {
+    getNextToken(); // eat (.
+    return enter(Frame(Frame::Paren));
+  }
 
-  if (CurTok != '(') // Simple variable ref.
-    return std::make_unique<VariableExprAST>(LitLoc, IdName);
+  /// identifierexpr
+  ///   ::= identifier
+  ///   ::= identifier '(' expression* ')'
+  bool parseIdentifierExpr(Expr &E) {
+    Frame F(Frame::Call);
+    F.Name = IdentifierSym;
 
-  // Call.
-  getNextToken(); // eat (
-  std::vector<std::unique_ptr<ExprAST>> Args;
-  if (CurTok != ')') {
-    while (true) {
-      if (auto Arg = ParseExpression())
-        Args.push_back(std::move(Arg));
-      else
-        return nullptr;
+    getNextToken(); // eat identifier.
 
-      if (CurTok == ')')
-        break;
+    if (CurTok != '(') { // Simple variable ref.
+      E = B::variable(F.Loc, F.Name);
+      return false;
+    }
 
-      if (CurTok != ',')
-        return LogError("Expected ')' or ',' in argument list");
-      getNextToken();
+    // Call.
+    getNextToken(); // eat (
+    if (CurTok == ')') {
+      getNextToken(); // eat ).
+      E = B::call(F.Loc, F.Name, ArrayRef<Expr>());
+      return false;
     }
+    F.Saved = Args.size();
+    return enter(F);
   }
 
-  // Eat the ')'.
-  getNextToken();
-
-  return std::make_unique<CallExprAST>(LitLoc, IdName, std::move(Args));
-}
-
-/// ifexpr ::= 'if' expression 'then' expression 'else' expression
-static std::unique_ptr<ExprAST> ParseIfExpr() {
-  SourceLocation IfLoc = CurLoc;
-
-  getNextToken(); // eat the if.
-
-  // condition.
-  auto Cond = ParseExpression();
-  if (!Cond)
-    return nullptr;
-
-  if (CurTok != tok_then)
-    return LogError("expected then");
-  getNextToken(); // eat the then
-
-  auto Then = ParseExpression();
-  if (!Then)
-    return nullptr;
-
-  if (CurTok != tok_else)
-    return LogError("expected else");
-
-  getNextToken();
-
-  auto Else = ParseExpression();
-  if (!Else)
-    return nullptr;
+  /// ifexpr ::= 'if' expression 'then' expression 'else' expression
+  bool parseIfExpr() {
+    Frame F(Frame::If);
+    getNextToken(); // eat the if.
+    return enter(F); // condition.
+  }
 
-  return std::make_unique<IfExprAST>(IfLoc, std::move(Cond), std::move(Then),
-                                      std::move(Else));
-}
+  /// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+  bool parseForExpr(Expr &E) {
+    getNextToken(); // eat the for.
 
-/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-static std::unique_ptr<ExprAST> ParseForExpr() {
-  getNextToken(); // eat the for.
+    if (CurTok != tok_identifier)
+      return fail(E, "expected identifier after for");
 
-  if (CurTok != tok_identifier)
-    return LogError("expected identifier after for");
+    Frame F(Frame::For);
+    F.Name = IdentifierSym;
+    getNextToken(); // eat identifier.
 
-  std::string IdName = IdentifierStr;
-  getNextToken(); // eat identifier.
+    if (CurTok != '=')
+      return fail(E, "expected '=' after for");
+    getNextToken(); // eat '='.
 
-  if (CurTok != '=')
-    return LogError("expected '=' after for");
-  getNextToken(); // eat '='.
+    return enter(F);
+  }
 
-  auto Start = ParseExpression();
-  if (!Start)
-    return nullptr;
-  if (CurTok != ',')
-    return LogError("expected ',' after for start value");
-  getNextToken();
+  /// varexpr ::= 'var' identifier ('=' expression)?
+  //                    (',' identifier ('=' expression)?)* 'in' expression
+  bool parseVarExpr(Expr &E) {
+    getNextToken(); // eat the var.
 
-  auto End = ParseExpression();
-  if (!End)
-    return nullptr;
+    // At least one variable name is required.
+    if (CurTok != tok_identifier)
+      return fail(E, "expected identifier after var");
 
-  // The step value is optional.
-  std::unique_ptr<ExprAST> Step;
-  if (CurTok == ',') {
-    getNextToken();
-    Step = ParseExpression();
-    if (!Step)
-      return nullptr;
+    Frame F(Frame::Var);
+    F.Saved = Vars.size();
+    Stack.push_back(F);
+    return parseVarNames(E, /*AtName=*/true);
   }
 
-  if (CurTok != tok_in)
-    return LogError("expected 'in' after for");
-  getNextToken(); // eat 'in'.
-
-  auto Body = ParseExpression();
-  if (!Body)
-    return nullptr;
-
-  return std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End),
-                                       std::move(Step), std::move(Body));
-}
+  /// parseVarNames - Parse the rest of the var list up to and including 'in',
+  /// for the Var frame on top, stopping at each initializer.  AtName is false
+  /// when resuming after an initializer.
+  bool parseVarNames(Expr &E, bool AtName) {
+    Frame &F = Stack.back();
+    while (true) {
+      if (AtName) {
+        SymbolID Name = IdentifierSym;
+        getNextToken(); // eat identifier.
+
+        // Read the optional initializer.
+        if (CurTok == '=') {
+          getNextToken(); // eat the '='.
+          F.Name = Name;
+          F.Stage = 1;
+          return beginExpression();
+        }
+        Vars.push_back(std::make_pair(Name, Expr()));
+      }
+      AtName = true;
+
+      // End of var list, exit loop.
+      if (CurTok != ',')
+        break;
+      getNextToken(); // eat the ','.
 
-/// varexpr ::= 'var' identifier ('=' expression)?
-//                    (',' identifier ('=' expression)?)* 'in' expression
-static std::unique_ptr<ExprAST> ParseVarExpr() {
-  getNextToken(); // eat the var.
+      if (CurTok != tok_identifier)
+        return fail(E, "expected identifier list after var");
+    }
 
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    // At this point, we have to have 'in'.
+    if (CurTok != tok_in)
+      return fail(E, "expected 'in' keyword after 'var'");
+    getNextToken(); // eat 'in'.
 
-  // At least one variable name is required.
-  if (CurTok != tok_identifier)
-    return LogError("expected identifier after var");
+    F.Stage = 2;
+    return beginExpression();
+  }
 
-  while (true) {
-    std::string Name = IdentifierStr;
-    getNextToken(); // eat identifier.
+  /// primary
+  ///   ::= identifierexpr
+  ///   ::= numberexpr
+  ///   ::= parenexpr
+  ///   ::= ifexpr
+  ///   ::= forexpr
+  ///   ::= varexpr
+  bool parsePrimary(Expr &E) {
+    switch (CurTok) {
+    default:
+      return fail(E, "unknown token when expecting an expression");
+    case tok_error:
+      E = nullptr;
+      return false;
+    case tok_identifier:
+      return parseIdentifierExpr(E);
+    case tok_number:
+      return parseNumberExpr(E);
+    case '(':
+      return parseParenExpr();
+    case tok_if:
+      return parseIfExpr();
+    case tok_for:
+      return parseForExpr(E);
+    case tok_var:
+      return parseVarExpr(E);
+    }
+  }
 
-    // Read the optional initializer.
-    std::unique_ptr<ExprAST> Init = nullptr;
-    if (CurTok == '=') {
-      getNextToken(); // eat the '='.
+  /// unary
+  ///   ::= primary
+  ///   ::= '!' unary
+  bool parseUnary(Expr &E) {
+    // If the current token is not an operator, it must be a primary expr.
+    while (isascii(CurTok) && CurTok != '(' && CurTok != ',') {
+      // If this is a unary operator, read it.
+      Frame F(Frame::Unary);
+      F.Op = CurTok;
+      Stack.push_back(F);
+      getNextToken();
+    }
+    return parsePrimary(E);
+  }
 
-      Init = ParseExpression();
-      if (!Init)
-        return nullptr;
+  /// binoprhs
+  ///   ::= ('+' unary)*
+  ///
+  /// Resumes the Binary frame on top with E, the unary expression it waited
+  /// for, or the result of an operator that binds more tightly.
+  bool resumeBinary(Expr &E) {
+    Frame &F = Stack.back();
+    if (F.Stage == 0) {
+      F.Ops[0] = E;
+    } else if (F.Stage == 1) {
+      // If the pending operator binds less tightly with E than the operator
+      // after E, or as tightly and that operator is right associative, let
+      // the operator after E take it as its LHS.
+      int NextPrec = GetTokPrecedence();
+      bool NextRightAssoc =
+          F.OpPrec == NextPrec &&
+          Operators.lookup(CurTok, ItemStart).isRightAssoc();
+      if (F.OpPrec < NextPrec || NextRightAssoc) {
+        F.Stage = 2;
+        Frame Next(Frame::Binary);
+        Next.MinPrec = NextRightAssoc ? F.OpPrec : F.OpPrec + 1;
+        Stack.push_back(Next);
+        return false; // E is the new frame's LHS.
+      }
+      // Merge LHS/RHS.
+      F.Ops[0] = B::binary(F.Loc, F.Op, F.Ops[0], E);
+    } else {
+      F.Ops[0] = B::binary(F.Loc, F.Op, F.Ops[0], E);
     }
 
-    VarNames.push_back(std::make_pair(Name, std::move(Init)));
+    // If this is a binop that binds at least as tightly as the current binop,
+    // consume it, otherwise we are done.
+    int TokPrec = GetTokPrecedence();
+    if (TokPrec < F.MinPrec) {
+      E = F.Ops[0];
+      Stack.pop_back();
+      return false;
+    }
 
-    // End of var list, exit loop.
-    if (CurTok != ',')
-      break;
-    getNextToken(); // eat the ','.
+    // Okay, we know this is a binop.
+    F.Op = CurTok;
+    F.OpPrec = TokPrec;
+    F.Loc = CurLoc;
+    F.Stage = 1;
+    getNextToken(); // eat binop
 
-    if (CurTok != tok_identifier)
-      return LogError("expected identifier list after var");
+    // Parse the unary expression after the binary operator.
+    return true;
   }
 
-  // At this point, we have to have 'in'.
-  if (CurTok != tok_in)
-    return LogError("expected 'in' keyword after 'var'");
-  getNextToken(); // eat 'in'.
+  /// resume - Hand E, the operand it waited for, to the frame on top.  Either
+  /// the frame wants another, or it is complete: it is popped, and E becomes
+  /// its result.
+  bool resume(Expr &E) {
+    Frame &F = Stack.back();
+    switch (F.Kind) {
+    case Frame::Binary:
+      return resumeBinary(E);
+
+    case Frame::Unary:
+      E = B::unary(F.Op, E);
+      break;
 
-  auto Body = ParseExpression();
-  if (!Body)
-    return nullptr;
+    case Frame::Paren:
+      if (CurTok != ')')
+        return fail(E, "expected ')'");
+      getNextToken(); // eat ).
+      break;
 
-  return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
-}
+    case Frame::Call:
+      Args.push_back(E);
+      if (CurTok == ',') {
+        getNextToken();
+        return beginExpression();
+      }
+      if (CurTok != ')')
+        return fail(E, "Expected ')' or ',' in argument list");
 
-/// primary
-///   ::= identifierexpr
-///   ::= numberexpr
-///   ::= parenexpr
-///   ::= ifexpr
-///   ::= forexpr
-///   ::= varexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
-  switch (CurTok) {
-  default:
-    return LogError("unknown token when expecting an expression");
-  case tok_identifier:
-    return ParseIdentifierExpr();
-  case tok_number:
-    return ParseNumberExpr();
-  case '(':
-    return ParseParenExpr();
-  case tok_if:
-    return ParseIfExpr();
-  case tok_for:
-    return ParseForExpr();
-  case tok_var:
-    return ParseVarExpr();
-  }
-}
+      // Eat the ')'.
+      getNextToken();
 
-/// unary
-///   ::= primary
-///   ::= '!' unary
-static std::unique_ptr<ExprAST> ParseUnary() {
-  // If the current token is not an operator, it must be a primary expr.
-  if (!isascii(CurTok) || CurTok == '(' || CurTok == ',')
-    return ParsePrimary();
+      E = B::call(F.Loc, F.Name, makeArrayRef(Args).drop_front(F.Saved));
+      Args.resize(F.Saved);
+      break;
 
-  // If this is a unary operator, read it.
-  int Opc = CurTok;
-  getNextToken();
-  if (auto Operand = ParseUnary())
-    return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
-  return nullptr;
-}
+    case Frame::If:
+      switch (F.Stage++) {
+      case 0:
+        F.Ops[0] = E;
+        if (CurTok != tok_then)
+          return fail(E, "expected then");
+        getNextToken(); // eat the then
+        return beginExpression();
+
+      case 1:
+        F.Ops[1] = E;
+        if (CurTok != tok_else)
+          return fail(E, "expected else");
+        getNextToken();
+        return beginExpression();
+      }
+      E = B::ifExpr(F.Loc, F.Ops[0], F.Ops[1], E);
+      break;
 
-/// binoprhs
-///   ::= ('+' unary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
-  // If this is a binop, find its precedence.
-  while (true) {
-    int TokPrec = GetTokPrecedence();
+    case Frame::For:
+      switch (F.Stage++) {
+      case 0:
+        F.Ops[0] = E;
+        if (CurTok != ',')
+          return fail(E, "expected ',' after for start value");
+        getNextToken();
+        return beginExpression();
+
+      case 1:
+        F.Ops[1] = E;
+        // The step value is optional.
+        if (CurTok == ',') {
+          getNextToken();
+          return beginExpression();
+        }
+        break;
 
-    // If this is a binop that binds at least as tightly as the current binop,
-    // consume it, otherwise we are done.
-    if (TokPrec < ExprPrec)
-      return LHS;
+      case 2:
+        F.Ops[2] = E;
+        break;
 
-    // Okay, we know this is a binop.
-    int BinOp = CurTok;
-    SourceLocation BinLoc = CurLoc;
-    getNextToken(); // eat binop
+      default:
+        E = B::forExpr(F.Name, F.Ops[0], F.Ops[1], F.Ops[2], E);
+        Stack.pop_back();
+        return false;
+      }
+
+      if (CurTok != tok_in)
+        return fail(E, "expected 'in' after for");
+      getNextToken(); // eat 'in'.
+
+      F.Stage = 3;
+      return beginExpression();
+
+    case Frame::Var:
+      if (F.Stage == 1) {
+        Vars.push_back(std::make_pair(F.Name, E));
+        return parseVarNames(E, /*AtName=*/false);
+      }
+      E = B::varExpr(makeArrayRef(Vars).drop_front(F.Saved), E);
+      Vars.resize(F.Saved);
+      break;
+    }
 
-    // Parse the unary expression after the binary operator.
-    auto RHS = ParseUnary();
-    if (!RHS)
-      return nullptr;
+    Stack.pop_back();
+    return false;
+  }
 
-    // If BinOp binds less tightly with RHS than the operator after RHS, let
-    // the pending operator take RHS as its LHS.
-    int NextPrec = GetTokPrecedence();
-    if (TokPrec < NextPrec) {
-      RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-      if (!RHS)
+public:
+  /// expression
+  ///   ::= unary binoprhs
+  ///
+  Expr parse() {
+    Expr E = nullptr;
+    bool NeedOperand = beginExpression();
+    while (true) {
+      if (NeedOperand && parseUnary(E))
+        continue;
+      if (!E)
         return nullptr;
+      NeedOperand = resume(E);
+      if (Stack.empty())
+        return E;
     }
-
-    // Merge LHS/RHS.
-    LHS = std::make_unique<BinaryExprAST>(BinLoc, BinOp, std::move(LHS),
-                                           std::move(RHS));
   }
-}
-
-/// expression
-///   ::= unary binoprhs
-///
-static std::unique_ptr<ExprAST> ParseExpression() {
-  auto LHS = ParseUnary();
-  if (!LHS)
-    return nullptr;
+};
 
-  return ParseBinOpRHS(0, std::move(LHS));
+template <typename B> static typename B::Expr ParseExpression() {
+  return ExprParser<B>().parse();
 }
 
 /// prototype
@@ -720,7 +1130,7 @@ static std::unique_ptr<ExprAST> ParseExpression() {
 ///   ::= binary LETTER number? (id, id)
 ///   ::= unary LETTER (id)
 static std::unique_ptr<PrototypeAST> ParsePrototype() {
-  std::string FnName;
+  SymbolID FnName;
 
   SourceLocation FnLoc = CurLoc;
 
@@ -731,7 +1141,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
   default:
     return LogErrorP("Expected function name in prototype");
   case tok_identifier:
-    FnName = IdentifierStr;
+    FnName = IdentifierSym;
     Kind = 0;
     getNextToken();
     break;
@@ -739,8 +1149,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     getNextToken();
     if (!isascii(CurTok))
       return LogErrorP("Expected unary operator");
-    FnName = "unary";
-    FnName += (char)CurTok;
+    FnName = internSymbol("unary", (char)CurTok);
     Kind = 1;
     getNextToken();
     break;
@@ -748,8 +1157,9 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     getNextToken();
     if (!isascii(CurTok))
       return LogErrorP("Expected binary operator");
-    FnName = "binary";
-    FnName += (char)CurTok;
+    if (Operators.lookup(CurTok).isBuiltin())
+      return LogErrorP("Cannot redefine a builtin operator");
+    FnName = internSymbol("binary", (char)CurTok);
     Kind = 2;
     getNextToken();
 
@@ -766,9 +1176,9 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
   if (CurTok != '(')
     return LogErrorP("Expected '(' in prototype");
 
-  std::vector<std::string> ArgNames;
+  std::vector<SymbolID> ArgNames;
   while (getNextToken() == tok_identifier)
-    ArgNames.push_back(IdentifierStr);
+    ArgNames.push_back(IdentifierSym);
   if (CurTok != ')')
     return LogErrorP("Expected ')' in prototype");
 
@@ -784,31 +1194,35 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
 }
 
 /// definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition() {
+template <typename B> static std::unique_ptr<FunctionAST<B>> ParseDefinition() {
+  PhaseScope Timing(PhaseParse);
   getNextToken(); // eat def.
   auto Proto = ParsePrototype();
   if (!Proto)
     return nullptr;
 
-  if (auto E = ParseExpression())
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+  if (auto E = ParseExpression<B>())
+    return std::make_unique<FunctionAST<B>>(std::move(Proto), E);
   return nullptr;
 }
 
 /// toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+template <typename B>
+static std::unique_ptr<FunctionAST<B>> ParseTopLevelExpr() {
+  PhaseScope Timing(PhaseParse);
   SourceLocation FnLoc = CurLoc;
-  if (auto E = ParseExpression()) {
+  if (auto E = ParseExpression<B>()) {
     // Make an anonymous proto.
-    auto Proto = std::make_unique<PrototypeAST>(FnLoc, "__anon_expr",
-                                                 std::vector<std::string>());
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    auto Proto = std::make_unique<PrototypeAST>(
+        FnLoc, internSymbol("__anon_expr"), std::vector<SymbolID>());
+    return std::make_unique<FunctionAST<B>>(std::move(Proto), E);
   }
   return nullptr;
 }
 
 /// external ::= 'extern' prototype
 static std::unique_ptr<PrototypeAST> ParseExtern() {
+  PhaseScope Timing(PhaseParse);
   getNextToken(); // eat extern.
   return ParsePrototype();
 }
@@ -822,9 +1236,19 @@ static std::unique_ptr<Module> TheModule;
 static std::unique_ptr<IRBuilder<>> Builder;
 static ExitOnError ExitOnErr;
 
-static std::map<std::string, AllocaInst *> NamedValues;
+static DenseMap<SymbolID, AllocaInst *> NamedValues;
+/// TheProfileData - Branch and call counts for profile-guided optimization.
+/// It comes before TheJIT, whose code may count into it until it is gone.
+static ProfileData TheProfileData;
 static std::unique_ptr<DivJIT> TheJIT;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+/// AOTTarget - With -emit, the target the input is compiled for, ahead of
+/// time, into the one module; AOTExprs are its top-level expressions.
+static std::unique_ptr<TargetMachine> AOTTarget;
+static std::vector<std::string> AOTExprs;
+static DenseMap<SymbolID, std::unique_ptr<PrototypeAST>> FunctionProtos;
+/// InstrumentCalls - Under -instrument, count the calls to and cycles spent
+/// in every function generated.
+static bool InstrumentCalls;
 
 //===----------------------------------------------------------------------===//
 // Debug Info Support
@@ -841,15 +1265,24 @@ DIType *DebugInfo::getDoubleTy() {
 }
 
 void DebugInfo::emitLocation(ExprAST *AST) {
+  if (!DBuilder)
+    return;
   if (!AST)
     return Builder->SetCurrentDebugLocation(DebugLoc());
+  emitLocation(AST->getLoc());
+}
+
+void DebugInfo::emitLocation(SourceLocation Loc) {
+  if (!DBuilder)
+    return;
   DIScope *Scope;
   if (LexicalBlocks.empty())
     Scope = TheCU;
   else
     Scope = LexicalBlocks.back();
+  auto LineCol = TheSource->getLineAndColumn(Loc.Offset);
   Builder->SetCurrentDebugLocation(DILocation::get(
-      Scope->getContext(), AST->getLine(), AST->getCol(), Scope));
+      Scope->getContext(), LineCol.first, LineCol.second, Scope));
 }
 
 static DISubroutineType *CreateFunctionType(unsigned NumArgs) {
@@ -874,9 +1307,9 @@ Value *LogErrorV(const char *Str) {
   return nullptr;
 }
 
-Function *getFunction(std::string Name) {
+Function *getFunction(SymbolID Name) {
   // First, see if the function has already been added to the current module.
-  if (auto *F = TheModule->getFunction(Name))
+  if (auto *F = TheModule->getFunction(Identifiers.getName(Name)))
     return F;
 
   // If not, check whether we can codegen the declaration from some existing
@@ -898,12 +1331,12 @@ static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
   return TmpB.CreateAlloca(Type::getDoubleTy(*TheContext), nullptr, VarName);
 }
 
-Value *NumberExprAST::codegen() {
+ExprStep NumberExprAST::codegen(ExprStack &, ExprFrame &, Value *) {
   KSDbgInfo.emitLocation(this);
   return ConstantFP::get(*TheContext, APFloat(Val));
 }
 
-Value *VariableExprAST::codegen() {
+ExprStep VariableExprAST::codegen(ExprStack &, ExprFrame &, Value *) {
   // Look this variable up in the function.
   Value *V = NamedValues[Name];
   if (!V)
@@ -911,50 +1344,62 @@ Value *VariableExprAST::codegen() {
 
   KSDbgInfo.emitLocation(this);
   // Load the value.
-  return Builder->CreateLoad(Type::getDoubleTy(*TheContext), V, Name.c_str());
+  return Builder->CreateLoad(Type::getDoubleTy(*TheContext), V,
+                            Identifiers.getName(Name));
 }
 
-Value *UnaryExprAST::codegen() {
-  Value *OperandV = Operand->codegen();
+ExprStep UnaryExprAST::codegen(ExprStack &, ExprFrame &F, Value *OperandV) {
+  if (F.Stage++ == 0)
+    return ExprStep::visit(Operand);
   if (!OperandV)
     return nullptr;
 
-  Function *F = getFunction(std::string("unary") + Opcode);
-  if (!F)
+  Function *Fn = getFunction(Identifiers.intern("unary", Opcode));
+  if (!Fn)
     return LogErrorV("Unknown unary operator");
 
   KSDbgInfo.emitLocation(this);
-  return Builder->CreateCall(F, OperandV, "unop");
+  return Builder->CreateCall(Fn, OperandV, "unop");
 }
 
-Value *BinaryExprAST::codegen() {
-  KSDbgInfo.emitLocation(this);
+ExprStep BinaryExprAST::codegen(ExprStack &, ExprFrame &F, Value *V) {
+  switch (F.Stage++) {
+  case 0:
+    KSDbgInfo.emitLocation(this);
+
+    // Special case '=' because we don't want to emit the LHS as an expression.
+    if (Op == '=') {
+      // Assignment requires the LHS to be an identifier.
+      if (!isa<VariableExprAST>(LHS))
+        return LogErrorV("destination of '=' must be a variable");
+      // Codegen the RHS.
+      F.Stage = 3;
+      return ExprStep::visit(RHS);
+    }
+    return ExprStep::visit(LHS);
 
-  // Special case '=' because we don't want to emit the LHS as an expression.
-  if (Op == '=') {
-    // Assignment requires the LHS to be an identifier.
-    // This assume we're building without RTTI because LLVM builds that way by
-    // default.  If you build LLVM with RTTI this can be changed to a
-    // dynamic_cast for automatic error checking.
-    VariableExprAST *LHSE = static_cast<VariableExprAST *>(LHS.get());
-    if (!LHSE)
-      return LogErrorV("destination of '=' must be a variable");
-    // Codegen the RHS.
-    Value *Val = RHS->codegen();
-    if (!Val)
+  case 1:
+    // An error in the LHS still lets the RHS report its own.
+    F.Vals[0] = V;
+    return ExprStep::visit(RHS);
+
+  case 3: {
+    if (!V)
       return nullptr;
 
     // Look up the name.
-    Value *Variable = NamedValues[LHSE->getName()];
+    Value *Variable =
+        NamedValues[cast<VariableExprAST>(LHS)->getName()];
     if (!Variable)
       return LogErrorV("Unknown variable name");
 
-    Builder->CreateStore(Val, Variable);
-    return Val;
+    Builder->CreateStore(V, Variable);
+    return V;
+  }
   }
 
-  Value *L = LHS->codegen();
-  Value *R = RHS->codegen();
+  Value *L = F.Vals[0];
+  Value *R = V;
   if (!L || !R)
     return nullptr;
 
@@ -975,85 +1420,111 @@ Value *BinaryExprAST::codegen() {
 
   // If it wasn't a builtin binary operator, it must be a user defined one. Emit
   // a call to it.
-  Function *F = getFunction(std::string("binary") + Op);
-  assert(F && "binary operator not found!");
+  Function *Fn = getFunction(Identifiers.intern("binary", Op));
+  assert(Fn && "binary operator not found!");
 
   Value *Ops[] = {L, R};
-  return Builder->CreateCall(F, Ops, "binop");
+  return Builder->CreateCall(Fn, Ops, "binop");
 }
 
-Value *CallExprAST::codegen() {
-  KSDbgInfo.emitLocation(this);
+ExprStep CallExprAST::codegen(ExprStack &S, ExprFrame &F, Value *ArgV) {
+  if (F.Stage++ == 0) {
+    KSDbgInfo.emitLocation(this);
 
-  // Look up the name in the global module table.
-  Function *CalleeF = getFunction(Callee);
-  if (!CalleeF)
-    return LogErrorV("Unknown function referenced");
+    // Look up the name in the global module table.
+    Function *CalleeF = getFunction(Callee);
+    if (!CalleeF)
+      return LogErrorV("Unknown function referenced");
 
-  // If argument mismatch error.
-  if (CalleeF->arg_size() != Args.size())
-    return LogErrorV("Incorrect # arguments passed");
+    // If argument mismatch error.
+    if (CalleeF->arg_size() != Args.size())
+      return LogErrorV("Incorrect # arguments passed");
 
-  std::vector<Value *> ArgsV;
-  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-    ArgsV.push_back(Args[i]->codegen());
-    if (!ArgsV.back())
+    F.Vals[0] = CalleeF;
+    F.Saved = S.Values.size();
+  } else {
+    S.Values.push_back(ArgV);
+    if (!ArgV)
       return nullptr;
+    ++F.Index;
   }
 
-  return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
-}
+  if (F.Index != Args.size())
+    return ExprStep::visit(Args[F.Index]);
 
-Value *IfExprAST::codegen() {
-  KSDbgInfo.emitLocation(this);
+  ArrayRef<Value *> ArgsV = makeArrayRef(S.Values).drop_front(F.Saved);
+  Value *Call =
+      Builder->CreateCall(cast<Function>(F.Vals[0]), ArgsV, "calltmp");
+  S.Values.resize(F.Saved);
+  return Call;
+}
 
-  Value *CondV = Cond->codegen();
-  if (!CondV)
-    return nullptr;
+ExprStep IfExprAST::codegen(ExprStack &, ExprFrame &F, Value *V) {
+  switch (F.Stage++) {
+  case 0:
+    KSDbgInfo.emitLocation(this);
+    return ExprStep::visit(Cond);
 
-  // Convert condition to a bool by comparing non-equal to 0.0.
-  CondV = Builder->CreateFCmpONE(
-      CondV, ConstantFP::get(*TheContext, APFloat(0.0)), "ifcond");
+  case 1: {
+    Value *CondV = V;
+    if (!CondV)
+      return nullptr;
 
-  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    // Convert condition to a bool by comparing non-equal to 0.0.
+    CondV = Builder->CreateFCmpONE(
+        CondV, ConstantFP::get(*TheContext, APFloat(0.0)), "ifcond");
 
-  // Create blocks for the then and else cases.  Insert the 'then' block at the
-  // end of the function.
-  BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
-  BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
-  BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
-  Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+    // Create blocks for the then and else cases.  Insert the 'then' block at
+    // the end of the function.
+    BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
+    BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
+    BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
 
-  // Emit then value.
-  Builder->SetInsertPoint(ThenBB);
+    Builder->CreateCondBr(CondV, ThenBB, ElseBB);
 
-  Value *ThenV = Then->codegen();
-  if (!ThenV)
-    return nullptr;
+    // Emit then value.
+    Builder->SetInsertPoint(ThenBB);
+    F.Blocks[1] = ElseBB;
+    F.Blocks[2] = MergeBB;
+    return ExprStep::visit(Then);
+  }
 
-  Builder->CreateBr(MergeBB);
-  // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-  ThenBB = Builder->GetInsertBlock();
+  case 2: {
+    Value *ThenV = V;
+    if (!ThenV)
+      return nullptr;
 
-  // Emit else block.
-  TheFunction->getBasicBlockList().push_back(ElseBB);
-  Builder->SetInsertPoint(ElseBB);
+    Builder->CreateBr(F.Blocks[2]);
+    // Codegen of 'Then' can change the current block, update ThenBB for the
+    // PHI.
+    F.Blocks[0] = Builder->GetInsertBlock();
+    F.Vals[0] = ThenV;
+
+    // Emit else block.
+    Function *TheFunction = F.Blocks[0]->getParent();
+    TheFunction->getBasicBlockList().push_back(F.Blocks[1]);
+    Builder->SetInsertPoint(F.Blocks[1]);
+    return ExprStep::visit(Else);
+  }
+  }
 
-  Value *ElseV = Else->codegen();
+  Value *ElseV = V;
   if (!ElseV)
     return nullptr;
 
+  BasicBlock *MergeBB = F.Blocks[2];
   Builder->CreateBr(MergeBB);
   // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
-  ElseBB = Builder->GetInsertBlock();
+  BasicBlock *ElseBB = Builder->GetInsertBlock();
 
   // Emit merge block.
-  TheFunction->getBasicBlockList().push_back(MergeBB);
+  ElseBB->getParent()->getBasicBlockList().push_back(MergeBB);
   Builder->SetInsertPoint(MergeBB);
   PHINode *PN = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
 
-  PN->addIncoming(ThenV, ThenBB);
+  PN->addIncoming(F.Vals[0], F.Blocks[0]);
   PN->addIncoming(ElseV, ElseBB);
   return PN;
 }
@@ -1077,64 +1548,85 @@ Value *IfExprAST::codegen() {
 //   store nextvar -> var
 //   br endcond, loop, endloop
 // outloop:
-Value *ForExprAST::codegen() {
-  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+ExprStep ForExprAST::codegen(ExprStack &, ExprFrame &F, Value *V) {
+  switch (F.Stage++) {
+  case 0: {
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
-  // Create an alloca for the variable in the entry block.
-  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+    // Create an alloca for the variable in the entry block.
+    F.Allocas[0] =
+        CreateEntryBlockAlloca(TheFunction, Identifiers.getName(VarName));
 
-  KSDbgInfo.emitLocation(this);
+    KSDbgInfo.emitLocation(this);
 
-  // Emit the start code first, without 'variable' in scope.
-  Value *StartVal = Start->codegen();
-  if (!StartVal)
-    return nullptr;
+    // Emit the start code first, without 'variable' in scope.
+    return ExprStep::visit(Start);
+  }
 
-  // Store the value into the alloca.
-  Builder->CreateStore(StartVal, Alloca);
+  case 1: {
+    Value *StartVal = V;
+    if (!StartVal)
+      return nullptr;
 
-  // Make the new basic block for the loop header, inserting after current
-  // block.
-  BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
+    // Store the value into the alloca.
+    AllocaInst *Alloca = F.Allocas[0];
+    Builder->CreateStore(StartVal, Alloca);
 
-  // Insert an explicit fall through from the current block to the LoopBB.
-  Builder->CreateBr(LoopBB);
+    // Make the new basic block for the loop header, inserting after current
+    // block.
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
+    F.Blocks[0] = LoopBB;
 
-  // Start insertion in LoopBB.
-  Builder->SetInsertPoint(LoopBB);
+    // Insert an explicit fall through from the current block to the LoopBB.
+    Builder->CreateBr(LoopBB);
 
-  // Within the loop, the variable is defined equal to the PHI node.  If it
-  // shadows an existing variable, we have to restore it, so save it now.
-  AllocaInst *OldVal = NamedValues[VarName];
-  NamedValues[VarName] = Alloca;
+    // Start insertion in LoopBB.
+    Builder->SetInsertPoint(LoopBB);
 
-  // Emit the body of the loop.  This, like any other expr, can change the
-  // current BB.  Note that we ignore the value computed by the body, but don't
-  // allow an error.
-  if (!Body->codegen())
-    return nullptr;
+    // Within the loop, the variable is defined equal to the PHI node.  If it
+    // shadows an existing variable, we have to restore it, so save it now.
+    F.Allocas[1] = NamedValues[VarName];
+    NamedValues[VarName] = Alloca;
+
+    // Emit the body of the loop.  This, like any other expr, can change the
+    // current BB.  Note that we ignore the value computed by the body, but
+    // don't allow an error.
+    return ExprStep::visit(Body);
+  }
 
-  // Emit the step value.
-  Value *StepVal = nullptr;
-  if (Step) {
-    StepVal = Step->codegen();
-    if (!StepVal)
+  case 2:
+    if (!V)
       return nullptr;
-  } else {
+
+    // Emit the step value.
+    if (Step)
+      return ExprStep::visit(Step);
+
     // If not specified, use 1.0.
-    StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+    F.Vals[0] = ConstantFP::get(*TheContext, APFloat(1.0));
+    F.Stage = 4;
+    return ExprStep::visit(End);
+
+  case 3:
+    if (!V)
+      return nullptr;
+    F.Vals[0] = V;
+
+    // Compute the end condition.
+    return ExprStep::visit(End);
   }
 
-  // Compute the end condition.
-  Value *EndCond = End->codegen();
+  Value *EndCond = V;
   if (!EndCond)
     return nullptr;
 
   // Reload, increment, and restore the alloca.  This handles the case where
   // the body of the loop mutates the variable.
+  AllocaInst *Alloca = F.Allocas[0];
   Value *CurVar = Builder->CreateLoad(Type::getDoubleTy(*TheContext), Alloca,
-                                      VarName.c_str());
-  Value *NextVar = Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+                                      Identifiers.getName(VarName));
+  Value *NextVar = Builder->CreateFAdd(CurVar, F.Vals[0], "nextvar");
   Builder->CreateStore(NextVar, Alloca);
 
   // Convert condition to a bool by comparing non-equal to 0.0.
@@ -1142,17 +1634,18 @@ Value *ForExprAST::codegen() {
       EndCond, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
 
   // Create the "after loop" block and insert it.
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
   BasicBlock *AfterBB =
       BasicBlock::Create(*TheContext, "afterloop", TheFunction);
 
   // Insert the conditional branch into the end of LoopEndBB.
-  Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+  Builder->CreateCondBr(EndCond, F.Blocks[0], AfterBB);
 
   // Any new code will be inserted in AfterBB.
   Builder->SetInsertPoint(AfterBB);
 
   // Restore the unshadowed variable.
-  if (OldVal)
+  if (AllocaInst *OldVal = F.Allocas[1])
     NamedValues[VarName] = OldVal;
   else
     NamedValues.erase(VarName);
@@ -1161,104 +1654,503 @@ Value *ForExprAST::codegen() {
   return Constant::getNullValue(Type::getDoubleTy(*TheContext));
 }
 
-Value *VarExprAST::codegen() {
-  std::vector<AllocaInst *> OldBindings;
-
+/// bindVariable - Store InitVal to a new variable named VarName, shadowing any
+/// variable of that name until the binding set aside in Bindings is restored.
+static void bindVariable(SymbolID VarName, Value *InitVal,
+                         SmallVectorImpl<AllocaInst *> &Bindings) {
   Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  AllocaInst *Alloca =
+      CreateEntryBlockAlloca(TheFunction, Identifiers.getName(VarName));
+  Builder->CreateStore(InitVal, Alloca);
 
-  // Register all variables and emit their initializer.
-  for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
-    const std::string &VarName = VarNames[i].first;
-    ExprAST *Init = VarNames[i].second.get();
+  // Remember the old variable binding so that we can restore the binding when
+  // we unrecurse.
+  Bindings.push_back(NamedValues[VarName]);
 
+  // Remember this binding.
+  NamedValues[VarName] = Alloca;
+}
+
+ExprStep VarExprAST::codegen(ExprStack &S, ExprFrame &F, Value *V) {
+  switch (F.Stage) {
+  case 0:
+    F.Saved = S.Bindings.size();
+    break;
+
+  case 1:
+    if (!V)
+      return nullptr;
+    bindVariable(VarNames[F.Index++].first, V, S.Bindings);
+    break;
+
+  default: {
+    Value *BodyVal = V;
+    if (!BodyVal)
+      return nullptr;
+
+    // Pop all our variables from scope.
+    for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
+      NamedValues[VarNames[i].first] = S.Bindings[F.Saved + i];
+    S.Bindings.resize(F.Saved);
+
+    // Return the body computation.
+    return BodyVal;
+  }
+  }
+
+  // Register all variables and emit their initializer.
+  for (unsigned e = VarNames.size(); F.Index != e; ++F.Index) {
     // Emit the initializer before adding the variable to scope, this prevents
     // the initializer from referencing the variable itself, and permits stuff
     // like this:
     //  var a = 1 in
     //    var a = a in ...   # refers to outer 'a'.
-    Value *InitVal;
-    if (Init) {
-      InitVal = Init->codegen();
-      if (!InitVal)
-        return nullptr;
-    } else { // If not specified, use 0.0.
-      InitVal = ConstantFP::get(*TheContext, APFloat(0.0));
+    if (ExprAST *Init = VarNames[F.Index].second) {
+      F.Stage = 1;
+      return ExprStep::visit(Init);
     }
 
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-    Builder->CreateStore(InitVal, Alloca);
-
-    // Remember the old variable binding so that we can restore the binding when
-    // we unrecurse.
-    OldBindings.push_back(NamedValues[VarName]);
-
-    // Remember this binding.
-    NamedValues[VarName] = Alloca;
+    // If not specified, use 0.0.
+    bindVariable(VarNames[F.Index].first,
+                 ConstantFP::get(*TheContext, APFloat(0.0)), S.Bindings);
   }
 
   KSDbgInfo.emitLocation(this);
 
   // Codegen the body, now that all vars are in scope.
-  Value *BodyVal = Body->codegen();
-  if (!BodyVal)
-    return nullptr;
-
-  // Pop all our variables from scope.
-  for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
-    NamedValues[VarNames[i].first] = OldBindings[i];
-
-  // Return the body computation.
-  return BodyVal;
+  F.Stage = 2;
+  return ExprStep::visit(Body);
 }
 
 Function *PrototypeAST::codegen() {
+  PhaseScope Timing(PhaseCodegen);
   // Make the function type:  double(double,double) etc.
   std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
   FunctionType *FT =
       FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
 
-  Function *F =
-      Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+  Function *F = Function::Create(FT, Function::ExternalLinkage, getName(),
+                                 TheModule.get());
 
   // Set names for all arguments.
   unsigned Idx = 0;
   for (auto &Arg : F->args())
-    Arg.setName(Args[Idx++]);
+    Arg.setName(Identifiers.getName(Args[Idx++]));
 
   return F;
 }
 
-Function *FunctionAST::codegen() {
+//===----------------------------------------------------------------------===//
+// Flat AST Code Generation
+//===----------------------------------------------------------------------===//
+
+// Each case mirrors the codegen() step function of the matching ExprAST
+// class, and emits exactly the same IR.
+
+Value *FlatBuilder::codegen(NodeRef N) { return runCodegen(N, codegenStep); }
+
+FlatBuilder::Step FlatBuilder::codegenStep(Stack &S, Frame &F, Value *V) {
+  const FlatAST &AST = *FlatNodes;
+  NodeRef N = F.E;
+  SourceLocation Loc = getLoc(N);
+
+  switch (AST.getKind(N)) {
+  case FK_Number:
+    KSDbgInfo.emitLocation(Loc);
+    return ConstantFP::get(*TheContext, APFloat(AST.getNumber(N)));
+
+  case FK_Variable: {
+    SymbolID Name = AST.getVarName(N);
+    Value *Var = NamedValues[Name];
+    if (!Var)
+      return LogErrorV("Unknown variable name");
+    KSDbgInfo.emitLocation(Loc);
+    return Builder->CreateLoad(Type::getDoubleTy(*TheContext), Var,
+                               Identifiers.getName(Name));
+  }
+
+  case FK_Unary: {
+    if (F.Stage++ == 0)
+      return Step::visit(AST.getOperand(N));
+    Value *OperandV = V;
+    if (!OperandV)
+      return nullptr;
+
+    Function *Fn = getFunction(Identifiers.intern("unary", AST.getOp(N)));
+    if (!Fn)
+      return LogErrorV("Unknown unary operator");
+
+    KSDbgInfo.emitLocation(Loc);
+    return Builder->CreateCall(Fn, OperandV, "unop");
+  }
+
+  case FK_Binary: {
+    char Op = AST.getOp(N);
+    switch (F.Stage++) {
+    case 0:
+      KSDbgInfo.emitLocation(Loc);
+
+      // Special case '=' because we don't want to emit the LHS as an
+      // expression.
+      if (Op == '=') {
+        if (AST.getKind(AST.getLHS(N)) != FK_Variable)
+          return LogErrorV("destination of '=' must be a variable");
+        F.Stage = 3;
+        return Step::visit(AST.getRHS(N));
+      }
+      return Step::visit(AST.getLHS(N));
+
+    case 1:
+      F.Vals[0] = V;
+      return Step::visit(AST.getRHS(N));
+
+    case 3: {
+      if (!V)
+        return nullptr;
+
+      Value *Variable = NamedValues[AST.getVarName(AST.getLHS(N))];
+      if (!Variable)
+        return LogErrorV("Unknown variable name");
+
+      Builder->CreateStore(V, Variable);
+      return V;
+    }
+    }
+
+    Value *L = F.Vals[0];
+    Value *R = V;
+    if (!L || !R)
+      return nullptr;
+
+    switch (Op) {
+    case '+':
+      return Builder->CreateFAdd(L, R, "addtmp");
+    case '-':
+      return Builder->CreateFSub(L, R, "subtmp");
+    case '*':
+      return Builder->CreateFMul(L, R, "multmp");
+    case '<':
+      L = Builder->CreateFCmpULT(L, R, "cmptmp");
+      return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext),
+                                   "booltmp");
+    default:
+      break;
+    }
+
+    Function *Fn = getFunction(Identifiers.intern("binary", Op));
+    assert(Fn && "binary operator not found!");
+
+    Value *Ops[] = {L, R};
+    return Builder->CreateCall(Fn, Ops, "binop");
+  }
+
+  case FK_Call: {
+    unsigned NumArgs = AST.getNumArgs(N);
+    if (F.Stage++ == 0) {
+      KSDbgInfo.emitLocation(Loc);
+
+      Function *CalleeF = getFunction(AST.getCallee(N));
+      if (!CalleeF)
+        return LogErrorV("Unknown function referenced");
+
+      if (CalleeF->arg_size() != NumArgs)
+        return LogErrorV("Incorrect # arguments passed");
+
+      F.Vals[0] = CalleeF;
+      F.Saved = S.Values.size();
+    } else {
+      S.Values.push_back(V);
+      if (!V)
+        return nullptr;
+      ++F.Index;
+    }
+
+    if (F.Index != NumArgs)
+      return Step::visit(AST.getArg(N, F.Index));
+
+    ArrayRef<Value *> ArgsV = makeArrayRef(S.Values).drop_front(F.Saved);
+    Value *Call =
+        Builder->CreateCall(cast<Function>(F.Vals[0]), ArgsV, "calltmp");
+    S.Values.resize(F.Saved);
+    return Call;
+  }
+
+  case FK_If:
+    switch (F.Stage++) {
+    case 0:
+      KSDbgInfo.emitLocation(Loc);
+      return Step::visit(AST.getCond(N));
+
+    case 1: {
+      Value *CondV = V;
+      if (!CondV)
+        return nullptr;
+
+      CondV = Builder->CreateFCmpONE(
+          CondV, ConstantFP::get(*TheContext, APFloat(0.0)), "ifcond");
+
+      Function *TheFunction = Builder->GetInsertBlock()->getParent();
+      BasicBlock *ThenBB =
+          BasicBlock::Create(*TheContext, "then", TheFunction);
+      BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
+      BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
+
+      Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+
+      Builder->SetInsertPoint(ThenBB);
+      F.Blocks[1] = ElseBB;
+      F.Blocks[2] = MergeBB;
+      return Step::visit(AST.getThen(N));
+    }
+
+    case 2: {
+      Value *ThenV = V;
+      if (!ThenV)
+        return nullptr;
+      Builder->CreateBr(F.Blocks[2]);
+      F.Blocks[0] = Builder->GetInsertBlock();
+      F.Vals[0] = ThenV;
+
+      Function *TheFunction = F.Blocks[0]->getParent();
+      TheFunction->getBasicBlockList().push_back(F.Blocks[1]);
+      Builder->SetInsertPoint(F.Blocks[1]);
+      return Step::visit(AST.getElse(N));
+    }
+
+    default: {
+      Value *ElseV = V;
+      if (!ElseV)
+        return nullptr;
+      BasicBlock *MergeBB = F.Blocks[2];
+      Builder->CreateBr(MergeBB);
+      BasicBlock *ElseBB = Builder->GetInsertBlock();
+
+      ElseBB->getParent()->getBasicBlockList().push_back(MergeBB);
+      Builder->SetInsertPoint(MergeBB);
+      PHINode *PN =
+          Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
+      PN->addIncoming(F.Vals[0], F.Blocks[0]);
+      PN->addIncoming(ElseV, ElseBB);
+      return PN;
+    }
+    }
+
+  case FK_For: {
+    SymbolID VarName = AST.getForVar(N);
+    switch (F.Stage++) {
+    case 0: {
+      Function *TheFunction = Builder->GetInsertBlock()->getParent();
+      F.Allocas[0] =
+          CreateEntryBlockAlloca(TheFunction, Identifiers.getName(VarName));
+
+      KSDbgInfo.emitLocation(Loc);
+      return Step::visit(AST.getStart(N));
+    }
+
+    case 1: {
+      Value *StartVal = V;
+      if (!StartVal)
+        return nullptr;
+      AllocaInst *Alloca = F.Allocas[0];
+      Builder->CreateStore(StartVal, Alloca);
+
+      Function *TheFunction = Builder->GetInsertBlock()->getParent();
+      BasicBlock *LoopBB =
+          BasicBlock::Create(*TheContext, "loop", TheFunction);
+      F.Blocks[0] = LoopBB;
+      Builder->CreateBr(LoopBB);
+      Builder->SetInsertPoint(LoopBB);
+
+      F.Allocas[1] = NamedValues[VarName];
+      NamedValues[VarName] = Alloca;
+
+      return Step::visit(AST.getForBody(N));
+    }
+
+    case 2:
+      if (!V)
+        return nullptr;
+
+      if (NodeRef StepN = AST.getStep(N))
+        return Step::visit(StepN);
+
+      F.Vals[0] = ConstantFP::get(*TheContext, APFloat(1.0));
+      F.Stage = 4;
+      return Step::visit(AST.getEnd(N));
+
+    case 3:
+      if (!V)
+        return nullptr;
+      F.Vals[0] = V;
+      return Step::visit(AST.getEnd(N));
+    }
+
+    Value *EndCond = V;
+    if (!EndCond)
+      return nullptr;
+
+    AllocaInst *Alloca = F.Allocas[0];
+    Value *CurVar = Builder->CreateLoad(Type::getDoubleTy(*TheContext), Alloca,
+                                        Identifiers.getName(VarName));
+    Value *NextVar = Builder->CreateFAdd(CurVar, F.Vals[0], "nextvar");
+    Builder->CreateStore(NextVar, Alloca);
+
+    EndCond = Builder->CreateFCmpONE(
+        EndCond, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    BasicBlock *AfterBB =
+        BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+    Builder->CreateCondBr(EndCond, F.Blocks[0], AfterBB);
+    Builder->SetInsertPoint(AfterBB);
+
+    if (AllocaInst *OldVal = F.Allocas[1])
+      NamedValues[VarName] = OldVal;
+    else
+      NamedValues.erase(VarName);
+
+    return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+  }
+
+  case FK_Var: {
+    unsigned NumVars = AST.getNumVars(N);
+    switch (F.Stage) {
+    case 0:
+      F.Saved = S.Bindings.size();
+      break;
+
+    case 1:
+      if (!V)
+        return nullptr;
+      bindVariable(AST.getVarName(N, F.Index++), V, S.Bindings);
+      break;
+
+    default: {
+      Value *BodyVal = V;
+      if (!BodyVal)
+        return nullptr;
+
+      for (unsigned i = 0; i != NumVars; ++i)
+        NamedValues[AST.getVarName(N, i)] = S.Bindings[F.Saved + i];
+      S.Bindings.resize(F.Saved);
+
+      return BodyVal;
+    }
+    }
+
+    for (; F.Index != NumVars; ++F.Index) {
+      if (NodeRef Init = AST.getVarInit(N, F.Index)) {
+        F.Stage = 1;
+        return Step::visit(Init);
+      }
+      bindVariable(AST.getVarName(N, F.Index),
+                   ConstantFP::get(*TheContext, APFloat(0.0)), S.Bindings);
+    }
+
+    KSDbgInfo.emitLocation(Loc);
+
+    F.Stage = 2;
+    return Step::visit(AST.getVarBody(N));
+  }
+  }
+  llvm_unreachable("unknown flat node kind");
+}
+
+raw_ostream &FlatBuilder::dump(raw_ostream &out, NodeRef N, int ind) {
+  if (!N)
+    return out << "null\n";
+
+  const FlatAST &AST = *FlatNodes;
+  auto Loc = TheSource->getLineAndColumn(AST.getLoc(N));
+  auto header = [&]() -> raw_ostream & {
+    return out << ':' << Loc.first << ':' << Loc.second << '\n';
+  };
+
+  switch (AST.getKind(N)) {
+  case FK_Number:
+    out << AST.getNumber(N);
+    return header();
+  case FK_Variable:
+    out << Identifiers.getName(AST.getVarName(N));
+    return header();
+  case FK_Unary:
+    out << "unary" << AST.getOp(N);
+    header();
+    return dump(out, AST.getOperand(N), ind + 1);
+  case FK_Binary:
+    out << "binary" << AST.getOp(N);
+    header();
+    dump(indent(out, ind) << "LHS:", AST.getLHS(N), ind + 1);
+    return dump(indent(out, ind) << "RHS:", AST.getRHS(N), ind + 1);
+  case FK_Call:
+    out << "call " << Identifiers.getName(AST.getCallee(N));
+    header();
+    for (unsigned i = 0, e = AST.getNumArgs(N); i != e; ++i)
+      dump(indent(out, ind + 1), AST.getArg(N, i), ind + 1);
+    return out;
+  case FK_If:
+    out << "if";
+    header();
+    dump(indent(out, ind) << "Cond:", AST.getCond(N), ind + 1);
+    dump(indent(out, ind) << "Then:", AST.getThen(N), ind + 1);
+    return dump(indent(out, ind) << "Else:", AST.getElse(N), ind + 1);
+  case FK_For:
+    out << "for";
+    header();
+    dump(indent(out, ind) << "Cond:", AST.getStart(N), ind + 1);
+    dump(indent(out, ind) << "End:", AST.getEnd(N), ind + 1);
+    dump(indent(out, ind) << "Step:", AST.getStep(N), ind + 1);
+    return dump(indent(out, ind) << "Body:", AST.getForBody(N), ind + 1);
+  case FK_Var:
+    out << "var";
+    header();
+    for (unsigned i = 0, e = AST.getNumVars(N); i != e; ++i)
+      dump(indent(out, ind) << Identifiers.getName(AST.getVarName(N, i)) << ':',
+           AST.getVarInit(N, i), ind + 1);
+    return dump(indent(out, ind) << "Body:", AST.getVarBody(N), ind + 1);
+  }
+  llvm_unreachable("unknown flat node kind");
+}
+
+template <typename B> Function *FunctionAST<B>::codegen() {
+  PhaseScope Timing(PhaseCodegen);
   // Transfer ownership of the prototype to the FunctionProtos map, but keep a
   // reference to it for use below.
   auto &P = *Proto;
-  FunctionProtos[Proto->getName()] = std::move(Proto);
-  Function *TheFunction = getFunction(P.getName());
+  FunctionProtos[Proto->getSymbol()] = std::move(Proto);
+  Function *TheFunction = getFunction(P.getSymbol());
   if (!TheFunction)
     return nullptr;
+  if (!TheFunction->empty())
+    return LogError("Function cannot be redefined.");
 
   // If this is an operator, install it.
   if (P.isBinaryOp())
-    BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+    Operators.define(P.getOperatorName(), P.getBinaryPrecedence());
 
   // Create a new basic block to start insertion into.
   BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
   Builder->SetInsertPoint(BB);
 
   // Create a subprogram DIE for this function.
-  DIFile *Unit = DBuilder->createFile(KSDbgInfo.TheCU->getFilename(),
-                                      KSDbgInfo.TheCU->getDirectory());
-  DIScope *FContext = Unit;
-  unsigned LineNo = P.getLine();
-  unsigned ScopeLine = LineNo;
-  DISubprogram *SP = DBuilder->createFunction(
-      FContext, P.getName(), StringRef(), Unit, LineNo,
-      CreateFunctionType(TheFunction->arg_size()), ScopeLine,
-      DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
-  TheFunction->setSubprogram(SP);
-
-  // Push the current scope.
-  KSDbgInfo.LexicalBlocks.push_back(SP);
+  DIFile *Unit = nullptr;
+  DISubprogram *SP = nullptr;
+  unsigned LineNo = 0;
+  if (DBuilder) {
+    Unit = DBuilder->createFile(KSDbgInfo.TheCU->getFilename(),
+                                KSDbgInfo.TheCU->getDirectory());
+    DIScope *FContext = Unit;
+    LineNo = P.getLine();
+    unsigned ScopeLine = LineNo;
+    SP = DBuilder->createFunction(
+        FContext, P.getName(), StringRef(), Unit, LineNo,
+        CreateFunctionType(TheFunction->arg_size()), ScopeLine,
+        DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+    TheFunction->setSubprogram(SP);
+
+    // Push the current scope.
+    KSDbgInfo.LexicalBlocks.push_back(SP);
+  }
 
   // Unset the location for the prologue emission (leading instructions with no
   // location in a function are considered part of the prologue and the debugger
@@ -1273,32 +2165,46 @@ Function *FunctionAST::codegen() {
     AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
 
     // Create a debug descriptor for the variable.
-    DILocalVariable *D = DBuilder->createParameterVariable(
-        SP, Arg.getName(), ++ArgIdx, Unit, LineNo, KSDbgInfo.getDoubleTy(),
-        true);
-
-    DBuilder->insertDeclare(Alloca, D, DBuilder->createExpression(),
-                            DILocation::get(SP->getContext(), LineNo, 0, SP),
-                            Builder->GetInsertBlock());
+    ++ArgIdx;
+    if (SP) {
+      DILocalVariable *D = DBuilder->createParameterVariable(
+          SP, Arg.getName(), ArgIdx, Unit, LineNo, KSDbgInfo.getDoubleTy(),
+          true);
+
+      DBuilder->insertDeclare(Alloca, D, DBuilder->createExpression(),
+                              DILocation::get(SP->getContext(), LineNo, 0, SP),
+                              Builder->GetInsertBlock());
+    }
 
     // Store the initial value into the alloca.
     Builder->CreateStore(&Arg, Alloca);
 
     // Add arguments to variable symbol table.
-    NamedValues[std::string(Arg.getName())] = Alloca;
+    NamedValues[P.getArgs()[ArgIdx - 1]] = Alloca;
   }
 
-  KSDbgInfo.emitLocation(Body.get());
+  if (InstrumentCalls)
+    CallStats::instrumentEntry(*Builder, *TheFunction,
+                               CallStats::get().getId(P.getName()));
+
+  B::foldConstants();
+  KSDbgInfo.emitLocation(B::getLoc(Body));
 
-  if (Value *RetVal = Body->codegen()) {
+  if (Value *RetVal = B::codegen(Body)) {
     // Finish off the function.
+    if (InstrumentCalls)
+      CallStats::instrumentExit(*Builder, *TheFunction);
     Builder->CreateRet(RetVal);
 
     // Pop off the lexical block for the function.
-    KSDbgInfo.LexicalBlocks.pop_back();
+    if (SP)
+      KSDbgInfo.LexicalBlocks.pop_back();
 
     // Validate the generated code, checking for consistency.
-    verifyFunction(*TheFunction);
+    {
+      PhaseScope Verifying(PhaseVerify);
+      verifyFunction(*TheFunction);
+    }
 
     return TheFunction;
   }
@@ -1307,11 +2213,12 @@ Function *FunctionAST::codegen() {
   TheFunction->eraseFromParent();
 
   if (P.isBinaryOp())
-    BinopPrecedence.erase(Proto->getOperatorName());
+    Operators.undefine(P.getOperatorName());
 
   // Pop off the lexical block for the function since we added it
   // unconditionally.
-  KSDbgInfo.LexicalBlocks.pop_back();
+  if (SP)
+    KSDbgInfo.LexicalBlocks.pop_back();
 
   return nullptr;
 }
@@ -1320,31 +2227,137 @@ Function *FunctionAST::codegen() {
 // Top-Level parsing and JIT Driver
 //===----------------------------------------------------------------------===//
 
+/// InitializeModule - Open a new module, in a context of its own, for the
+/// items that follow, along with the debug info builder that goes with it.
 static void InitializeModule() {
+  // Drop whatever is left of the previous module before its context.
+  DBuilder.reset();
+  Builder.reset();
+  TheModule.reset();
+
   // Open a new module.
   TheContext = std::make_unique<LLVMContext>();
   TheModule = std::make_unique<Module>("my cool jit", *TheContext);
-  TheModule->setDataLayout(TheJIT->getDataLayout());
+  if (AOTTarget) {
+    TheModule->setDataLayout(AOTTarget->createDataLayout());
+    TheModule->setTargetTriple(AOTTarget->getTargetTriple().str());
+  } else {
+    TheModule->setDataLayout(TheJIT->getDataLayout());
+  }
 
   Builder = std::make_unique<IRBuilder<>>(*TheContext);
+
+  if (!KSDbgInfo.Enabled)
+    return;
+
+  // Add the current debug info version into the module.
+  TheModule->addModuleFlag(Module::Warning, "Debug Info Version",
+                           DEBUG_METADATA_VERSION);
+
+  // Darwin only supports dwarf2.
+  if (Triple(sys::getProcessTriple()).isOSDarwin())
+    TheModule->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 2);
+
+  // Construct the DIBuilder, we do this here because we need the module.
+  DBuilder = std::make_unique<DIBuilder>(*TheModule);
+
+  // Create the compile unit for the module.
+  KSDbgInfo.TheCU = DBuilder->createCompileUnit(
+      dwarf::DW_LANG_C,
+      DBuilder->createFile(KSDbgInfo.FileName, KSDbgInfo.Directory),
+      "Div Compiler", false, "", 0);
+  KSDbgInfo.DblTy = nullptr;
 }
 
+/// TakeModule - Finish the module built so far and hand it, with its context,
+/// to whoever is going to own it, usually the JIT.  A new module is opened for
+/// the items that follow.
+static ThreadSafeModule TakeModule() {
+  if (DBuilder)
+    DBuilder->finalize();
+  ThreadSafeModule TSM(std::move(TheModule), std::move(TheContext));
+  InitializeModule();
+  return TSM;
+}
 
-static void InitializeModuleAndPassManager() {
-  // Open a new module.
-  TheContext = std::make_unique<LLVMContext>();
-  TheModule = std::make_unique<Module>("my cool jit", *TheContext);
+/// LogJITError - Report an error from the JIT.  The item it came from is
+/// dropped and the session carries on.
+static void LogJITError(Error Err) {
+  logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+}
 
-  // Create a new builder for the module.
-  Builder = std::make_unique<IRBuilder<>>(*TheContext);
+template <typename B>
+static void EmitDefinition(std::unique_ptr<FunctionAST<B>> FnAST) {
+  TheTimer.nameItem(FnAST->getProto().getName());
+  if (auto *FnIR = FnAST->codegen()) {
+    fprintf(stderr, "Read function definition:");
+    FnIR->print(errs());
+    fprintf(stderr, "\n");
+
+    // Compiled ahead of time, everything goes into the one module.
+    if (AOTTarget)
+      return;
+
+    // A definition gets a module of its own, which stays in the JIT for the
+    // rest of the session.
+    if (Error Err = TheJIT->addModule(TakeModule()))
+      LogJITError(std::move(Err));
+  }
 }
-static void HandleDefinition() {
-  if (auto FnAST = ParseDefinition()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read function definition:");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
+
+static void EmitExtern(std::unique_ptr<PrototypeAST> ProtoAST) {
+  TheTimer.nameItem(ProtoAST->getName());
+  if (auto *FnIR = ProtoAST->codegen()) {
+    fprintf(stderr, "Read extern: ");
+    FnIR->print(errs());
+    fprintf(stderr, "\n");
+    FunctionProtos[ProtoAST->getSymbol()] = std::move(ProtoAST);
+  }
+}
+
+template <typename B>
+static void EmitTopLevelExpression(std::unique_ptr<FunctionAST<B>> FnAST) {
+  // Evaluate a top-level expression into an anonymous function.
+  TheTimer.nameItem(FnAST->getProto().getName());
+  Function *F = FnAST->codegen();
+  if (!F)
+    return;
+
+  // Compiled ahead of time, it is left for main to call.
+  if (AOTTarget) {
+    F->setName("__anon_expr." + Twine(AOTExprs.size()));
+    F->setLinkage(Function::InternalLinkage);
+    AOTExprs.push_back(F->getName().str());
+    return;
+  }
+
+  // Give the expression a module, and a resource tracker, of its own, so that
+  // its code is freed as soon as it has run.
+  ResourceTrackerSP RT = TheJIT->getMainJITDylib().createResourceTracker();
+  if (Error Err = TheJIT->addEagerModule(TakeModule(), RT))
+    return LogJITError(std::move(Err));
+
+  // Get the anonymous expression's address and cast it to the right type,
+  // double(*)(), so we can call it as a native function.
+  if (auto ExprSymbol = TheJIT->lookup("__anon_expr")) {
+    auto *FP = (double (*)())(intptr_t)ExprSymbol->getAddress();
+    double Result;
+    {
+      PhaseScope Running(PhaseRun);
+      Result = FP();
     }
+    fprintf(stderr, "Evaluated to %f\n", Result);
+  } else {
+    LogJITError(ExprSymbol.takeError());
+  }
+
+  // Delete the anonymous expression module from the JIT.
+  ExitOnErr(TheJIT->removeModules(*RT));
+}
+
+template <typename B> static void HandleDefinition() {
+  if (auto FnAST = ParseDefinition<B>()) {
+    EmitDefinition<B>(std::move(FnAST));
   } else {
     // Skip token for error recovery.
     getNextToken();
@@ -1353,30 +2366,45 @@ static void HandleDefinition() {
 
 static void HandleExtern() {
   if (auto ProtoAST = ParseExtern()) {
-    if (auto *FnIR = ProtoAST->codegen()) {
-      fprintf(stderr, "Read extern: ");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
-    }
+    EmitExtern(std::move(ProtoAST));
   } else {
     // Skip token for error recovery.
     getNextToken();
   }
 }
 
-static void HandleTopLevelExpression() {
-  // Evaluate a top-level expression into an anonymous function.
-  if (auto FnAST = ParseTopLevelExpr()) {
-    FnAST->codegen();
+template <typename B> static void HandleTopLevelExpression() {
+  if (auto FnAST = ParseTopLevelExpr<B>()) {
+    EmitTopLevelExpression<B>(std::move(FnAST));
   } else {
     // Skip token for error recovery.
     getNextToken();
   }
 }
 
-/// top ::= definition | external | expression | ';'
-static void MainLoop() {
+/// BeginTimedItem - Start charging phase times to the top-level item at
+/// CurTok, a definition, an extern or an expression.
+static void BeginTimedItem() {
+  if (!TheTimer.Enabled)
+    return;
+  TheTimer.beginItem(CurTok == tok_def      ? "def"
+                     : CurTok == tok_extern ? "extern"
+                                            : "expr",
+                     TheSource->getLineAndColumn(CurLoc.Offset).first);
+}
+
+/// RunCommand - Carry out a REPL command, which the lexer has checked is
+/// one there is:
+///   ':stats' prints the call statistics gathered so far under -instrument.
+static void RunCommand() {
+  if (InstrumentCalls)
+    CallStats::get().report(stderr);
+  else
+    fprintf(stderr, "call stats: run with -instrument to gather them\n");
+}
+
+/// top ::= definition | external | expression | ';' | command
+template <typename B> static void MainLoop() {
   while (true) {
     fprintf(stderr, "\e[32;1m[DIV] \x1b[34;1m>\x1b[0m ");
     switch (CurTok) {
@@ -1385,16 +2413,27 @@ static void MainLoop() {
     case ';': // ignore top-level semicolons.
       getNextToken();
       break;
+    case tok_command:
+      RunCommand();
+      getNextToken();
+      continue;
     case tok_def:
-      HandleDefinition();
+      BeginTimedItem();
+      HandleDefinition<B>();
       break;
     case tok_extern:
+      BeginTimedItem();
       HandleExtern();
       break;
     default:
-      HandleTopLevelExpression();
+      BeginTimedItem();
+      HandleTopLevelExpression<B>();
       break;
     }
+    TheTimer.endItem();
+
+    // The item has been code generated (or failed to parse); free its AST.
+    B::reset();
   }
 }
 
@@ -1420,59 +2459,952 @@ extern "C" DLLEXPORT double printd(double X) {
   return 0;
 }
 
+/// __div_instr_enter, __div_instr_exit - What code built with -instrument
+/// calls on entry and before it returns, with the cycle counter.  Div names
+/// cannot start with an underscore, so programs cannot call these.
+extern "C" DLLEXPORT void __div_instr_enter(uint32_t Id, uint64_t Now) {
+  CallStats::get().enter(Id, Now);
+}
+
+extern "C" DLLEXPORT void __div_instr_exit(uint64_t Now) {
+  CallStats::get().exit(Now);
+}
+
 //===----------------------------------------------------------------------===//
 // Main driver code.
 //===----------------------------------------------------------------------===//
 
-int main() {
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<input file>"),
+                                          cl::init("-"));
+
+static cl::opt<unsigned> OptLevel("O", cl::Prefix,
+                                  cl::desc("Optimization level: -O0, -O1, "
+                                           "-O2 (the default) or -O3"),
+                                  cl::init(2));
+
+static cl::opt<bool>
+    DebugInfoFlag("g", cl::desc("Generate debug info: the source locations "
+                                "of functions, their arguments and their "
+                                "code"));
+
+static cl::opt<std::string>
+    TargetCPU("mcpu",
+              cl::desc("Generate code for this CPU (default: the host's; "
+                       "'generic' for the baseline of the architecture)"),
+              cl::value_desc("cpu-name"));
+
+static cl::list<std::string>
+    TargetFeatures("mattr", cl::CommaSeparated,
+                   cl::desc("Target features to enable (+feature) or "
+                            "disable (-feature), e.g. -mattr=-avx512f,+fma"),
+                   cl::value_desc("a1,+a2,-a3,..."));
+
+static cl::opt<CodeModel::Model> TargetCodeModel(
+    "code-model", cl::desc("Code model for generated code (default: the "
+                           "target's choice for a JIT)"),
+    cl::values(clEnumValN(CodeModel::Small, "small", "Small code model"),
+               clEnumValN(CodeModel::Medium, "medium", "Medium code model"),
+               clEnumValN(CodeModel::Large, "large", "Large code model")));
+
+static cl::opt<unsigned>
+    CodeGenOptLevel("codegen-opt",
+                    cl::desc("Optimization level for instruction selection "
+                             "and register allocation, 0 to 3 (default: "
+                             "that of -O)"),
+                    cl::value_desc("level"));
+
+static cl::opt<bool>
+    LazyCompile("lazy",
+                cl::desc("Compile each function the first time it is "
+                         "called, through a stub, rather than as soon as "
+                         "code that refers to it is compiled"));
+
+static cl::opt<bool>
+    TieredCompile("tiered",
+                  cl::desc("Compile functions quickly at first, with "
+                           "counters, and again with full optimization in "
+                           "the background once they are hot"));
+
+static cl::opt<uint64_t>
+    TierThreshold("tier-threshold",
+                  cl::desc("Calls plus loop iterations that make a function "
+                           "hot (default 10000)"),
+                  cl::init(10000));
+
+static cl::opt<bool>
+    PrintTiers("print-tiers",
+               cl::desc("With -tiered, print each function's tier and count "
+                        "on exit"));
+
+static cl::opt<std::string>
+    PGOGen("pgo-gen",
+           cl::desc("Count the branches taken and calls made in every "
+                    "function and write the counts to <file> on exit, added "
+                    "to any read with -pgo-use"),
+           cl::value_desc("file"));
+
+static cl::opt<std::string>
+    PGOUse("pgo-use",
+           cl::desc("Optimize functions for the branch and call counts in "
+                    "<file>, written by -pgo-gen; with -tiered, counts are "
+                    "taken as the program runs as well"),
+           cl::value_desc("file"));
+
+static cl::opt<unsigned>
+    JITThreads("jit-threads",
+               cl::desc("Compile and link modules on this many threads "
+                        "(0: on the thread that needs their code)"),
+               cl::init(0));
+
+static cl::opt<std::string>
+    CacheDir("cache-dir",
+             cl::desc("Keep compiled code in this directory and reuse it "
+                      "in later runs"),
+             cl::value_desc("directory"));
+
+static cl::opt<uint64_t>
+    CacheSize("cache-size",
+              cl::desc("The most the -cache-dir directory may hold, in "
+                       "megabytes, before the code used least recently is "
+                       "removed (default 256; 0 for no limit)"),
+              cl::init(256));
+
+static cl::opt<bool>
+    PrintCacheStats("cache-stats",
+                    cl::desc("With -cache-dir, print the cache's hits and "
+                             "misses on exit"));
+
+static cl::opt<bool>
+    UseJITLink("jitlink",
+               cl::desc("Link with JITLink, packing every module's code into "
+                        "shared pages, rather than with RuntimeDyld"));
+
+static cl::opt<bool>
+    HugePages("huge-pages",
+              cl::desc("With -jitlink, ask for JIT'd code to be on "
+                       "transparent huge pages"));
+
+static cl::opt<bool>
+    PrintLinkStats("link-stats",
+                   cl::desc("Print the system calls and memory that linking "
+                            "took, and the instruction TLB misses and page "
+                            "faults of the run, on exit"));
+
+static cl::opt<bool>
+    PerfMapFile("perf-map",
+                cl::desc("Name each JIT'd function for perf in "
+                         "/tmp/perf-<pid>.map"));
+
+static cl::opt<bool>
+    JITDumpFile("jitdump",
+                cl::desc("Record each JIT'd function's code and lines, with "
+                         "-g, in a jitdump file for perf inject --jit, in "
+                         "$JITDUMPDIR or /tmp"));
+
+static cl::opt<bool>
+    ProfileRun("profile",
+               cl::desc("Sample the program counter and the stack on a CPU "
+                        "time timer, with frame pointers kept in JIT'd code, "
+                        "and print a flat profile on exit; lines need -g"));
+
+static cl::opt<unsigned>
+    ProfileInterval("profile-interval",
+                    cl::desc("With -profile, the CPU time between samples, "
+                             "in microseconds (default 1000)"),
+                    cl::init(1000));
+
+static cl::opt<std::string>
+    ProfileFolded("profile-folded",
+                  cl::desc("With -profile, write the stacks sampled to "
+                           "<file>, folded for flame graphs (default "
+                           "div.folded)"),
+                  cl::value_desc("file"), cl::init("div.folded"));
+
+static cl::opt<bool>
+    Instrument("instrument",
+               cl::desc("Count the calls to every function and the cycles "
+                        "spent in it, in all and less its calls, for ':stats' "
+                        "and a report on exit"));
+
+static cl::opt<bool>
+    TimePhases("time-phases",
+               cl::desc("Print how long lexing, parsing, code generation, "
+                        "optimization, linking and the rest took, in all and "
+                        "for the slowest items, on exit"));
+
+static cl::opt<std::string>
+    TimePhasesJSON("time-phases-json",
+                   cl::desc("Write the phase times of the session and of "
+                            "every item to <file> as JSON"),
+                   cl::value_desc("file"));
+
+static cl::opt<std::string>
+    TimeTrace("time-trace",
+              cl::desc("Write every item and phase to <file> as a Chrome "
+                       "trace"),
+              cl::value_desc("file"));
+
+enum EmitKind { EmitJIT, EmitObject, EmitExecutable, EmitShared };
+
+static cl::opt<EmitKind> Emit(
+    "emit", cl::desc("Compile the input ahead of time rather than run it"),
+    cl::values(clEnumValN(EmitObject, "obj", "An object file"),
+               clEnumValN(EmitExecutable, "exe",
+                          "An executable that prints the value of each "
+                          "top-level expression"),
+               clEnumValN(EmitShared, "shared",
+                          "A shared library, with a C header")),
+    cl::init(EmitJIT));
+
+static cl::opt<std::string>
+    OutputFilename("o",
+                   cl::desc("Where -emit writes its output (default: the "
+                            "input's name with .o or .so, or a.out)"),
+                   cl::value_desc("filename"));
+
+static cl::opt<std::string>
+    HeaderFilename("header",
+                   cl::desc("With -emit, write a C header declaring the "
+                            "definitions here (default for -emit=shared: "
+                            "the output's name with .h)"),
+                   cl::value_desc("filename"));
+
+static cl::opt<bool>
+    PrintTarget("print-target",
+                cl::desc("Print the CPU and features code is generated for"));
+
+static cl::opt<bool> LexOnly("lex-only",
+                             cl::desc("Lex the input, report lexer throughput "
+                                      "and exit"));
+
+static cl::opt<bool> ScalarLexer("scalar-lexer",
+                                 cl::desc("Scan characters one at a time "
+                                          "instead of with SIMD"));
+
+/// LexInput - Run the lexer over the whole input and report how fast it went.
+static void LexInput() {
+  auto Start = std::chrono::steady_clock::now();
+  size_t NumTokens = 0;
+  while (getNextToken() != tok_eof)
+    ++NumTokens;
+  std::chrono::duration<double> Secs = std::chrono::steady_clock::now() - Start;
+
+  double MB = TheSource->size() / (1024.0 * 1024.0);
+  fprintf(stderr, "lexed %zu bytes, %zu tokens in %.3fs (%.1f MB/s)\n",
+          TheSource->size(), NumTokens, Secs.count(), MB / Secs.count());
+}
+
+static cl::opt<bool> UseFlatAST("flat-ast",
+                                cl::desc("Parse into flat, index-based node "
+                                         "arrays instead of a tree of "
+                                         "ExprAST nodes"));
+
+static cl::opt<bool> ParseOnly("parse-only",
+                               cl::desc("Parse the input without generating "
+                                        "code, report parser throughput and "
+                                        "exit"));
+
+static cl::opt<bool> CodegenOnly("codegen-only",
+                                 cl::desc("Parse the input and generate IR "
+                                          "for it without printing or running "
+                                          "it, report front-end throughput "
+                                          "and exit"));
+
+static cl::opt<unsigned>
+    ParseThreads("parse-threads",
+                 cl::desc("Read the whole input, split it at top-level items "
+                          "and parse the pieces on this many threads (0: "
+                          "parse it in order as it is read)"),
+                 cl::init(0));
+
+/// ParsedItem - A top-level item parsed ahead of being handled.
+template <typename B> struct ParsedItem {
+  int Kind = 0; // tok_def, tok_extern, tok_command, or 0 for an expression.
+  std::unique_ptr<FunctionAST<B>> Fn;  // Set for a definition or expression.
+  std::unique_ptr<PrototypeAST> Proto; // Set for an extern.
+  std::string Diags;                   // The errors parsing it reported.
+};
+
+/// ParsedChunk - A piece of the input, [Begin, End), and the items parsed from
+/// it.  Their expressions live in Arena or Flat.
+template <typename B> struct ParsedChunk {
+  size_t Begin, End;
+  BumpPtrAllocator Arena;
+  FlatAST Flat;
+  std::vector<ParsedItem<B>> Items;
+  size_t NumNodes = 0;
+};
+
+/// parseItem - Parse the next top-level item into Item.  Returns false at the
+/// end of the input.  An item that fails to parse has neither Fn nor Proto,
+/// and nor has a command, which only has its Kind.
+template <typename B> static bool parseItem(ParsedItem<B> &Item) {
+  while (CurTok == ';') // ignore top-level semicolons.
+    getNextToken();
+  if (CurTok == tok_eof)
+    return false;
+
+  ItemStart = CurLoc.Offset;
+  switch (CurTok) {
+  case tok_def:
+    Item.Kind = tok_def;
+    Item.Fn = ParseDefinition<B>();
+    break;
+  case tok_extern:
+    Item.Kind = tok_extern;
+    Item.Proto = ParseExtern();
+    break;
+  case tok_command:
+    Item.Kind = tok_command;
+    getNextToken();
+    return true;
+  default:
+    Item.Fn = ParseTopLevelExpr<B>();
+    break;
+  }
+  if (!Item.Fn && !Item.Proto)
+    getNextToken(); // Skip token for error recovery.
+  return true;
+}
+
+/// ParseChunk - Parse every item of C on this thread, keeping their ASTs and
+/// error messages in C.
+template <typename B> static void ParseChunk(ParsedChunk<B> &C) {
+  SymbolCache Symbols(Identifiers);
+  std::string Messages;
+  raw_string_ostream OS(Messages);
+  ChunkSymbols = &Symbols;
+  Diags = &OS;
+  ASTArena = &C.Arena;
+  FlatNodes = &C.Flat;
+  LexPos = C.Begin;
+  LexLimit = C.End;
+  NumASTNodes = 0;
+
+  getNextToken();
+  ParsedItem<B> Item;
+  while (parseItem(Item)) {
+    Item.Diags.swap(OS.str());
+    C.Items.push_back(std::move(Item));
+    Item = ParsedItem<B>();
+  }
+  B::foldConstants();
+  C.NumNodes = NumASTNodes;
+
+  ChunkSymbols = nullptr;
+  Diags = nullptr;
+}
+
+/// MinChunkSize - Pieces smaller than this are not worth a task of their own.
+static const size_t MinChunkSize = 64 * 1024;
+
+/// ParseInParallel - Read the whole input, cut it into pieces that each start
+/// at a 'def' or 'extern', and parse them on ParseThreads threads into Chunks.
+///
+/// A 'def binary' changes how everything after it parses, so every one is
+/// found and registered before parsing starts, visible only to the items that
+/// follow it.  Each piece then parses just as it would have from the top of
+/// the file.  If the file defines an operator twice with different
+/// precedences, the one an item sees depends on which definitions have been
+/// compiled, so this parses nothing and returns false; the input has to be
+/// parsed in order.
+template <typename B>
+static bool
+ParseInParallel(std::vector<std::unique_ptr<ParsedChunk<B>>> &Chunks) {
+  while (TheSource->fill())
+    ;
+  StringRef Text = TheSource->slice(0, TheSource->size());
+
+  std::vector<OperatorDefinition> Defs = findOperatorDefinitions(Text);
+  unsigned Precedence[256] = {};
+  for (const OperatorDefinition &D : Defs) {
+    unsigned &Prec = Precedence[(unsigned char)D.Op];
+    if (Prec && Prec != D.Precedence) {
+      fprintf(stderr, "note: operator '%c' is redefined with a different "
+                      "precedence; parsing in order\n", D.Op);
+      return false;
+    }
+    Prec = D.Precedence;
+  }
+  for (const OperatorDefinition &D : Defs)
+    if (!Operators.lookup(D.Op).isUserDefined())
+      Operators.define(D.Op, D.Precedence, 0, D.At + 1);
+
+  size_t NumChunks =
+      std::min<size_t>(ParseThreads * 4, Text.size() / MinChunkSize + 1);
+  for (size_t I = 1, Begin = 0; Begin != Text.size(); ++I) {
+    size_t End = Text.size();
+    if (I < NumChunks)
+      End = findItemStart(Text,
+                          std::max(Begin + 1, Text.size() * I / NumChunks));
+    Chunks.push_back(std::make_unique<ParsedChunk<B>>());
+    Chunks.back()->Begin = Begin;
+    Chunks.back()->End = End;
+    Begin = End;
+  }
+
+  ThreadPool Pool(hardware_concurrency(ParseThreads));
+  for (auto &C : Chunks) {
+    ParsedChunk<B> *Chunk = C.get();
+    Pool.async([Chunk] { ParseChunk<B>(*Chunk); });
+  }
+  Pool.wait();
+  return true;
+}
+
+/// useChunk - Point the expression storage at C's, for handling its items on
+/// this thread, or with null back at the per-item storage.
+template <typename B> static void useChunk(ParsedChunk<B> *C) {
+  ASTArena = C ? &C->Arena : &ItemArena;
+  FlatNodes = C ? &C->Flat : &ItemFlatNodes;
+}
+
+/// CompileInParallel - MainLoop for a whole file: parse it with ParseInParallel
+/// and handle the items in source order.  Returns false, having handled
+/// nothing, if the file has to be parsed in order instead.
+template <typename B> static bool CompileInParallel() {
+  std::vector<std::unique_ptr<ParsedChunk<B>>> Chunks;
+  if (!ParseInParallel(Chunks))
+    return false;
+
+  for (auto &C : Chunks) {
+    useChunk(C.get());
+    for (ParsedItem<B> &Item : C->Items) {
+      errs() << Item.Diags;
+      if (TheTimer.Enabled && (Item.Proto || Item.Fn))
+        TheTimer.beginItem(
+            Item.Proto ? "extern" : Item.Kind == tok_def ? "def" : "expr",
+            (Item.Proto ? *Item.Proto : Item.Fn->getProto()).getLine());
+      if (Item.Kind == tok_command)
+        RunCommand();
+      else if (Item.Proto)
+        EmitExtern(std::move(Item.Proto));
+      else if (Item.Fn && Item.Kind == tok_def)
+        EmitDefinition<B>(std::move(Item.Fn));
+      else if (Item.Fn)
+        EmitTopLevelExpression<B>(std::move(Item.Fn));
+      TheTimer.endItem();
+    }
+    C.reset();
+  }
+  useChunk<B>(nullptr);
+  return true;
+}
+
+/// FinishItem - What ParseInput does with each item once it is parsed.
+/// Returns whether the item parsed.
+template <typename B>
+static bool FinishItem(ParsedItem<B> &Item, bool Codegen) {
+  if (Item.Proto) {
+    if (Codegen && Item.Proto->codegen())
+      FunctionProtos[Item.Proto->getSymbol()] = std::move(Item.Proto);
+    return true;
+  }
+  if (!Item.Fn)
+    return false;
+  if (Codegen) {
+    if (Function *F = Item.Fn->codegen())
+      F->deleteBody();
+    return true;
+  }
+  // Later items parse differently once a binary operator is declared.
+  const PrototypeAST &P = Item.Fn->getProto();
+  if (P.isBinaryOp())
+    Operators.define(P.getOperatorName(), P.getBinaryPrecedence());
+  B::foldConstants();
+  return true;
+}
+
+/// ParseInput - Parse and constant fold every top-level item, and with Codegen
+/// generate its IR as well, freeing each item's AST as soon as it is done.
+/// Report how fast it went.  Function bodies are dropped once generated so
+/// the module stays small; calls to them only need the declaration.
+template <typename B> static void ParseInput(bool Codegen) {
+  auto Start = std::chrono::steady_clock::now();
+  size_t NumItems = 0, NumNodes = 0;
+  std::vector<std::unique_ptr<ParsedChunk<B>>> Chunks;
+  bool Parallel = ParseThreads && ParseInParallel(Chunks);
+  if (Parallel) {
+    for (auto &C : Chunks) {
+      useChunk(C.get());
+      NumNodes += C->NumNodes;
+      for (ParsedItem<B> &Item : C->Items) {
+        errs() << Item.Diags;
+        NumItems += FinishItem(Item, Codegen);
+      }
+      C.reset();
+    }
+    useChunk<B>(nullptr);
+  } else {
+    getNextToken();
+    ParsedItem<B> Item;
+    while (parseItem(Item)) {
+      NumItems += FinishItem(Item, Codegen);
+      Item = ParsedItem<B>();
+      B::reset();
+    }
+    NumNodes = NumASTNodes;
+  }
+  std::chrono::duration<double> Secs = std::chrono::steady_clock::now() - Start;
+
+  fprintf(stderr, "%s %zu items, %zu AST nodes in %.3fs (%.2fM nodes/s)",
+          Codegen ? "generated" : "parsed", NumItems, NumNodes, Secs.count(),
+          NumNodes / Secs.count() / 1e6);
+  if (Parallel)
+    fprintf(stderr, " on %u threads, %u hardware threads available",
+            (unsigned)ParseThreads,
+            hardware_concurrency().compute_thread_count());
+  fprintf(stderr, "\n");
+}
+
+static cl::opt<unsigned>
+    DepthBench("depth-bench",
+               cl::desc("Parse and generate code for expressions nested 10, "
+                        "100, ... up to this many levels deep, in several "
+                        "shapes, report how the time scales and exit"),
+               cl::init(0));
+
+/// DeepShape - The expressions DepthBenchmark builds.
+enum DeepShape {
+  DS_Chain,  // x + x + ... + x, a left-leaning tree of operators.
+  DS_Parens, // x + (x + (... (x + x)...)), nested parentheses.
+  DS_Ifs,    // if x then 1 else if x then 1 else ... 0, nested ifs.
+};
+
+/// deepExpression - An expression of the given shape, Depth levels deep.
+static std::string deepExpression(DeepShape Shape, unsigned Depth) {
+  std::string Text;
+  switch (Shape) {
+  case DS_Chain:
+    Text = "x";
+    for (unsigned I = 0; I != Depth; ++I)
+      Text += " + x";
+    break;
+  case DS_Parens:
+    for (unsigned I = 0; I != Depth; ++I)
+      Text += "x + (";
+    Text += "x" + std::string(Depth, ')');
+    break;
+  case DS_Ifs:
+    for (unsigned I = 0; I != Depth; ++I)
+      Text += "if x then 1 else ";
+    Text += "0";
+    break;
+  }
+  return Text;
+}
+
+/// DepthBenchmark - Time parsing and code generating a function whose body
+/// is each shape of deep expression, at each depth up to DepthBench.
+template <typename B> static void DepthBenchmark() {
+  static const struct {
+    DeepShape Shape;
+    const char *Name;
+  } Shapes[] = {{DS_Chain, "chain"}, {DS_Parens, "parens"}, {DS_Ifs, "ifs"}};
+
+  for (const auto &S : Shapes) {
+    for (uint64_t Depth = 10; Depth <= DepthBench; Depth *= 10) {
+      TheSource = SourceBuffer::getMemBuffer(
+          "def deep(x) " + deepExpression(S.Shape, Depth) + ";", S.Name);
+      LexPos = 0;
+      NumASTNodes = 0;
+
+      auto Start = std::chrono::steady_clock::now();
+      getNextToken();
+      auto FnAST = ParseDefinition<B>();
+      auto Parsed = std::chrono::steady_clock::now();
+      Function *F = FnAST ? FnAST->codegen() : nullptr;
+      auto Generated = std::chrono::steady_clock::now();
+      if (!F)
+        return;
+
+      std::chrono::duration<double, std::milli> ParseMs = Parsed - Start;
+      std::chrono::duration<double, std::milli> CodegenMs = Generated - Parsed;
+      fprintf(stderr,
+              "%-6s depth %8llu: parse %9.3fms, codegen %9.3fms "
+              "(%6.1f ns/node)\n",
+              S.Name, (unsigned long long)Depth, ParseMs.count(),
+              CodegenMs.count(),
+              (ParseMs + CodegenMs).count() * 1e6 / NumASTNodes);
+
+      F->eraseFromParent();
+      B::reset();
+    }
+  }
+}
+
+static cl::opt<unsigned>
+    JITBench("jit-bench",
+             cl::desc("Compile this many generated functions as one batch on "
+                      "1, 2, 4, ... up to -jit-threads threads (default: "
+                      "every hardware thread), report how it scales and "
+                      "exit"),
+             cl::init(0));
+
+/// JITBenchmark - Time DivJIT::addModules on JITBench functions, each in a
+/// module of its own, with a growing number of compile threads.  Only the
+/// JIT is timed; parsing and IR generation are done beforehand.
+template <typename B> static void JITBenchmark(DivJITOptions Opts) {
+  std::string Text;
+  for (unsigned I = 0; I != JITBench; ++I)
+    Text += formatv("def jb{0}(x y) if x < y then x * {0}.5 + y * (x - {0}) "
+                    "else (for i = 0, i < y in x = x * 0.5 + i) + x * y;\n",
+                    I);
+
+  unsigned MaxThreads =
+      JITThreads ? JITThreads : hardware_concurrency().compute_thread_count();
+  double OneThread = 0;
+  for (unsigned Threads = 1;; Threads = std::min(Threads * 2, MaxThreads)) {
+    Opts.NumThreads = Threads;
+    TheJIT = ExitOnErr(DivJIT::Create(Opts));
+    InitializeModule();
+
+    TheSource = SourceBuffer::getMemBuffer(Text, "jit-bench");
+    LexPos = 0;
+    getNextToken();
+    std::vector<ThreadSafeModule> Modules;
+    ParsedItem<B> Item;
+    while (parseItem(Item)) {
+      if (Item.Fn && Item.Fn->codegen())
+        Modules.push_back(TakeModule());
+      Item = ParsedItem<B>();
+      B::reset();
+    }
+    size_t NumModules = Modules.size();
+
+    auto Start = std::chrono::steady_clock::now();
+    ExitOnErr(TheJIT->addModules(std::move(Modules)));
+    std::chrono::duration<double> Secs =
+        std::chrono::steady_clock::now() - Start;
+    if (Threads == 1)
+      OneThread = Secs.count();
+
+    fprintf(stderr,
+            "%2u threads: compiled %zu functions in %.3fs (%.0f/s, %.2fx)\n",
+            Threads, NumModules, Secs.count(), NumModules / Secs.count(),
+            OneThread / Secs.count());
+    if (Threads == MaxThreads)
+      break;
+  }
+}
+
+/// PrintTierInfo - Report where each function stands under -tiered.
+static void PrintTierInfo() {
+  std::vector<TierInfo> Info = TheJIT->getTierInfo();
+  fprintf(stderr, "%-24s %-10s %12s\n", "function", "tier", "count");
+  for (const TierInfo &TI : Info) {
+    const char *Tier = TI.Tier == 2 ? "optimized"
+                       : TI.Promoting ? "promoting"
+                       : TI.Tier == 1 ? "baseline"
+                                      : "not run";
+    fprintf(stderr, "%-24s %-10s %12llu\n", TI.Name.c_str(), Tier,
+            (unsigned long long)TI.Count);
+  }
+  fprintf(stderr, "%zu tiered functions, %u promoted\n", Info.size(),
+          TheJIT->getNumPromotions());
+}
+
+/// PrintObjectCacheStats - Report what the object cache did under
+/// -cache-dir.
+static void PrintObjectCacheStats() {
+  DivObjectCache *Cache = TheJIT->getObjectCache();
+  if (!Cache)
+    return;
+  ObjectCacheStats S = Cache->getStats();
+  fprintf(stderr,
+          "object cache %s: %u hits, %u misses, %u stored, %u evicted; "
+          "%llu objects, %.1f MB\n",
+          Cache->getDirectory().c_str(), S.Hits, S.Misses, S.Stores,
+          S.Evictions, (unsigned long long)S.Files, S.Bytes / 1048576.0);
+}
+
+/// EmitAheadOfTime - Finish the module the input was compiled into under
+/// -emit, optimize it and write it out.
+static void EmitAheadOfTime() {
+  if (DBuilder)
+    DBuilder->finalize();
+  Module &M = *TheModule;
+  addLibraryFunctions(M);
+  if (Emit == EmitExecutable)
+    addMain(M, AOTExprs);
+  else if (!AOTExprs.empty())
+    fprintf(stderr, "warning: only executables run top-level expressions; "
+                    "%zu ignored\n",
+            AOTExprs.size());
+
+  StringRef Stem =
+      InputFilename == "-" ? "a" : sys::path::stem(InputFilename);
+  std::string Output = OutputFilename;
+  if (Output.empty())
+    Output = Emit == EmitObject   ? (Stem + ".o").str()
+             : Emit == EmitShared ? (Stem + ".so").str()
+                                  : "a.out";
+
+  SmallString<128> Header(HeaderFilename);
+  if (Header.empty() && Emit == EmitShared) {
+    Header = Output;
+    sys::path::replace_extension(Header, "h");
+  }
+  if (!Header.empty())
+    ExitOnErr(writeCHeader(M, Header));
+
+  // The IR for each definition is what the JIT was given, so its counts
+  // from JIT'd runs apply.
+  bool Annotated = false;
+  if (!PGOUse.empty())
+    for (Function &F : M)
+      if (!F.isDeclaration())
+        Annotated |= TheProfileData.annotate(F, F.getName());
+  if (Annotated)
+    TheProfileData.setSummary(M);
+
+  optimizeModule(M, OptLevel, AOTTarget.get());
+  if (Emit == EmitObject)
+    return ExitOnErr(emitObjectFile(M, *AOTTarget, Output));
+
+  SmallString<128> Obj;
+  if (std::error_code EC = sys::fs::createTemporaryFile("div", "o", Obj))
+    ExitOnErr(createStringError(EC, "cannot create a temporary file"));
+  FileRemover RemoveObj(Obj);
+  ExitOnErr(emitObjectFile(M, *AOTTarget, Obj));
+  ExitOnErr(linkObject(Obj, Output, Emit == EmitShared));
+}
+
+/// ITLBMisses, PageFaults - Counted from startup under -link-stats.
+static PerfCounter ITLBMisses, PageFaults;
+
+/// PrintLinkStatistics - Report what linking cost under -link-stats.
+static void PrintLinkStatistics() {
+  CodeMemoryStats S = TheJIT->getCodeMemoryStats();
+  fprintf(stderr, "linker: %s\n", S.Manager);
+  fprintf(stderr,
+          "  %llu objects; %llu system calls: %llu mmap, %llu mprotect, "
+          "%llu munmap, %llu other\n",
+          (unsigned long long)S.Allocations,
+          (unsigned long long)S.getSyscalls(), (unsigned long long)S.Maps,
+          (unsigned long long)S.Protects, (unsigned long long)S.Unmaps,
+          (unsigned long long)S.Other);
+  fprintf(stderr, "  peak memory: %.1f KB of code pages, %.1f KB in all\n",
+          S.CodeBytes / 1024.0, S.TotalBytes / 1024.0);
+  if (ITLBMisses.isAvailable())
+    fprintf(stderr, "  iTLB misses: %llu\n",
+            (unsigned long long)ITLBMisses.read());
+  else
+    fprintf(stderr, "  iTLB misses: not counted on this system\n");
+  if (PageFaults.isAvailable())
+    fprintf(stderr, "  page faults: %llu\n",
+            (unsigned long long)PageFaults.read());
+}
+
+/// TheProfiler - The sampling profiler, under -profile.
+static std::unique_ptr<SamplingProfiler> TheProfiler;
+
+/// ReportProfile - Stop the profiler, print the flat profile and write the
+/// folded stacks.
+static void ReportProfile() {
+  TheProfiler->stop();
+  std::error_code EC;
+  raw_fd_ostream Folded(ProfileFolded, EC, sys::fs::OF_Text);
+  if (EC)
+    LogJITError(createStringError(EC, "cannot open '" + ProfileFolded +
+                                          "': " + EC.message()));
+  TheProfiler->report(stderr, EC ? nullptr : &Folded);
+}
+
+/// writeTimingFile - Have Write write to the file Path.
+static void writeTimingFile(StringRef Path,
+                            function_ref<void(raw_ostream &)> Write) {
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+  if (EC)
+    return LogJITError(createStringError(EC, "cannot open '" + Path +
+                                                 "': " + EC.message()));
+  Write(OS);
+}
+
+/// ReportTiming - Report the phase times as -time-phases, -time-phases-json
+/// and -time-trace ask, and LLVM's pass times under -time-passes.
+static void ReportTiming() {
+  if (TimePhases)
+    TheTimer.printTable(stderr);
+  if (!TimePhasesJSON.empty())
+    writeTimingFile(TimePhasesJSON,
+                    [](raw_ostream &OS) { TheTimer.writeJSON(OS); });
+  if (!TimeTrace.empty())
+    writeTimingFile(TimeTrace,
+                    [](raw_ostream &OS) { TheTimer.writeTrace(OS); });
+  printPassTimes();
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Div compiler\n");
+  ExitOnErr.setBanner(std::string(argv[0]) + ": ");
+
+  if (InputFilename == "-")
+    TheSource = SourceBuffer::getSTDIN();
+  else
+    TheSource = ExitOnErr(SourceBuffer::getFile(InputFilename));
+
+  KSDbgInfo.Enabled = DebugInfoFlag;
+  if (InputFilename != "-") {
+    SmallString<128> Path(InputFilename);
+    sys::fs::make_absolute(Path);
+    KSDbgInfo.FileName = sys::path::filename(Path).str();
+    KSDbgInfo.Directory = sys::path::parent_path(Path).str();
+  }
+
+  TheTimer.Enabled =
+      TimePhases || !TimePhasesJSON.empty() || !TimeTrace.empty();
+  TheTimer.Tracing = !TimeTrace.empty();
+
+  UseVectorScan = !ScalarLexer;
+  if (LexOnly) {
+    LexInput();
+    return 0;
+  }
+
+  // Install standard binary operators.
+  // 1 is lowest precedence.
+  Operators.addBuiltin('=', 2);
+  Operators.addBuiltin('<', 10);
+  Operators.addBuiltin('+', 20);
+  Operators.addBuiltin('-', 20);
+  Operators.addBuiltin('*', 40); // highest.
+
+  if (ParseOnly) {
+    UseFlatAST ? ParseInput<FlatBuilder>(false)
+               : ParseInput<TreeBuilder>(false);
+    ReportTiming();
+    return 0;
+  }
+
+  if (PrintLinkStats) {
+    ITLBMisses.openITLBMisses();
+    PageFaults.openPageFaults();
+  }
+
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
 
-  // Install standard binary operators.
-  // 1 is lowest precedence.
-  BinopPrecedence['='] = 2;
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40; // highest.
-
-  // Prime the first token.
-  printf("\e[32;1mDIV COMPILER\e[0m\n");
-  fprintf(stderr, "\e[32;1m[DIV] \x1b[34;1m>\x1b[0m ");
-  getNextToken();
+  if (OptLevel > 3 || CodeGenOptLevel > 3) {
+    fprintf(stderr, "%s: optimization levels must be 0 to 3\n", argv[0]);
+    return 1;
+  }
+  DivJITOptions JITOpts;
+  JITOpts.OptLevel = OptLevel;
+  JITOpts.CPU = TargetCPU;
+  JITOpts.Features = TargetFeatures;
+  JITOpts.Lazy = LazyCompile;
+  JITOpts.NumThreads = JITThreads;
+  JITOpts.Tiered = TieredCompile;
+  JITOpts.TierThreshold = TierThreshold;
+  JITOpts.CacheDir = CacheDir;
+  JITOpts.CacheSize = CacheSize << 20;
+  JITOpts.JITLink = UseJITLink;
+  JITOpts.HugePages = HugePages;
+  JITOpts.PerfOutputs =
+      (PerfMapFile ? PerfMap : 0) | (JITDumpFile ? PerfJITDump : 0);
+  JITOpts.FramePointers = JITOpts.SymbolTable = ProfileRun;
+  if (!PGOUse.empty())
+    ExitOnErr(TheProfileData.read(PGOUse));
+  if (TieredCompile || !PGOGen.empty() || !PGOUse.empty())
+    JITOpts.Profile = &TheProfileData;
+  JITOpts.ProfileGen = !PGOGen.empty();
+  if (TargetCodeModel.getNumOccurrences())
+    JITOpts.CodeModel = TargetCodeModel;
+  if (CodeGenOptLevel.getNumOccurrences())
+    JITOpts.CodeGenLevel = (CodeGenOpt::Level)(unsigned)CodeGenOptLevel;
+  if (Emit != EmitJIT) {
+    if (Instrument || !PGOGen.empty()) {
+      fprintf(stderr, "%s: -%s is only for JIT'd code\n", argv[0],
+              Instrument ? "instrument" : "pgo-gen");
+      return 1;
+    }
+    // Position-independent code goes in shared libraries and in the PIE
+    // executables most systems now link by default.
+    JITTargetMachineBuilder JTMB = ExitOnErr(
+        getTargetMachineBuilder(JITOpts, Triple(sys::getProcessTriple())));
+    JTMB.setRelocationModel(Reloc::PIC_);
+    AOTTarget = ExitOnErr(JTMB.createTargetMachine());
+  } else {
+    TheJIT = ExitOnErr(DivJIT::Create(JITOpts));
+    InstrumentCalls = Instrument;
+    if (ProfileRun) {
+      TheProfiler =
+          std::make_unique<SamplingProfiler>(TheJIT->getSymbolTable());
+      ExitOnErr(TheProfiler->start(ProfileInterval));
+    }
+  }
 
-  TheJIT = ExitOnErr(DivJIT::Create());
+  if (PrintTarget) {
+    const TargetMachine &TM =
+        AOTTarget ? *AOTTarget : TheJIT->getTargetMachine();
+    fprintf(stderr, "target: %s, cpu: %s, features: %s\n",
+            TM.getTargetTriple().str().c_str(), TM.getTargetCPU().str().c_str(),
+            TM.getTargetFeatureString().str().c_str());
+  }
 
   InitializeModule();
 
-  // Add the current debug info version into the module.
-  TheModule->addModuleFlag(Module::Warning, "Debug Info Version",
-                           DEBUG_METADATA_VERSION);
+  if (CodegenOnly) {
+    UseFlatAST ? ParseInput<FlatBuilder>(true) : ParseInput<TreeBuilder>(true);
+    ReportTiming();
+    return 0;
+  }
 
-  // Darwin only supports dwarf2.
-  if (Triple(sys::getProcessTriple()).isOSDarwin())
-    TheModule->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 2);
+  if (JITBench) {
+    UseFlatAST ? JITBenchmark<FlatBuilder>(JITOpts)
+               : JITBenchmark<TreeBuilder>(JITOpts);
+    return 0;
+  }
 
-  // Construct the DIBuilder, we do this here because we need the module.
-  DBuilder = std::make_unique<DIBuilder>(*TheModule);
+  if (DepthBench) {
+    UseFlatAST ? DepthBenchmark<FlatBuilder>() : DepthBenchmark<TreeBuilder>();
+    return 0;
+  }
 
-  // Create the compile unit for the module.
-  // Currently down as "fib.ks" as a filename since we're redirecting stdin
-  // but we'd like actual source locations.
-  KSDbgInfo.TheCU = DBuilder->createCompileUnit(
-      dwarf::DW_LANG_C, DBuilder->createFile("fib.ks", "."),
-      "Div Compiler", false, "", 0);
+  if (!AOTTarget)
+    printf("\e[32;1mDIV COMPILER\e[0m\n");
 
-  // Run the main "interpreter loop" now.
-  MainLoop();
+  // A whole file can be parsed up front, in parallel, rather than item by item.
+  bool Compiled =
+      ParseThreads && (UseFlatAST ? CompileInParallel<FlatBuilder>()
+                                  : CompileInParallel<TreeBuilder>());
+  if (!Compiled) {
+    // Prime the first token.
+    fprintf(stderr, "\e[32;1m[DIV] \x1b[34;1m>\x1b[0m ");
+    getNextToken();
 
-  // Finalize the debug info.
-  DBuilder->finalize();
+    // Run the main "interpreter loop" now.
+    UseFlatAST ? MainLoop<FlatBuilder>() : MainLoop<TreeBuilder>();
+  }
 
-  // Print out all of the generated code.
-  TheModule->print(errs(), nullptr);
+  if (AOTTarget) {
+    EmitAheadOfTime();
+    ReportTiming();
+    return 0;
+  }
 
+  if (PrintTiers)
+    PrintTierInfo();
+  if (PrintCacheStats)
+    PrintObjectCacheStats();
+  if (PrintLinkStats)
+    PrintLinkStatistics();
+  if (TheProfiler)
+    ReportProfile();
+  if (InstrumentCalls)
+    CallStats::get().report(stderr);
+  if (!PGOGen.empty())
+    if (Error Err = TheProfileData.write(PGOGen))
+      LogJITError(std::move(Err));
+  ReportTiming();
+
+  // Wait for the JIT's threads and free its code here, rather than in a
+  // static destructor, after what they use may already be gone.
+  TheJIT.reset();
   return 0;
 }
 
@@ -0,0 +1,169 @@
+//===- aot.hh - Ahead-of-time compilation -----------------------*- C++ -*-===//
+//
+// With -emit, the whole input is compiled into one module, optimized and
+// written out as an object file, or linked by the system's C compiler into an
+// executable or a shared library.  Code linked that way never sees the JIT,
+// so the library functions it may call, putchard and printd, are defined in
+// the module itself, and an executable gets a main that runs the top-level
+// expressions in order.  A C header can declare the definitions, each taking
+// and returning doubles, for C and C++ code to call.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_AOT_HH
+#define DIV_AOT_HH
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "timing.hh"
+#include <cstdlib>
+#include <string>
+
+/// defineLibraryFunction - Give the declaration of Name in M, if it has one,
+/// a body that prints its argument to stderr with Format, as an int if
+/// AsChar, else as a double, and returns 0.  It is internal to M, so that
+/// two libraries of div code can be linked into one program.
+static inline void defineLibraryFunction(llvm::Module &M, llvm::StringRef Name,
+                                         llvm::StringRef Format, bool AsChar) {
+  llvm::Function *F = M.getFunction(Name);
+  llvm::LLVMContext &Ctx = M.getContext();
+  llvm::Type *DoubleTy = llvm::Type::getDoubleTy(Ctx);
+  if (!F || !F->isDeclaration() || F->arg_size() != 1 ||
+      F->getReturnType() != DoubleTy || F->getArg(0)->getType() != DoubleTy)
+    return;
+
+  llvm::IRBuilder<> B(llvm::BasicBlock::Create(Ctx, "entry", F));
+  llvm::Type *IntTy = B.getInt32Ty();
+  llvm::FunctionCallee Dprintf = M.getOrInsertFunction(
+      "dprintf", llvm::FunctionType::get(IntTy, {IntTy, B.getInt8PtrTy()},
+                                         /*isVarArg=*/true));
+  llvm::Value *X = F->getArg(0);
+  if (AsChar)
+    X = B.CreateSExt(B.CreateFPToSI(X, B.getInt8Ty()), IntTy);
+  B.CreateCall(Dprintf, {B.getInt32(2), B.CreateGlobalStringPtr(Format), X});
+  B.CreateRet(llvm::ConstantFP::get(DoubleTy, 0.0));
+  F->setLinkage(llvm::GlobalValue::InternalLinkage);
+}
+
+/// addLibraryFunctions - Define whichever of the library functions M calls.
+static inline void addLibraryFunctions(llvm::Module &M) {
+  defineLibraryFunction(M, "putchard", "%c", true);
+  defineLibraryFunction(M, "printd", "%f\n", false);
+}
+
+/// addMain - Define main in M to call each of Exprs, the top-level
+/// expressions, in turn and print its value on stdout.
+static inline void addMain(llvm::Module &M,
+                           llvm::ArrayRef<std::string> Exprs) {
+  llvm::LLVMContext &Ctx = M.getContext();
+  llvm::IRBuilder<> B(Ctx);
+  llvm::Function *Main = llvm::Function::Create(
+      llvm::FunctionType::get(B.getInt32Ty(), false),
+      llvm::GlobalValue::ExternalLinkage, "main", M);
+  B.SetInsertPoint(llvm::BasicBlock::Create(Ctx, "entry", Main));
+
+  llvm::FunctionCallee Printf = M.getOrInsertFunction(
+      "printf", llvm::FunctionType::get(B.getInt32Ty(), {B.getInt8PtrTy()},
+                                        /*isVarArg=*/true));
+  llvm::Value *Format = B.CreateGlobalStringPtr("%f\n");
+  for (const std::string &Name : Exprs)
+    B.CreateCall(Printf, {Format, B.CreateCall(M.getFunction(Name))});
+  B.CreateRet(B.getInt32(0));
+}
+
+/// isCIdentifier - Whether Name can be declared as it is in C.
+static inline bool isCIdentifier(llvm::StringRef Name) {
+  if (Name.empty() || llvm::isDigit(Name[0]))
+    return false;
+  for (char C : Name)
+    if (!llvm::isAlnum(C) && C != '_')
+      return false;
+  return true;
+}
+
+/// writeCHeader - Write a C header to Path that declares M's definitions.
+/// Operators, whose names are not identifiers, are left out.
+static inline llvm::Error writeCHeader(const llvm::Module &M,
+                                       llvm::StringRef Path) {
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_Text);
+  if (EC)
+    return llvm::createStringError(EC, "cannot open '" + Path +
+                                           "': " + EC.message());
+
+  std::string Guard = "DIV_";
+  for (char C : llvm::sys::path::filename(Path))
+    Guard += llvm::isAlnum(C) ? llvm::toUpper(C) : '_';
+
+  OS << "/* Generated by div.  Every function takes and returns doubles. */\n"
+     << "#ifndef " << Guard << "\n#define " << Guard << "\n\n"
+     << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+  for (const llvm::Function &F : M) {
+    if (F.isDeclaration() || !F.hasExternalLinkage() ||
+        F.getName() == "main" || !isCIdentifier(F.getName()))
+      continue;
+    OS << "double " << F.getName() << "(";
+    for (unsigned I = 0, E = F.arg_size(); I != E; ++I)
+      OS << (I ? ", " : "") << "double";
+    OS << (F.arg_empty() ? "void" : "") << ");\n";
+  }
+  OS << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif /* " << Guard << " */\n";
+  return llvm::Error::success();
+}
+
+/// emitObjectFile - Generate code for M with TM into an object file at Path.
+static inline llvm::Error emitObjectFile(llvm::Module &M,
+                                         llvm::TargetMachine &TM,
+                                         llvm::StringRef Path) {
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_None);
+  if (EC)
+    return llvm::createStringError(EC, "cannot open '" + Path +
+                                           "': " + EC.message());
+
+  // Code generation still runs on the legacy pass manager.
+  PhaseScope Timing(PhaseMachineCodegen);
+  llvm::legacy::PassManager PM;
+  if (TM.addPassesToEmitFile(PM, OS, nullptr, llvm::CGFT_ObjectFile))
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "the target cannot emit object files");
+  PM.run(M);
+  return llvm::Error::success();
+}
+
+/// linkObject - Link the object file Obj into an executable, or a shared
+/// library if Shared, at Output.  The C compiler named by $CC, or else cc,
+/// does the linking, so that the C library comes along.
+static inline llvm::Error linkObject(llvm::StringRef Obj,
+                                     llvm::StringRef Output, bool Shared) {
+  const char *CC = getenv("CC");
+  auto Linker = llvm::sys::findProgramByName(CC && *CC ? CC : "cc");
+  if (!Linker)
+    return llvm::createStringError(Linker.getError(),
+                                   "cannot find a C compiler to link with");
+
+  llvm::SmallVector<llvm::StringRef, 6> Args = {*Linker, Obj, "-o", Output};
+  if (Shared)
+    Args.push_back("-shared");
+  std::string ErrMsg;
+  PhaseScope Timing(PhaseLink);
+  if (llvm::sys::ExecuteAndWait(*Linker, Args, llvm::None, {}, 0, 0, &ErrMsg))
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "linking '" + Output + "' failed" +
+                                       (ErrMsg.empty() ? "" : ": " + ErrMsg));
+  return llvm::Error::success();
+}
+
+#endif // DIV_AOT_HH
@@ -0,0 +1,239 @@
+//===- callstats.hh - Call counts and cycles per function -------*- C++ -*-===//
+//
+// Under -instrument every function div generates reads the cycle counter on
+// entry and again before it returns, and hands each reading to the runtime
+// below.  That keeps, for each thread, a shadow stack of the calls in flight
+// and a counter block with a slot per function, so threads never share a
+// counter.  A call's cycles are charged to its function inclusively, once
+// for the outermost of any recursive calls to it, and exclusively, less the
+// cycles of the calls it makes.
+//
+// Functions are numbered in the order they are generated and the IR names
+// the runtime rather than its address, so instrumented code is as cacheable
+// as any other.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_CALLSTATS_HH
+#define DIV_CALLSTATS_HH
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/// CallStats - The function numbering and every thread's counters.
+class CallStats {
+  /// Counters - One function's totals on one thread.
+  struct Counters {
+    uint64_t Calls = 0;
+    uint64_t Outermost = 0; // Calls not made, however deeply, by itself.
+    uint64_t Inclusive = 0;
+    uint64_t Exclusive = 0;
+    uint64_t Depth = 0; // Calls in flight, for recursion.
+  };
+
+  /// Call - A call in flight.
+  struct Call {
+    uint32_t Id;
+    uint64_t Start;
+    uint64_t Children; // Cycles spent in the calls it made.
+  };
+
+  /// ThreadStats - A thread's counters and shadow stack.  The thread only
+  /// takes the lock to grow its counters; a report takes it to read them.
+  struct ThreadStats {
+    std::mutex Lock;
+    std::vector<Counters> Fns;
+    std::vector<Call> Stack;
+  };
+
+  std::mutex Lock;
+  llvm::StringMap<uint32_t> Ids;
+  std::vector<std::string> Names;
+  // Kept after their threads exit, for the report.
+  std::vector<std::unique_ptr<ThreadStats>> Threads;
+  std::chrono::steady_clock::time_point StartTime;
+  uint64_t StartCycles = 0;
+
+  CallStats() : StartTime(std::chrono::steady_clock::now()) {
+    StartCycles = readCycles();
+  }
+
+public:
+  /// get - The one set of statistics, which outlives every thread that
+  /// might still be running instrumented code at exit.
+  static CallStats &get() {
+    static CallStats *Stats = new CallStats();
+    return *Stats;
+  }
+
+  /// getId - The number of the function called Name.  Different code for
+  /// the same function, such as a tiered function's, shares a number.
+  uint32_t getId(llvm::StringRef Name) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto Ins = Ids.insert({Name, (uint32_t)Names.size()});
+    if (Ins.second)
+      Names.push_back(Name.str());
+    return Ins.first->second;
+  }
+
+  /// instrumentEntry - Count a call to F, numbered Id, at the insertion
+  /// point of B, which should be in F's entry block.
+  static void instrumentEntry(llvm::IRBuilder<> &B, llvm::Function &F,
+                              uint32_t Id) {
+    llvm::Module &M = *F.getParent();
+    llvm::FunctionCallee Enter = M.getOrInsertFunction(
+        "__div_instr_enter", B.getVoidTy(), B.getInt32Ty(), B.getInt64Ty());
+    B.CreateCall(Enter, {B.getInt32(Id), readCycleCounter(B, M)});
+  }
+
+  /// instrumentExit - Finish the call counted by instrumentEntry, at the
+  /// insertion point of B, which should be just before F returns.
+  static void instrumentExit(llvm::IRBuilder<> &B, llvm::Function &F) {
+    llvm::Module &M = *F.getParent();
+    llvm::FunctionCallee Exit = M.getOrInsertFunction(
+        "__div_instr_exit", B.getVoidTy(), B.getInt64Ty());
+    B.CreateCall(Exit, {readCycleCounter(B, M)});
+  }
+
+  /// enter - A call to function Id started at cycle Now.
+  void enter(uint32_t Id, uint64_t Now) {
+    ThreadStats &T = getThread();
+    if (Id >= T.Fns.size()) {
+      std::lock_guard<std::mutex> Guard(T.Lock);
+      T.Fns.resize(std::max<size_t>(Id + 1, T.Fns.size() * 2));
+    }
+    Counters &C = T.Fns[Id];
+    ++C.Calls;
+    C.Outermost += !C.Depth++;
+    T.Stack.push_back({Id, Now, 0});
+  }
+
+  /// exit - The innermost call in flight returned at cycle Now.
+  void exit(uint64_t Now) {
+    ThreadStats &T = getThread();
+    if (T.Stack.empty())
+      return;
+    Call Done = T.Stack.back();
+    T.Stack.pop_back();
+    uint64_t Cycles = Now - Done.Start;
+    Counters &C = T.Fns[Done.Id];
+    C.Exclusive += Cycles - std::min(Cycles, Done.Children);
+    if (--C.Depth == 0)
+      C.Inclusive += Cycles;
+    if (!T.Stack.empty())
+      T.Stack.back().Children += Cycles;
+  }
+
+  /// report - Print the Top functions by exclusive cycles to OS, with their
+  /// call counts and average cycles per call, summed over every thread.
+  /// Calls still in flight are not counted in yet.
+  void report(FILE *OS, size_t Top = 20) {
+    std::vector<Counters> Totals;
+    std::vector<std::string> FnNames;
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      FnNames = Names;
+      for (auto &T : Threads) {
+        std::lock_guard<std::mutex> ThreadGuard(T->Lock);
+        if (Totals.size() < T->Fns.size())
+          Totals.resize(T->Fns.size());
+        for (size_t I = 0, E = T->Fns.size(); I != E; ++I) {
+          Totals[I].Calls += T->Fns[I].Calls;
+          Totals[I].Outermost += T->Fns[I].Outermost;
+          Totals[I].Inclusive += T->Fns[I].Inclusive;
+          Totals[I].Exclusive += T->Fns[I].Exclusive;
+        }
+      }
+    }
+
+    std::vector<size_t> Order;
+    uint64_t AllCycles = 0;
+    for (size_t I = 0; I != Totals.size(); ++I)
+      if (Totals[I].Calls) {
+        Order.push_back(I);
+        AllCycles += Totals[I].Exclusive;
+      }
+    std::stable_sort(Order.begin(), Order.end(), [&](size_t A, size_t B) {
+      return Totals[A].Exclusive > Totals[B].Exclusive;
+    });
+
+    double NsPerCycle = getNsPerCycle();
+    fprintf(OS, "call stats: %zu functions called, %.3f Gcycles", Order.size(),
+            AllCycles / 1e9);
+    if (NsPerCycle)
+      fprintf(OS, " (%.3f ns per cycle)", NsPerCycle);
+    fprintf(OS, "\n");
+    if (Order.empty())
+      return;
+    fprintf(OS, "  %12s %10s %10s %7s %13s %13s  %s\n", "calls", "incl Mcyc",
+            "excl Mcyc", "excl", NsPerCycle ? "avg ns" : "avg cyc",
+            NsPerCycle ? "self ns" : "self cyc", "function");
+    for (size_t I = 0; I != Order.size() && I != Top; ++I) {
+      const Counters &C = Totals[Order[I]];
+      // A recursive function's inclusive cycles are those of its outermost
+      // calls, and so is its average latency.
+      double Scale = NsPerCycle ? NsPerCycle : 1;
+      double Share = AllCycles ? 100.0 * C.Exclusive / AllCycles : 0;
+      fprintf(OS, "  %12llu %10.3f %10.3f %6.2f%% %13.1f %13.1f  %s\n",
+              (unsigned long long)C.Calls, C.Inclusive / 1e6,
+              C.Exclusive / 1e6, Share,
+              Scale * C.Inclusive / std::max<uint64_t>(C.Outermost, 1),
+              Scale * C.Exclusive / C.Calls, FnNames[Order[I]].c_str());
+    }
+  }
+
+private:
+  /// readCycleCounter - Emit a read of the cycle counter.  Targets without
+  /// one read 0.
+  static llvm::Value *readCycleCounter(llvm::IRBuilder<> &B, llvm::Module &M) {
+    return B.CreateCall(llvm::Intrinsic::getDeclaration(
+        &M, llvm::Intrinsic::readcyclecounter));
+  }
+
+  /// readCycles - What readCycleCounter reads, or 0 where the host's counter
+  /// cannot be read from here.
+  static uint64_t readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+  }
+
+  /// getNsPerCycle - The length of a cycle, timed since the statistics were
+  /// created, or 0 if cycles cannot be timed.
+  double getNsPerCycle() const {
+    uint64_t Cycles = readCycles() - StartCycles;
+    auto Ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - StartTime)
+                  .count();
+    return StartCycles && Cycles ? (double)Ns / Cycles : 0;
+  }
+
+  ThreadStats &getThread() {
+    static thread_local ThreadStats *Current = nullptr;
+    if (!Current) {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Threads.push_back(std::make_unique<ThreadStats>());
+      Current = Threads.back().get();
+    }
+    return *Current;
+  }
+};
+
+#endif // DIV_CALLSTATS_HH
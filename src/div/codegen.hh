@@ -5,13 +5,9 @@
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/DerivedTypes.h>
-#include <llvm/IR/LegacyPassManager.h>
 #include <llvm/Support/Error.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Target/TargetMachine.h>
-#include <llvm/Transforms/InstCombine/InstCombine.h>
-#include <llvm/Transforms/Scalar.h>
-#include <llvm/Transforms/Scalar/GVN.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
@@ -40,7 +36,6 @@ static unique_ptr<Module> mod;
 static unique_ptr<IRBuilder<>> Builder;
 static std::map<string, Value *> vals;
 static std::unique_ptr<llvm::orc::DivJIT> jit;
-static std::unique_ptr<legacy::FunctionPassManager> fpm;
 static std::map<string, unique_ptr<ProtoAST>> fnprotos;
 static ExitOnError ExitOnErr;
 
@@ -148,9 +143,6 @@ Function *FnAST::codegen() {
     // Validate the generated code, checking for consistency.
     verifyFunction(*fn);
 
-    // Run the optimizer on the function.
-    fpm->run(*fn);
-
     return fn;
   }
 
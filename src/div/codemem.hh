@@ -0,0 +1,456 @@
+//===- codemem.hh - Memory for JIT'd code -----------------------*- C++ -*-===//
+//
+// RuntimeDyld gives each object a SectionMemoryManager of its own, which maps
+// fresh pages for its code and data and then mprotects them.  Thousands of
+// small modules mean thousands of mappings, most of each page left empty, and
+// code spread over as many pages as there are functions.
+//
+// SlabMemoryManager, for JITLink, instead packs every object's segments into
+// three pools, one each for code, read-only data and writable data, taken
+// out of a single shared memory object.  The object is mapped twice: once
+// writable, for the linker to fill in, and once with each pool's proper
+// protection, for the code to run from.  Setting up the pools takes a handful
+// of system calls, after which linking an object takes none.  Memory freed
+// when a module is removed goes back to its pool for reuse.
+//
+// CountingMemoryMapper counts the system calls the SectionMemoryManagers make,
+// for comparison.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_CODEMEM_HH
+#define DIV_CODEMEM_HH
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ExecutionEngine/JITLink/JITLinkMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/Shared/AllocationActions.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/// CodeMemoryStats - What a memory manager has asked of the system, and how
+/// much memory it has to show for it.
+struct CodeMemoryStats {
+  const char *Manager = "";
+  uint64_t Maps = 0;     // mmap calls.
+  uint64_t Protects = 0; // mprotect calls.
+  uint64_t Unmaps = 0;   // munmap calls.
+  uint64_t Other = 0;    // Any other system calls, such as madvise.
+  uint64_t Allocations = 0;
+  /// CodeBytes - The most memory ever mapped for code at once, counted in
+  /// whole pages: the footprint of the code in memory and in the TLB.
+  uint64_t CodeBytes = 0;
+  /// TotalBytes - The same, for code and data together.
+  uint64_t TotalBytes = 0;
+
+  uint64_t getSyscalls() const { return Maps + Protects + Unmaps + Other; }
+};
+
+/// CountingMemoryMapper - The SectionMemoryManager's default mapper, calling
+/// straight into the system, with counts.  One is shared by every
+/// SectionMemoryManager the JIT creates.
+class CountingMemoryMapper
+    : public llvm::SectionMemoryManager::MemoryMapper {
+  std::mutex Lock; // Guards everything.
+  uint64_t Objects = 0, Maps = 0, Protects = 0, Unmaps = 0;
+  uint64_t CodeBytes = 0, TotalBytes = 0;
+  uint64_t PeakCodeBytes = 0, PeakTotalBytes = 0;
+  /// CodeBlocks - The blocks mapped for code, since releaseMappedMemory is
+  /// not told what a block was for.
+  llvm::DenseSet<void *> CodeBlocks;
+
+public:
+  /// countObject - Note that a SectionMemoryManager has been created, for
+  /// one more object.
+  void countObject() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    ++Objects;
+  }
+
+  llvm::sys::MemoryBlock
+  allocateMappedMemory(llvm::SectionMemoryManager::AllocationPurpose Purpose,
+                       size_t NumBytes,
+                       const llvm::sys::MemoryBlock *const NearBlock,
+                       unsigned Flags, std::error_code &EC) override {
+    llvm::sys::MemoryBlock MB = llvm::sys::Memory::allocateMappedMemory(
+        NumBytes, NearBlock, Flags, EC);
+    std::lock_guard<std::mutex> Guard(Lock);
+    ++Maps;
+    if (MB.base()) {
+      if (Purpose == llvm::SectionMemoryManager::AllocationPurpose::Code) {
+        CodeBlocks.insert(MB.base());
+        CodeBytes += MB.allocatedSize();
+        PeakCodeBytes = std::max(PeakCodeBytes, CodeBytes);
+      }
+      TotalBytes += MB.allocatedSize();
+      PeakTotalBytes = std::max(PeakTotalBytes, TotalBytes);
+    }
+    return MB;
+  }
+
+  std::error_code protectMappedMemory(const llvm::sys::MemoryBlock &Block,
+                                      unsigned Flags) override {
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      ++Protects;
+    }
+    return llvm::sys::Memory::protectMappedMemory(Block, Flags);
+  }
+
+  std::error_code releaseMappedMemory(llvm::sys::MemoryBlock &M) override {
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      ++Unmaps;
+      if (CodeBlocks.erase(M.base()))
+        CodeBytes -= M.allocatedSize();
+      TotalBytes -= M.allocatedSize();
+    }
+    return llvm::sys::Memory::releaseMappedMemory(M);
+  }
+
+  CodeMemoryStats getStats() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    CodeMemoryStats S;
+    S.Manager = "RuntimeDyld, SectionMemoryManager per object";
+    S.Maps = Maps;
+    S.Protects = Protects;
+    S.Unmaps = Unmaps;
+    S.Allocations = Objects;
+    S.CodeBytes = PeakCodeBytes;
+    S.TotalBytes = PeakTotalBytes;
+    return S;
+  }
+};
+
+/// SlabMemoryManager - A JITLink memory manager that packs objects into
+/// pools of shared pages.
+class SlabMemoryManager : public llvm::jitlink::JITLinkMemoryManager {
+  enum PoolKind { CodePool, ReadOnlyPool, ReadWritePool, NumPools };
+
+  /// Pool - Where in the shared memory a pool starts, and which parts of it
+  /// are free, by offset from there.
+  struct Pool {
+    uint64_t Start = 0;
+    std::map<uint64_t, uint64_t> Free;
+    uint64_t HighWater = 0;
+  };
+
+  struct Range {
+    unsigned Pool;
+    uint64_t Offset, Size;
+  };
+
+  /// AllocInfo - What an object was given, to give back when its module is
+  /// removed.  A FinalizedAlloc's address points to one.
+  struct AllocInfo {
+    llvm::SmallVector<Range, 3> Ranges;
+    std::vector<llvm::orc::shared::WrapperFunctionCall> DeallocActions;
+  };
+
+  class InFlight;
+
+  uint64_t PoolSize;
+  int FD = -1;
+  char *Working = nullptr; // The writable view.
+  char *Target = nullptr;  // The view code runs from.
+  void *Reserved[2] = {};  // The two mappings, before alignment.
+  size_t ReservedSize = 0;
+
+  std::mutex Lock; // Guards Pools and the counts that change.
+  Pool Pools[NumPools];
+  uint64_t Syscalls[4] = {}; // As CodeMemoryStats: maps, protects, ...
+  uint64_t Allocations = 0;
+  bool HugePages;
+
+  SlabMemoryManager(uint64_t PoolSize, bool HugePages)
+      : PoolSize(PoolSize), HugePages(HugePages) {
+    for (unsigned P = 0; P != NumPools; ++P) {
+      Pools[P].Start = P * PoolSize;
+      Pools[P].Free[0] = PoolSize;
+    }
+  }
+
+public:
+  /// Alignment - Of each view, and so of each pool: that of a huge page on
+  /// x86-64 and AArch64.
+  static constexpr uint64_t Alignment = 2 << 20;
+
+  /// Create - Set up the pools, each PoolSize bytes of address space, of
+  /// which only what is used takes up memory.  With HugePages, ask the
+  /// kernel to back them with transparent huge pages, which it does only
+  /// if it is configured to for shared memory.
+  static llvm::Expected<std::unique_ptr<SlabMemoryManager>>
+  Create(uint64_t PoolSize, bool HugePages) {
+    PoolSize = llvm::alignTo(PoolSize, Alignment);
+    std::unique_ptr<SlabMemoryManager> MM(
+        new SlabMemoryManager(PoolSize, HugePages));
+    if (llvm::Error Err = MM->map())
+      return std::move(Err);
+    return std::move(MM);
+  }
+
+  ~SlabMemoryManager() override {
+#ifdef __linux__
+    for (void *R : Reserved)
+      if (R)
+        munmap(R, ReservedSize);
+    if (FD >= 0)
+      close(FD);
+#endif
+  }
+
+  void allocate(const llvm::jitlink::JITLinkDylib *JD,
+                llvm::jitlink::LinkGraph &G,
+                OnAllocatedFunction OnAllocated) override;
+  using JITLinkMemoryManager::allocate;
+
+  void deallocate(std::vector<FinalizedAlloc> Allocs,
+                  OnDeallocatedFunction OnDeallocated) override {
+    llvm::Error Err = llvm::Error::success();
+    for (FinalizedAlloc &A : Allocs) {
+      std::unique_ptr<AllocInfo> Info(A.release().toPtr<AllocInfo *>());
+      Err = llvm::joinErrors(
+          std::move(Err),
+          llvm::orc::shared::runDeallocActions(Info->DeallocActions));
+      release(Info->Ranges);
+    }
+    OnDeallocated(std::move(Err));
+  }
+  using JITLinkMemoryManager::deallocate;
+
+  CodeMemoryStats getStats() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    CodeMemoryStats S;
+    S.Manager = HugePages ? "JITLink, shared slabs, huge pages asked for"
+                          : "JITLink, shared slabs";
+    S.Maps = Syscalls[0];
+    S.Protects = Syscalls[1];
+    S.Unmaps = Syscalls[2];
+    S.Other = Syscalls[3];
+    S.Allocations = Allocations;
+    uint64_t PageSize = llvm::sys::Process::getPageSizeEstimate();
+    for (unsigned P = 0; P != NumPools; ++P) {
+      uint64_t Bytes = llvm::alignTo(Pools[P].HighWater, PageSize);
+      if (P == CodePool)
+        S.CodeBytes = Bytes;
+      S.TotalBytes += Bytes;
+    }
+    return S;
+  }
+
+private:
+  /// map - Create the shared memory and map both views of it.
+  llvm::Error map() {
+#ifdef __linux__
+    uint64_t Size = NumPools * PoolSize;
+    ReservedSize = Size + Alignment;
+    auto Fail = [](const char *What) {
+      return llvm::createStringError(
+          std::error_code(errno, std::generic_category()),
+          "cannot set up JIT code memory: %s: %s", What, strerror(errno));
+    };
+
+    ++Syscalls[3];
+    FD = memfd_create("div-jit-code", MFD_CLOEXEC);
+    if (FD < 0)
+      return Fail("memfd_create");
+    ++Syscalls[3];
+    if (ftruncate(FD, Size) != 0)
+      return Fail("ftruncate");
+
+    // Reserve room for each view, aligned for huge pages, and map the memory
+    // over it.
+    char *Views[2];
+    for (unsigned V = 0; V != 2; ++V) {
+      ++Syscalls[0];
+      Reserved[V] = mmap(nullptr, ReservedSize, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (Reserved[V] == MAP_FAILED) {
+        Reserved[V] = nullptr;
+        return Fail("mmap");
+      }
+      Views[V] = (char *)llvm::alignTo((uintptr_t)Reserved[V], Alignment);
+    }
+    Working = Views[0];
+    Target = Views[1];
+
+    ++Syscalls[0];
+    if (mmap(Working, Size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             FD, 0) == MAP_FAILED)
+      return Fail("mmap");
+    const int Prot[NumPools] = {PROT_READ | PROT_EXEC, PROT_READ,
+                                PROT_READ | PROT_WRITE};
+    for (unsigned P = 0; P != NumPools; ++P) {
+      ++Syscalls[0];
+      if (mmap(Target + Pools[P].Start, PoolSize, Prot[P],
+               MAP_SHARED | MAP_FIXED, FD, Pools[P].Start) == MAP_FAILED)
+        return Fail("mmap");
+    }
+
+    if (HugePages) {
+      // Failure only means small pages.
+      Syscalls[3] += 2;
+      madvise(Working, Size, MADV_HUGEPAGE);
+      madvise(Target, Size, MADV_HUGEPAGE);
+    }
+    return llvm::Error::success();
+#else
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "JIT code slabs need Linux");
+#endif
+  }
+
+  static unsigned getPool(llvm::jitlink::MemProt Prot) {
+    unsigned Bits = static_cast<unsigned>(Prot);
+    if (Bits & static_cast<unsigned>(llvm::jitlink::MemProt::Exec))
+      return CodePool;
+    if (Bits & static_cast<unsigned>(llvm::jitlink::MemProt::Write))
+      return ReadWritePool;
+    return ReadOnlyPool;
+  }
+
+  /// take - Find Size bytes, aligned to Align, in pool P, first fit.
+  /// Returns false if there is no room.  Lock must be held.
+  bool take(unsigned P, uint64_t Size, uint64_t Align, uint64_t &Offset) {
+    Pool &Pl = Pools[P];
+    for (auto I = Pl.Free.begin(), E = Pl.Free.end(); I != E; ++I) {
+      uint64_t Begin = I->first, End = I->first + I->second;
+      uint64_t Start = llvm::alignTo(Begin, Align);
+      if (Start + Size > End)
+        continue;
+      Pl.Free.erase(I);
+      if (Start > Begin)
+        Pl.Free[Begin] = Start - Begin;
+      if (Start + Size < End)
+        Pl.Free[Start + Size] = End - (Start + Size);
+      Pl.HighWater = std::max(Pl.HighWater, Start + Size);
+      Offset = Start;
+      return true;
+    }
+    return false;
+  }
+
+  /// release - Give Ranges back to their pools.
+  void release(llvm::ArrayRef<Range> Ranges) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    giveBack(Ranges);
+  }
+
+  /// giveBack - Return Ranges to their pools, merging each with the free
+  /// space either side of it.  Lock must be held.
+  void giveBack(llvm::ArrayRef<Range> Ranges) {
+    for (const Range &R : Ranges) {
+      std::map<uint64_t, uint64_t> &Free = Pools[R.Pool].Free;
+      uint64_t Begin = R.Offset, Size = R.Size;
+      auto Next = Free.lower_bound(Begin);
+      if (Next != Free.end() && Begin + Size == Next->first) {
+        Size += Next->second;
+        Next = Free.erase(Next);
+      }
+      if (Next != Free.begin()) {
+        auto Prev = std::prev(Next);
+        if (Prev->first + Prev->second == Begin) {
+          Prev->second += Size;
+          continue;
+        }
+      }
+      Free[Begin] = Size;
+    }
+  }
+};
+
+/// InFlight - An object laid out in the pools and being linked.
+class SlabMemoryManager::InFlight
+    : public llvm::jitlink::JITLinkMemoryManager::InFlightAlloc {
+  SlabMemoryManager &MM;
+  llvm::jitlink::BasicLayout BL;
+  std::unique_ptr<AllocInfo> Info;
+
+public:
+  InFlight(SlabMemoryManager &MM, llvm::jitlink::BasicLayout BL,
+           std::unique_ptr<AllocInfo> Info)
+      : MM(MM), BL(std::move(BL)), Info(std::move(Info)) {}
+
+  void finalize(OnFinalizedFunction OnFinalized) override {
+    // The code was written through the other view.
+    for (const Range &R : Info->Ranges)
+      if (R.Pool == CodePool)
+        llvm::sys::Memory::InvalidateInstructionCache(
+            MM.Target + MM.Pools[R.Pool].Start + R.Offset, R.Size);
+
+    auto DeallocActions =
+        llvm::orc::shared::runFinalizeActions(BL.graphAllocActions());
+    if (!DeallocActions) {
+      MM.release(Info->Ranges);
+      return OnFinalized(DeallocActions.takeError());
+    }
+    Info->DeallocActions = std::move(*DeallocActions);
+    OnFinalized(FinalizedAlloc(
+        llvm::orc::ExecutorAddr::fromPtr(Info.release())));
+  }
+
+  void abandon(OnAbandonedFunction OnAbandoned) override {
+    MM.release(Info->Ranges);
+    OnAbandoned(llvm::Error::success());
+  }
+};
+
+inline void SlabMemoryManager::allocate(const llvm::jitlink::JITLinkDylib *JD,
+                                        llvm::jitlink::LinkGraph &G,
+                                        OnAllocatedFunction OnAllocated) {
+  llvm::jitlink::BasicLayout BL(G);
+  auto Info = std::make_unique<AllocInfo>();
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    ++Allocations;
+    for (auto &KV : BL.segments()) {
+      llvm::jitlink::BasicLayout::Segment &Seg = KV.second;
+      unsigned P = getPool(KV.first.getMemProt());
+      // Sixteen-byte granules keep the free lists short.
+      uint64_t Size = llvm::alignTo(Seg.ContentSize + Seg.ZeroFillSize, 16);
+      uint64_t Align = std::max<uint64_t>(Seg.Alignment.value(), 16);
+      uint64_t Offset;
+      if (!take(P, Size, Align, Offset)) {
+        giveBack(Info->Ranges);
+        return OnAllocated(llvm::createStringError(
+            llvm::inconvertibleErrorCode(),
+            "out of JIT code memory linking %s", G.getName().c_str()));
+      }
+      Info->Ranges.push_back({P, Offset, Size});
+    }
+  }
+
+  unsigned I = 0;
+  for (auto &KV : BL.segments()) {
+    llvm::jitlink::BasicLayout::Segment &Seg = KV.second;
+    const Range &R = Info->Ranges[I++];
+    uint64_t At = Pools[R.Pool].Start + R.Offset;
+    // Memory is reused, and zero-fill sections must start out zero.
+    memset(Working + At, 0, R.Size);
+    Seg.WorkingMem = Working + At;
+    Seg.Addr = llvm::orc::ExecutorAddr::fromPtr(Target + At);
+  }
+
+  if (llvm::Error Err = BL.apply()) {
+    release(Info->Ranges);
+    return OnAllocated(std::move(Err));
+  }
+  OnAllocated(
+      std::make_unique<InFlight>(*this, std::move(BL), std::move(Info)));
+}
+
+#endif // DIV_CODEMEM_HH
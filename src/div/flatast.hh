@@ -0,0 +1,284 @@
+//===- flatast.hh - Flat, index-based expression trees ----------*- C++ -*-===//
+//
+// An alternative to the ExprAST class hierarchy.  Nodes are rows in a handful
+// of parallel arrays, children are 32-bit indices into them, and passes walk
+// the arrays with a switch on the node kind rather than through virtual calls.
+//
+// Nodes are appended as the parser finishes them, so every child has a lower
+// index than its parent.  A bottom-up pass over an item is therefore a single
+// forward scan of the arrays.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_FLATAST_HH
+#define DIV_FLATAST_HH
+
+#include "symbol.hh"
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ArrayRef.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/// FlatKind - What a node is, and so how its operands are laid out.
+enum FlatKind : uint8_t {
+  FK_Number,   // LHS: index into Numbers.
+  FK_Variable, // LHS: variable name.
+  FK_Unary,    // Op; LHS: operand.
+  FK_Binary,   // Op; LHS, RHS: operands.
+  FK_Call,     // LHS: callee; RHS: Extra[RHS] args, then the args.
+  FK_If,       // LHS: condition; RHS: Extra[RHS..+1] then, else.
+  FK_For,      // LHS: variable; RHS: Extra[RHS..+3] start, end, step, body.
+  FK_Var,      // LHS: body; RHS: Extra[RHS] vars, then (name, init) pairs.
+};
+
+/// NodeRef - The index of a node in a FlatAST.  A default-constructed or null
+/// NodeRef refers to no node, which is how the parser reports a failure.
+class NodeRef {
+  uint32_t Idx = ~0u;
+
+public:
+  NodeRef() = default;
+  NodeRef(std::nullptr_t) {}
+  explicit NodeRef(uint32_t Idx) : Idx(Idx) {}
+
+  explicit operator bool() const { return Idx != ~0u; }
+  uint32_t getIndex() const { return Idx; }
+};
+
+/// FlatAST - The expressions of one top-level item.  clear() keeps the
+/// storage, so after the first few items parsing allocates nothing.
+class FlatAST {
+  struct Tag {
+    FlatKind Kind;
+    char Op;
+  };
+  struct Operands {
+    uint32_t LHS, RHS;
+  };
+
+  /// The node arrays share one size and capacity, so appending a node costs a
+  /// single bounds check rather than one per array.
+  uint32_t NumNodes = 0, Capacity = 0;
+  std::unique_ptr<Tag[]> Tags;
+  std::unique_ptr<Operands[]> Ops;
+  std::unique_ptr<size_t[]> Locs;
+
+  std::vector<double> Numbers;
+  std::vector<uint32_t> Extra;
+
+  /// FirstFoldable - The first binary operator built with two literal
+  /// operands since the last fold.  Nothing before it can fold, so
+  /// foldConstants starts there.
+  uint32_t FirstFoldable = ~0u;
+
+  void grow() {
+    uint32_t NewCapacity = Capacity ? Capacity * 2 : 256;
+    auto NewTags = std::make_unique<Tag[]>(NewCapacity);
+    auto NewOps = std::make_unique<Operands[]>(NewCapacity);
+    auto NewLocs = std::make_unique<size_t[]>(NewCapacity);
+    std::copy(Tags.get(), Tags.get() + NumNodes, NewTags.get());
+    std::copy(Ops.get(), Ops.get() + NumNodes, NewOps.get());
+    std::copy(Locs.get(), Locs.get() + NumNodes, NewLocs.get());
+    Tags = std::move(NewTags);
+    Ops = std::move(NewOps);
+    Locs = std::move(NewLocs);
+    Capacity = NewCapacity;
+  }
+
+  NodeRef add(FlatKind Kind, char Op, size_t Loc, uint32_t LHS, uint32_t RHS) {
+    if (NumNodes == Capacity)
+      grow();
+    uint32_t I = NumNodes++;
+    Tags[I] = {Kind, Op};
+    Ops[I] = {LHS, RHS};
+    Locs[I] = Loc;
+    return NodeRef(I);
+  }
+
+  uint32_t lhs(NodeRef N) const { return Ops[N.getIndex()].LHS; }
+  uint32_t rhs(NodeRef N) const { return Ops[N.getIndex()].RHS; }
+  NodeRef extra(NodeRef N, unsigned I) const {
+    return NodeRef(Extra[rhs(N) + I]);
+  }
+
+public:
+  size_t size() const { return NumNodes; }
+
+  void clear() {
+    NumNodes = 0;
+    FirstFoldable = ~0u;
+    Numbers.clear();
+    Extra.clear();
+  }
+
+  //===--------------------------------------------------------------------===//
+  // Building
+
+  NodeRef addNumber(size_t Loc, double Val) {
+    Numbers.push_back(Val);
+    return add(FK_Number, 0, Loc, Numbers.size() - 1, 0);
+  }
+
+  NodeRef addVariable(size_t Loc, SymbolID Name) {
+    return add(FK_Variable, 0, Loc, Name, 0);
+  }
+
+  NodeRef addUnary(size_t Loc, char Op, NodeRef Operand) {
+    return add(FK_Unary, Op, Loc, Operand.getIndex(), 0);
+  }
+
+  NodeRef addBinary(size_t Loc, char Op, NodeRef LHS, NodeRef RHS) {
+    NodeRef N = add(FK_Binary, Op, Loc, LHS.getIndex(), RHS.getIndex());
+    if (FirstFoldable == ~0u && getKind(LHS) == FK_Number &&
+        getKind(RHS) == FK_Number)
+      FirstFoldable = N.getIndex();
+    return N;
+  }
+
+  NodeRef addCall(size_t Loc, SymbolID Callee, llvm::ArrayRef<NodeRef> Args) {
+    uint32_t First = Extra.size();
+    Extra.push_back(Args.size());
+    for (NodeRef Arg : Args)
+      Extra.push_back(Arg.getIndex());
+    return add(FK_Call, 0, Loc, Callee, First);
+  }
+
+  NodeRef addIf(size_t Loc, NodeRef Cond, NodeRef Then, NodeRef Else) {
+    uint32_t First = Extra.size();
+    Extra.push_back(Then.getIndex());
+    Extra.push_back(Else.getIndex());
+    return add(FK_If, 0, Loc, Cond.getIndex(), First);
+  }
+
+  /// addFor - Step may be null, meaning a step of 1.0.
+  NodeRef addFor(size_t Loc, SymbolID VarName, NodeRef Start, NodeRef End,
+                 NodeRef Step, NodeRef Body) {
+    uint32_t First = Extra.size();
+    Extra.push_back(Start.getIndex());
+    Extra.push_back(End.getIndex());
+    Extra.push_back(Step.getIndex());
+    Extra.push_back(Body.getIndex());
+    return add(FK_For, 0, Loc, VarName, First);
+  }
+
+  /// addVar - An initializer may be null, meaning 0.0.
+  NodeRef addVar(size_t Loc,
+                 llvm::ArrayRef<std::pair<SymbolID, NodeRef>> VarNames,
+                 NodeRef Body) {
+    uint32_t First = Extra.size();
+    Extra.push_back(VarNames.size());
+    for (const auto &NamedVar : VarNames) {
+      Extra.push_back(NamedVar.first);
+      Extra.push_back(NamedVar.second.getIndex());
+    }
+    return add(FK_Var, 0, Loc, Body.getIndex(), First);
+  }
+
+  //===--------------------------------------------------------------------===//
+  // Accessors
+
+  FlatKind getKind(NodeRef N) const { return Tags[N.getIndex()].Kind; }
+  char getOp(NodeRef N) const { return Tags[N.getIndex()].Op; }
+  size_t getLoc(NodeRef N) const { return Locs[N.getIndex()]; }
+
+  double getNumber(NodeRef N) const { return Numbers[lhs(N)]; }
+  SymbolID getVarName(NodeRef N) const { return lhs(N); }
+  NodeRef getOperand(NodeRef N) const { return NodeRef(lhs(N)); }
+  NodeRef getLHS(NodeRef N) const { return NodeRef(lhs(N)); }
+  NodeRef getRHS(NodeRef N) const { return NodeRef(rhs(N)); }
+
+  SymbolID getCallee(NodeRef N) const { return lhs(N); }
+  unsigned getNumArgs(NodeRef N) const { return Extra[rhs(N)]; }
+  NodeRef getArg(NodeRef N, unsigned I) const { return extra(N, 1 + I); }
+
+  NodeRef getCond(NodeRef N) const { return NodeRef(lhs(N)); }
+  NodeRef getThen(NodeRef N) const { return extra(N, 0); }
+  NodeRef getElse(NodeRef N) const { return extra(N, 1); }
+
+  SymbolID getForVar(NodeRef N) const { return lhs(N); }
+  NodeRef getStart(NodeRef N) const { return extra(N, 0); }
+  NodeRef getEnd(NodeRef N) const { return extra(N, 1); }
+  NodeRef getStep(NodeRef N) const { return extra(N, 2); }
+  NodeRef getForBody(NodeRef N) const { return extra(N, 3); }
+
+  NodeRef getVarBody(NodeRef N) const { return NodeRef(lhs(N)); }
+  unsigned getNumVars(NodeRef N) const { return Extra[rhs(N)]; }
+  SymbolID getVarName(NodeRef N, unsigned I) const {
+    return Extra[rhs(N) + 1 + 2 * I];
+  }
+  NodeRef getVarInit(NodeRef N, unsigned I) const {
+    return extra(N, 2 + 2 * I);
+  }
+
+  //===--------------------------------------------------------------------===//
+  // Passes
+
+private:
+  static double foldNaN(char Op, double L, double R) {
+    llvm::APFloat LF(L), RF(R);
+    if (Op == '+')
+      LF.add(RF, llvm::APFloat::rmNearestTiesToEven);
+    else if (Op == '-')
+      LF.subtract(RF, llvm::APFloat::rmNearestTiesToEven);
+    else
+      LF.multiply(RF, llvm::APFloat::rmNearestTiesToEven);
+    return LF.convertToDouble();
+  }
+
+public:
+  /// foldConstants - Replace each builtin arithmetic or comparison operator
+  /// whose operands are both literals with the literal it evaluates to, in one
+  /// forward pass.  The result is bit for bit what LLVM's constant folder would
+  /// have produced from the IR: host arithmetic is IEEE round-to-nearest too,
+  /// and only the NaN it produces may differ, so NaNs are redone with APFloat.
+  /// Returns the number of operators folded.
+  unsigned foldConstants() {
+    unsigned NumFolded = 0;
+    for (uint32_t I = FirstFoldable; I < NumNodes; ++I) {
+      if (Tags[I].Kind != FK_Binary)
+        continue;
+      Operands &O = Ops[I];
+      if (Tags[O.LHS].Kind != FK_Number || Tags[O.RHS].Kind != FK_Number)
+        continue;
+
+      double L = Numbers[Ops[O.LHS].LHS], R = Numbers[Ops[O.RHS].LHS], V;
+      switch (Tags[I].Op) {
+      case '+':
+        V = L + R;
+        break;
+      case '-':
+        V = L - R;
+        break;
+      case '*':
+        V = L * R;
+        break;
+      case '<':
+        // fcmp ult: true when less than or unordered.
+        V = !(L >= R);
+        break;
+      default:
+        continue;
+      }
+      if (V != V)
+        V = foldNaN(Tags[I].Op, L, R);
+
+      // Reuse the left operand's slot; the operand itself is now dead.  The
+      // node takes over the right operand's location, which is the last one
+      // the unfolded operator would have left the debug location at.
+      uint32_t Slot = Ops[O.LHS].LHS;
+      Numbers[Slot] = V;
+      Locs[I] = Locs[O.RHS];
+      Tags[I] = {FK_Number, 0};
+      O = {Slot, 0};
+      ++NumFolded;
+    }
+    FirstFoldable = ~0u;
+    return NumFolded;
+  }
+};
+
+#endif // DIV_FLATAST_HH
@@ -13,88 +13,871 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_DIVJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_DIVJIT_H
 
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/JITLink/EHFrameSupport.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "codemem.hh"
+#include "objcache.hh"
+#include "optimize.hh"
+#include "perfjit.hh"
+#include "pgo.hh"
+#include "tiering.hh"
+#include <atomic>
+#include <cstdlib>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 namespace llvm {
 namespace orc {
 
+/// DivJITOptions - What DivJIT generates code for, and how hard it works at
+/// it.  By default that is the CPU this is running on, with every feature it
+/// has.
+struct DivJITOptions {
+  unsigned OptLevel = 2;
+  /// CPU - A CPU name as for -mcpu; empty for the host CPU.
+  std::string CPU;
+  /// Features - Features to add to, or with a leading '-' remove from, those
+  /// of the CPU, e.g. "+avx2" or "-fma".
+  std::vector<std::string> Features;
+  /// CodeModel - The code model, if not the target's default for a JIT.
+  Optional<CodeModel::Model> CodeModel;
+  /// CodeGenLevel - The code generator's optimization level, if not the one
+  /// that goes with OptLevel.
+  Optional<CodeGenOpt::Level> CodeGenLevel;
+  /// Lazy - Compile each function of a module added with addModule the first
+  /// time it is called, rather than when something that refers to it is.
+  bool Lazy = false;
+  /// NumThreads - Compile and link modules on a pool of this many threads,
+  /// or with 0, on whichever thread looks their symbols up.
+  unsigned NumThreads = 0;
+  /// Tiered - Compile functions first at -O0 with counters, and again at -O3
+  /// in the background once a function's count of calls and loop iterations
+  /// reaches TierThreshold.  Overrides Lazy.
+  bool Tiered = false;
+  uint64_t TierThreshold = 10000;
+  /// CacheDir - Keep compiled modules in this directory, and load them from
+  /// it rather than compile them again; empty for no cache.  Baseline code
+  /// in tiered mode has the addresses of its counters built in, and is never
+  /// cached; nor is anything under ProfileGen.
+  std::string CacheDir;
+  /// CacheSize - The most the cache directory may hold, in bytes, or 0 for
+  /// no limit.
+  uint64_t CacheSize = 0;
+  /// JITLink - Link with JITLink, into slabs shared by every object, rather
+  /// than with RuntimeDyld, into pages of each object's own.
+  bool JITLink = false;
+  /// HugePages - With JITLink, ask for the slabs to be backed by transparent
+  /// huge pages.
+  bool HugePages = false;
+  /// SlabSize - With JITLink, the address space set aside for each of code,
+  /// read-only data and writable data.
+  uint64_t SlabSize = 256 << 20;
+  /// PerfOutputs - The files to tell perf about JIT'd code with, as
+  /// PerfJITOutput bits.  They can be changed later with setPerfOutputs.
+  unsigned PerfOutputs = 0;
+  /// FramePointers - Keep the frame pointer in every function, for stacks to
+  /// be walked by.
+  bool FramePointers = false;
+  /// SymbolTable - Keep a table of the JIT'd functions and their line tables,
+  /// for looking code addresses up in with getSymbolTable.
+  bool SymbolTable = false;
+  /// Profile - Counts to optimize definitions with, as branch weights.  In
+  /// tiered mode the baseline code counts into it, for the optimized code.
+  ProfileData *Profile = nullptr;
+  /// ProfileGen - Have all code for definitions, not just baseline code,
+  /// count into Profile.
+  bool ProfileGen = false;
+};
+
+/// TargetMachinePool - TargetMachines to lend to whichever thread is
+/// optimizing or compiling a module.  A TargetMachine must not be used by two
+/// threads at once, but building one costs about as much as compiling a
+/// small function, so rather than build one per module as
+/// ConcurrentIRCompiler does, each is handed back for reuse.  The pool grows
+/// to as many as are ever in use at once.
+class TargetMachinePool {
+  JITTargetMachineBuilder JTMB;
+  std::mutex Lock;
+  std::vector<std::unique_ptr<TargetMachine>> Free;
+
+public:
+  explicit TargetMachinePool(JITTargetMachineBuilder JTMB)
+      : JTMB(std::move(JTMB)) {}
+
+  Expected<std::unique_ptr<TargetMachine>> take() {
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      if (!Free.empty()) {
+        std::unique_ptr<TargetMachine> TM = std::move(Free.back());
+        Free.pop_back();
+        return std::move(TM);
+      }
+    }
+    return JTMB.createTargetMachine();
+  }
+
+  void give(std::unique_ptr<TargetMachine> TM) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Free.push_back(std::move(TM));
+  }
+};
+
+/// PooledIRCompiler - Compiles modules to objects with TargetMachines from a
+/// pool, so that several threads can compile at once.
+class PooledIRCompiler : public IRCompileLayer::IRCompiler {
+  TargetMachinePool &TMs;
+  ObjectCache *Cache;
+  bool FramePointers;
+
+public:
+  PooledIRCompiler(const JITTargetMachineBuilder &JTMB, TargetMachinePool &TMs,
+                   bool FramePointers, ObjectCache *Cache = nullptr)
+      : IRCompiler(irManglingOptionsFromTargetOptions(JTMB.getOptions())),
+        TMs(TMs), Cache(Cache), FramePointers(FramePointers) {}
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    if (FramePointers)
+      for (Function &F : M)
+        F.addFnAttr("frame-pointer", "all");
+    auto TM = TMs.take();
+    if (!TM)
+      return TM.takeError();
+    auto Obj = [&] {
+      PhaseScope Timing(PhaseMachineCodegen);
+      return SimpleCompiler(**TM, Cache)(M);
+    }();
+    TMs.give(std::move(*TM));
+    return Obj;
+  }
+};
+
+/// TimedObjectLayer - Passes objects on to Base, timing how long it takes to
+/// link them.
+class TimedObjectLayer : public ObjectLayer {
+  ObjectLayer &Base;
+
+public:
+  explicit TimedObjectLayer(ObjectLayer &Base)
+      : ObjectLayer(Base.getExecutionSession()), Base(Base) {}
+
+  void emit(std::unique_ptr<MaterializationResponsibility> R,
+            std::unique_ptr<MemoryBuffer> O) override {
+    PhaseScope Timing(PhaseLink);
+    Base.emit(std::move(R), std::move(O));
+  }
+};
+
+/// LinkReferencesPlugin - Records, for each symbol of each object JITLink
+/// links, the symbols the object refers to and where it looked them up.
+///
+/// LLVM 14's ORC only makes a symbol wait for the symbols its lookup had to
+/// wait for.  With compile threads, a function another thread has already
+/// given an address to, but not finished linking, is not one, so an
+/// expression calling it could run before its code was written (see
+/// test/jit-threads.sh).  DivJIT::lookup waits for them through these
+/// records instead.
+class LinkReferencesPlugin : public ObjectLinkingLayer::Plugin {
+public:
+  /// References - The symbols an object refers to, and its search order.
+  struct References {
+    JITDylibSearchOrder Order;
+    SymbolLookupSet Symbols;
+  };
+
+private:
+  std::mutex Lock; // Guards Refs.
+  DenseMap<SymbolStringPtr, std::shared_ptr<const References>> Refs;
+
+public:
+  void modifyPassConfig(MaterializationResponsibility &MR,
+                        jitlink::LinkGraph &G,
+                        jitlink::PassConfiguration &Config) override {
+    Config.PostPrunePasses.push_back([this, &MR](jitlink::LinkGraph &G) {
+      ExecutionSession &ES = MR.getTargetJITDylib().getExecutionSession();
+      auto R = std::make_shared<References>();
+      MR.getTargetJITDylib().withLinkOrderDo(
+          [&](const JITDylibSearchOrder &LO) { R->Order = LO; });
+      for (jitlink::Symbol *Sym : G.external_symbols())
+        R->Symbols.add(ES.intern(Sym->getName()),
+                       Sym->getLinkage() == jitlink::Linkage::Weak
+                           ? SymbolLookupFlags::WeaklyReferencedSymbol
+                           : SymbolLookupFlags::RequiredSymbol);
+      std::lock_guard<std::mutex> Guard(Lock);
+      for (jitlink::Symbol *Sym : G.defined_symbols())
+        if (Sym->hasName() && Sym->getScope() != jitlink::Scope::Local)
+          Refs[ES.intern(Sym->getName())] = R;
+      return Error::success();
+    });
+  }
+
+  /// getReferences - What the object that last defined Name refers to, or
+  /// null if it was not linked by JITLink.
+  std::shared_ptr<const References> getReferences(const SymbolStringPtr &Name) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto It = Refs.find(Name);
+    return It == Refs.end() ? nullptr : It->second;
+  }
+
+  Error notifyFailed(MaterializationResponsibility &MR) override {
+    return Error::success();
+  }
+  Error notifyRemovingResources(ResourceKey K) override {
+    return Error::success();
+  }
+  void notifyTransferringResources(ResourceKey DstKey,
+                                   ResourceKey SrcKey) override {}
+};
+
+/// getTargetMachineBuilder - A builder for TargetMachines that generate code
+/// for TT as Opts asks.
+inline Expected<JITTargetMachineBuilder>
+getTargetMachineBuilder(const DivJITOptions &Opts, const Triple &TT) {
+  // The triple alone gives a generic CPU: for x86-64, SSE2 and nothing
+  // newer.  The host's CPU and features are detected unless overridden.
+  JITTargetMachineBuilder JTMB(TT);
+  if (Opts.CPU.empty()) {
+    auto Host = JITTargetMachineBuilder::detectHost();
+    if (!Host)
+      return Host.takeError();
+    JTMB = std::move(*Host);
+  } else {
+    JTMB.setCPU(Opts.CPU);
+  }
+  JTMB.addFeatures(Opts.Features);
+  JTMB.setCodeModel(Opts.CodeModel);
+
+  unsigned OptLevel = Opts.OptLevel;
+  JTMB.setCodeGenOptLevel(Opts.CodeGenLevel ? *Opts.CodeGenLevel
+                          : OptLevel == 0   ? CodeGenOpt::None
+                          : OptLevel == 1   ? CodeGenOpt::Less
+                          : OptLevel == 2   ? CodeGenOpt::Default
+                                            : CodeGenOpt::Aggressive);
+  return std::move(JTMB);
+}
+
+class DivJIT;
+
+/// TieredFunction - A function compiled in tiers: how far it has got, and
+/// what it takes to compile it again.
+struct TieredFunction {
+  DivJIT *JIT;
+  std::string Name;
+  /// Count - Calls and loop iterations so far, bumped by the baseline code
+  /// without synchronization.
+  uint64_t Count = 0;
+  /// Tier - 0 until first called, 1 once running the baseline code, 2 once
+  /// the optimized code has been swapped in.
+  std::atomic<unsigned> Tier{0};
+  std::atomic<bool> Promoting{false};
+  /// Bitcode - The module it was defined in, before instrumentation.
+  SmallVector<char, 0> Bitcode;
+};
+
+/// TierInfo - A snapshot of a TieredFunction, for reporting.
+struct TierInfo {
+  std::string Name;
+  unsigned Tier;
+  uint64_t Count;
+  bool Promoting;
+};
+
 class DivJIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
 
   DataLayout DL;
   MangleAndInterner Mangle;
+  TargetMachinePool TMs;
+  std::unique_ptr<DivObjectCache> Cache;
 
-  RTDyldObjectLinkingLayer ObjectLayer;
+  /// The object linking layer, RuntimeDyld's with SectionMemoryManagers
+  /// that map their memory through Mapper, or with -jitlink, JITLink's with
+  /// Slabs.  The compile layers hand their objects to it through
+  /// LinkLayer, which times the linking.  Either way, the functions linked
+  /// are reported to perf, and to Symbols, as they are, through PerfListener
+  /// or a plugin.
+  CountingMemoryMapper Mapper;
+  SlabMemoryManager *Slabs = nullptr;
+  /// LinkRefs - What each object JITLink links refers to, or null under
+  /// RuntimeDyld (see LinkReferencesPlugin).
+  LinkReferencesPlugin *LinkRefs = nullptr;
+  JITSymbolTable Symbols;
+  PerfJITEventListener PerfListener{PerfJITWriter::get(), Symbols};
+  std::unique_ptr<ObjectLayer> ObjLayer;
+  TimedObjectLayer LinkLayer;
   IRCompileLayer CompileLayer;
+  IRTransformLayer OptimizeLayer;
+  std::unique_ptr<LazyCallThroughManager> LCTMgr;
+  CompileOnDemandLayer CODLayer;
 
   JITDylib &MainJD;
+  bool Lazy;
+
+  /// The optimization level, and the target as the JIT was asked for it.
+  /// The optimizer and the compiler borrow their own from TMs.
+  unsigned OptLevel;
+  std::unique_ptr<TargetMachine> TM;
+
+  std::unique_ptr<ThreadPool> CompileThreads;
+
+  /// Tiered compilation.  Baseline code is generated by BaselineLayer at -O0,
+  /// with FastISel, and every call to a tiered function goes through a stub
+  /// in TierStubs, which is pointed at the optimized code once there is some.
+  bool Tiered;
+  uint64_t TierThreshold;
+  /// Counts for profile-guided optimization, which baseline code, and under
+  /// ProfileGen all code, counts into.
+  ProfileData *Profile;
+  bool ProfileGen;
+  TargetMachinePool BaselineTMs;
+  IRCompileLayer BaselineLayer;
+  std::unique_ptr<IndirectStubsManager> TierStubs;
+  std::mutex TierLock; // Guards Tiers and TierIndex.
+  std::vector<std::unique_ptr<TieredFunction>> Tiers;
+  StringMap<TieredFunction *> TierIndex;
+  std::atomic<unsigned> NumPromotions{0};
+  std::unique_ptr<ThreadPool> TierThreads;
 
 public:
   DivJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
+                  JITTargetMachineBuilder JTMB, DataLayout DL,
+                  std::unique_ptr<TargetMachine> TM,
+                  std::unique_ptr<LazyCallThroughManager> LCTMgr,
+                  std::unique_ptr<DivObjectCache> Cache,
+                  std::unique_ptr<SlabMemoryManager> Slabs,
+                  const DivJITOptions &Opts)
       : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
-        ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
-        CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {
+        TMs(JTMB), Cache(std::move(Cache)),
+        ObjLayer(createObjectLayer(std::move(Slabs))), LinkLayer(*ObjLayer),
+        CompileLayer(*this->ES, LinkLayer,
+                     std::make_unique<PooledIRCompiler>(
+                         JTMB, TMs, Opts.FramePointers, this->Cache.get())),
+        OptimizeLayer(*this->ES, CompileLayer,
+                      [this](ThreadSafeModule TSM,
+                             const MaterializationResponsibility &R) {
+                        return optimize(std::move(TSM), R);
+                      }),
+        LCTMgr(std::move(LCTMgr)),
+        CODLayer(
+            *this->ES, OptimizeLayer, *this->LCTMgr,
+            createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple())),
+        MainJD(this->ES->createBareJITDylib("<main>")), Lazy(Opts.Lazy),
+        OptLevel(Opts.OptLevel), TM(std::move(TM)), Tiered(Opts.Tiered),
+        TierThreshold(Opts.TierThreshold), Profile(Opts.Profile),
+        ProfileGen(Opts.ProfileGen), BaselineTMs(baselineJTMB(JTMB)),
+        BaselineLayer(*this->ES, LinkLayer,
+                      std::make_unique<PooledIRCompiler>(
+                          JTMB, BaselineTMs, Opts.FramePointers)) {
+    if (Opts.SymbolTable)
+      Symbols.enable();
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
-    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
-      ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
-      ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
+    if (JTMB.getTargetTriple().isOSBinFormatCOFF() && !this->Slabs) {
+      auto &RTDyldLayer = static_cast<RTDyldObjectLinkingLayer &>(*ObjLayer);
+      RTDyldLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
+      RTDyldLayer.setAutoClaimResponsibilityForObjectSymbols(true);
+    }
+
+    // Every materialization, and so every module's compile and link, becomes
+    // a task on the pool.
+    if (Opts.NumThreads) {
+      CompileThreads =
+          std::make_unique<ThreadPool>(hardware_concurrency(Opts.NumThreads));
+      this->ES->setDispatchTask([this](std::unique_ptr<Task> T) {
+        // ThreadPool takes a std::function, which must be copyable.
+        CompileThreads->async([UnownedT = T.release()]() {
+          std::unique_ptr<Task> T(UnownedT);
+          T->run();
+        });
+      });
+    }
+
+    if (Tiered) {
+      TierStubs =
+          createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple())();
+      TierThreads = std::make_unique<ThreadPool>(hardware_concurrency(1));
     }
   }
 
   ~DivJIT() {
+    if (TierThreads)
+      TierThreads->wait();
+    if (CompileThreads)
+      CompileThreads->wait();
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<DivJIT>> Create() {
+  static Expected<std::unique_ptr<DivJIT>>
+  Create(const DivJITOptions &Opts = DivJITOptions()) {
     auto EPC = SelfExecutorProcessControl::Create();
     if (!EPC)
       return EPC.takeError();
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-    JITTargetMachineBuilder JTMB(
-        ES->getExecutorProcessControl().getTargetTriple());
+    auto ExpectedJTMB = getTargetMachineBuilder(
+        Opts, ES->getExecutorProcessControl().getTargetTriple());
+    if (!ExpectedJTMB)
+      return ExpectedJTMB.takeError();
+    JITTargetMachineBuilder JTMB = std::move(*ExpectedJTMB);
+    unsigned OptLevel = Opts.OptLevel;
 
     auto DL = JTMB.getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
+    auto TM = JTMB.createTargetMachine();
+    if (!TM)
+      return TM.takeError();
+
+    // Calls to functions not yet compiled go through a stub into this, which
+    // compiles them.
+    auto LCTMgr = createLocalLazyCallThroughManager(
+        JTMB.getTargetTriple(), *ES,
+        pointerToJITTargetAddress(&handleLazyCallThroughError));
+    if (!LCTMgr)
+      return LCTMgr.takeError();
+
+    // An object is only good for the target, features and options it was
+    // generated with.
+    std::unique_ptr<DivObjectCache> Cache;
+    if (!Opts.CacheDir.empty() && !Opts.ProfileGen) {
+      std::string Salt;
+      raw_string_ostream OS(Salt);
+      OS << JTMB.getTargetTriple().str() << '\n'
+         << (*TM)->getTargetCPU() << '\n'
+         << (*TM)->getTargetFeatureString() << '\n'
+         << "O" << OptLevel << " codegen " << (int)(*TM)->getOptLevel()
+         << " code model " << (int)(*TM)->getCodeModel()
+         << (Opts.FramePointers ? " frame pointers" : "");
+      auto C = DivObjectCache::create(Opts.CacheDir, Opts.CacheSize, OS.str());
+      if (!C)
+        return C.takeError();
+      Cache = std::move(*C);
+    }
+
+    if (Opts.PerfOutputs)
+      if (Error Err = PerfJITWriter::get().setOutputs(Opts.PerfOutputs))
+        return std::move(Err);
+
+    std::unique_ptr<SlabMemoryManager> Slabs;
+    if (Opts.JITLink) {
+      auto S = SlabMemoryManager::Create(Opts.SlabSize, Opts.HugePages);
+      if (!S)
+        return S.takeError();
+      Slabs = std::move(*S);
+    }
+
     return std::make_unique<DivJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+                                    std::move(*DL), std::move(*TM),
+                                    std::move(*LCTMgr), std::move(Cache),
+                                    std::move(Slabs), Opts);
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
+  /// getTargetMachine - The target code is generated for.
+  const TargetMachine &getTargetMachine() const { return *TM; }
+
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  /// getCodeMemoryStats - What linking has cost in system calls and memory.
+  CodeMemoryStats getCodeMemoryStats() {
+    return Slabs ? Slabs->getStats() : Mapper.getStats();
+  }
+
+  /// setPerfOutputs - Tell perf about code linked from now on through the
+  /// files Outputs asks for, as PerfJITOutput bits, and no others.
+  Error setPerfOutputs(unsigned Outputs) {
+    return PerfJITWriter::get().setOutputs(Outputs);
+  }
+
+  /// getSymbolTable - The JIT'd functions by address, if kept.
+  JITSymbolTable &getSymbolTable() { return Symbols; }
+
+  /// getObjectCache - The object cache, or null if there is none.
+  DivObjectCache *getObjectCache() { return Cache.get(); }
+
+  /// addModule - Add a module of definitions.  Its code is generated when
+  /// one of them is first looked up, or in lazy mode, function by function,
+  /// when each is first called.  In tiered mode, each function's baseline
+  /// code is generated when it is first called.
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
-    return CompileLayer.add(RT, std::move(TSM));
+    if (Tiered)
+      return addTieredModule(std::move(TSM), RT);
+    TSM.withModuleDo([&](Module &M) { applyProfile(M); });
+    if (Lazy)
+      return CODLayer.add(RT, std::move(TSM));
+    return OptimizeLayer.add(RT, std::move(TSM));
   }
 
+  /// addEagerModule - Add a module whose code is about to run, and so is
+  /// generated as soon as it is looked up, even in lazy mode.  In tiered mode
+  /// it is run once and never promoted, so it only gets baseline code.
+  Error addEagerModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+    if (!RT)
+      RT = MainJD.getDefaultResourceTracker();
+    if (Tiered)
+      return BaselineLayer.add(RT, std::move(TSM));
+    return OptimizeLayer.add(RT, std::move(TSM));
+  }
+
+  /// addModules - Add a batch of modules and generate code for all of them,
+  /// returning once every one is ready to run.  With compile threads they
+  /// are compiled and linked in parallel.
+  Error addModules(std::vector<ThreadSafeModule> TSMs,
+                   ResourceTrackerSP RT = nullptr) {
+    if (!RT)
+      RT = MainJD.getDefaultResourceTracker();
+    SymbolLookupSet Defs;
+    for (ThreadSafeModule &TSM : TSMs) {
+      TSM.withModuleDo([&](Module &M) {
+        applyProfile(M);
+        for (Function &F : M)
+          if (!F.isDeclaration() && F.hasExternalLinkage())
+            Defs.add(Mangle(F.getName()));
+      });
+      if (Error Err = OptimizeLayer.add(RT, std::move(TSM)))
+        return Err;
+    }
+
+    // Looking all their definitions up at once hands every module to the
+    // dispatcher before waiting on any of them.
+    PhaseScope Timing(PhaseLookup);
+    return ES->lookup(makeJITDylibSearchOrder(&MainJD), std::move(Defs))
+        .takeError();
+  }
+
+  /// lookup - The address of Name, once its code, and under JITLink with
+  /// compile threads, that of everything it can call, is ready to run.
   Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
-    return ES->lookup({&MainJD}, Mangle(Name.str()));
+    PhaseScope Timing(PhaseLookup);
+    SymbolStringPtr Sym = Mangle(Name.str());
+    auto Addr = ES->lookup({&MainJD}, Sym);
+    if (Addr && LinkRefs && CompileThreads)
+      if (Error Err = waitForReferences(Sym))
+        return std::move(Err);
+    return Addr;
+  }
+
+  /// removeModules - Remove the modules added with RT and free their code.
+  /// A compile thread can still be finishing off an object after its symbols
+  /// are ready and whoever looked them up has been woken, so the compile
+  /// threads are waited for first.
+  Error removeModules(ResourceTracker &RT) {
+    if (CompileThreads)
+      CompileThreads->wait();
+    return RT.remove();
+  }
+
+  /// getTierInfo - Where each tiered function stands, in definition order.
+  std::vector<TierInfo> getTierInfo() {
+    std::lock_guard<std::mutex> Guard(TierLock);
+    std::vector<TierInfo> Info;
+    for (const auto &TF : Tiers)
+      Info.push_back({TF->Name, TF->Tier, TF->Count, TF->Promoting});
+    return Info;
+  }
+
+  /// getNumPromotions - How many functions have had optimized code swapped
+  /// in.
+  unsigned getNumPromotions() const { return NumPromotions; }
+
+private:
+  /// handleLazyCallThroughError - Where a call to a function that could not
+  /// be compiled ends up.  The caller expects a result there is none of.
+  static void handleLazyCallThroughError() {
+    errs() << "error: a function called could not be compiled\n";
+    exit(1);
+  }
+
+  /// waitForReferences - Wait for every symbol Name's object refers to to be
+  /// ready, and for those theirs refer to, and so on.  Each is looked up
+  /// once it is known to be referred to, and so has been resolved already;
+  /// waiting for it to be ready has its object's references recorded.
+  Error waitForReferences(SymbolStringPtr Name) {
+    DenseSet<SymbolStringPtr> Seen = {Name};
+    std::vector<SymbolStringPtr> Work = {std::move(Name)};
+    while (!Work.empty()) {
+      auto Refs = LinkRefs->getReferences(Work.back());
+      Work.pop_back();
+      if (!Refs)
+        continue;
+      SymbolLookupSet Unseen;
+      for (auto &KV : Refs->Symbols)
+        if (Seen.insert(KV.first).second) {
+          Unseen.add(KV.first, KV.second);
+          Work.push_back(KV.first);
+        }
+      if (Unseen.empty())
+        continue;
+      auto Result = ES->lookup(Refs->Order, std::move(Unseen));
+      if (!Result)
+        return Result.takeError();
+    }
+    return Error::success();
+  }
+
+  /// createObjectLayer - The layer that links objects into memory: JITLink's,
+  /// if given Slabs to link into, or else RuntimeDyld's.
+  std::unique_ptr<ObjectLayer>
+  createObjectLayer(std::unique_ptr<SlabMemoryManager> Slabs) {
+    if (!Slabs) {
+      auto Layer =
+          std::make_unique<RTDyldObjectLinkingLayer>(*ES, [this]() {
+            Mapper.countObject();
+            return std::make_unique<SectionMemoryManager>(&Mapper);
+          });
+      Layer->registerJITEventListener(PerfListener);
+      return std::move(Layer);
+    }
+    this->Slabs = Slabs.get();
+    auto Layer = std::make_unique<ObjectLinkingLayer>(*ES, std::move(Slabs));
+    Layer->addPlugin(std::make_unique<EHFrameRegistrationPlugin>(
+        *ES, std::make_unique<jitlink::InProcessEHFrameRegistrar>()));
+    auto Refs = std::make_unique<LinkReferencesPlugin>();
+    LinkRefs = Refs.get();
+    Layer->addPlugin(std::move(Refs));
+    Layer->addPlugin(
+        std::make_unique<PerfJITPlugin>(PerfJITWriter::get(), Symbols));
+    return std::move(Layer);
+  }
+
+  /// baselineJTMB - JTMB, set up for generating baseline code: no
+  /// optimization, which at -O0 also means instruction selection by FastISel.
+  static JITTargetMachineBuilder baselineJTMB(JITTargetMachineBuilder JTMB) {
+    JTMB.setCodeGenOptLevel(CodeGenOpt::None);
+    return JTMB;
+  }
+
+  /// addTieredModule - Add the baseline code for TSM's definitions.  Each is
+  /// renamed to Name.tier1 and instrumented, and Name itself becomes a stub
+  /// which, until the baseline code has been compiled, leads to a trampoline
+  /// that compiles it.
+  Error addTieredModule(ThreadSafeModule TSM, ResourceTrackerSP RT) {
+    Error Err = TSM.withModuleDo([&](Module &M) -> Error {
+      SmallVector<char, 0> Bitcode;
+      raw_svector_ostream OS(Bitcode);
+      WriteBitcodeToFile(M, OS);
+
+      SmallVector<Function *, 1> Defs;
+      for (Function &F : M)
+        if (!F.isDeclaration() && F.hasExternalLinkage())
+          Defs.push_back(&F);
+
+      std::lock_guard<std::mutex> Guard(TierLock);
+      for (Function *F : Defs)
+        if (TierIndex.count(F->getName()))
+          return make_error<StringError>("Duplicate definition of symbol '" +
+                                             F->getName() + "'",
+                                         inconvertibleErrorCode());
+
+      SymbolMap Stubs;
+      for (Function *F : Defs) {
+        Tiers.push_back(std::make_unique<TieredFunction>());
+        TieredFunction &TF = *Tiers.back();
+        TF.JIT = this;
+        TF.Name = F->getName().str();
+        TF.Bitcode = Bitcode;
+        TierIndex[TF.Name] = &TF;
+
+        std::string Baseline = TF.Name + ".tier1";
+        if (Profile)
+          Profile->instrument(*F, TF.Name);
+        renameDefinition(*F, Baseline);
+        instrumentForTiering(*F, &TF.Count, TierThreshold, requestPromotion,
+                             &TF);
+
+        auto Trampoline = LCTMgr->getCallThroughTrampoline(
+            MainJD, Mangle(Baseline), [this, &TF](JITTargetAddress Addr) {
+              TF.Tier = 1;
+              return TierStubs->updatePointer(TF.Name, Addr);
+            });
+        if (!Trampoline)
+          return Trampoline.takeError();
+        if (Error Err = TierStubs->createStub(TF.Name, *Trampoline,
+                                              JITSymbolFlags::Exported))
+          return Err;
+        Stubs[Mangle(TF.Name)] =
+            JITEvaluatedSymbol(TierStubs->findStub(TF.Name, false).getAddress(),
+                               JITSymbolFlags::Exported |
+                                   JITSymbolFlags::Callable);
+      }
+      return MainJD.define(absoluteSymbols(std::move(Stubs)));
+    });
+    if (Err)
+      return Err;
+    return BaselineLayer.add(RT, std::move(TSM));
+  }
+
+  /// requestPromotion - Called by baseline code when its count reaches the
+  /// threshold: queue the function for optimization, once.
+  static void requestPromotion(void *Arg) {
+    TieredFunction &TF = *static_cast<TieredFunction *>(Arg);
+    if (TF.Promoting.exchange(true))
+      return;
+    TF.JIT->TierThreads->async([&TF] {
+      if (Error Err = TF.JIT->promote(TF))
+        logAllUnhandledErrors(std::move(Err), errs(),
+                              "error: optimizing '" + TF.Name + "': ");
+    });
+  }
+
+  /// promote - Compile TF again from its bitcode at -O3, as Name.tier2, and
+  /// point its stub at the result.  Calls already running the baseline code
+  /// finish there; every call from now on gets the optimized code.
+  Error promote(TieredFunction &TF) {
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = parseBitcodeFile(
+        MemoryBufferRef(StringRef(TF.Bitcode.data(), TF.Bitcode.size()),
+                        TF.Name),
+        *Ctx);
+    if (!M)
+      return M.takeError();
+
+    // Any other definitions in the module are promoted on their own.
+    for (Function &F : **M)
+      if (!F.isDeclaration() && F.getName() != TF.Name)
+        F.deleteBody();
+    // It is optimized for the branches the baseline code took.
+    Function *F = (*M)->getFunction(TF.Name);
+    bool Annotated = Profile && Profile->annotate(*F, TF.Name);
+    if (ProfileGen)
+      Profile->instrument(*F, TF.Name);
+
+    // The optimized code is the last tier, so its recursive calls can go
+    // straight to itself rather than through the stub.
+    std::string Optimized = TF.Name + ".tier2";
+    F->setName(Optimized);
+    if (Error Err = linkCallees(**M))
+      return Err;
+    if (Annotated)
+      Profile->setSummary(**M);
+
+    auto OptTM = TMs.take();
+    if (!OptTM)
+      return OptTM.takeError();
+    optimizeModule(**M, 3, OptTM->get(), false);
+    TMs.give(std::move(*OptTM));
+
+    if (Error Err = CompileLayer.add(MainJD.getDefaultResourceTracker(),
+                                     ThreadSafeModule(std::move(*M),
+                                                      std::move(Ctx))))
+      return Err;
+    auto Sym = lookup(Optimized);
+    if (!Sym)
+      return Sym.takeError();
+    if (Error Err = TierStubs->updatePointer(TF.Name, Sym->getAddress()))
+      return Err;
+    TF.Tier = 2;
+    ++NumPromotions;
+    return Error::success();
+  }
+
+  /// linkCallees - Give M the bodies of the tiered functions it calls as
+  /// available_externally definitions: the inliner can use them,
+  /// and calls it leaves alone still go through the stubs.
+  Error linkCallees(Module &M) {
+    std::vector<TieredFunction *> Callees;
+    {
+      std::lock_guard<std::mutex> Guard(TierLock);
+      for (Function &F : M) {
+        auto It = TierIndex.find(F.getName());
+        if (F.isDeclaration() && It != TierIndex.end())
+          Callees.push_back(It->second);
+      }
+    }
+
+    for (TieredFunction *Callee : Callees) {
+      auto CM = parseBitcodeFile(
+          MemoryBufferRef(
+              StringRef(Callee->Bitcode.data(), Callee->Bitcode.size()),
+              Callee->Name),
+          M.getContext());
+      if (!CM)
+        return CM.takeError();
+      for (Function &F : **CM) {
+        if (F.isDeclaration())
+          continue;
+        if (F.getName() == Callee->Name) {
+          F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+          if (Profile)
+            Profile->annotate(F, Callee->Name);
+        } else
+          F.deleteBody();
+      }
+      if (Linker::linkModules(M, std::move(*CM), Linker::LinkOnlyNeeded))
+        return make_error<StringError>("could not link in '" + Callee->Name +
+                                           "' for inlining",
+                                       inconvertibleErrorCode());
+    }
+    return Error::success();
+  }
+
+  /// applyProfile - Give M's definitions the branch weights in Profile and,
+  /// under ProfileGen, make them count into it.
+  void applyProfile(Module &M) {
+    if (!Profile)
+      return;
+    bool Annotated = false;
+    for (Function &F : M) {
+      if (F.isDeclaration())
+        continue;
+      Annotated |= Profile->annotate(F, F.getName());
+      if (ProfileGen)
+        Profile->instrument(F, F.getName());
+    }
+    if (Annotated)
+      Profile->setSummary(M);
+  }
+
+  /// optimize - Run the optimization pipeline over a module as it is
+  /// materialized, just before it is compiled, unless its object is in the
+  /// cache.  A top-level expression's module runs once and is thrown away,
+  /// so it is neither looked up in the cache nor stored there.
+  Expected<ThreadSafeModule> optimize(ThreadSafeModule TSM,
+                                      const MaterializationResponsibility &R) {
+    if (Cache && TSM.withModuleDo([&](Module &M) {
+          return !M.getFunction("__anon_expr") && Cache->lookup(M);
+        }))
+      return std::move(TSM);
+    auto OptTM = TMs.take();
+    if (!OptTM)
+      return OptTM.takeError();
+    TSM.withModuleDo([&](Module &M) {
+      optimizeModule(M, OptLevel, OptTM->get(), false);
+    });
+    TMs.give(std::move(*OptTM));
+    return std::move(TSM);
   }
 };
 
@@ -0,0 +1,144 @@
+//===- number.hh - Numeric literal parsing ----------------------*- C++ -*-===//
+//
+// Converts the text of a numeric literal straight from the source buffer,
+// without copying it or going through the locale-aware strtod.  Most literals
+// have at most 19 significant digits and a small exponent, and are converted
+// exactly with one multiply or divide (Clinger's fast path); the rest fall back
+// to APFloat, which is exact for any input.
+//
+// Accepted forms:
+//   decimal  ::= digits ('.' digits?)? exponent? | '.' digits exponent?
+//   exponent ::= [eE] [+-]? digits
+//   hex      ::= '0' [xX] hexdigits
+// Integer literals, decimal or hex, may carry a C-style u/l/ll suffix.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_NUMBER_HH
+#define DIV_NUMBER_HH
+
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include <cstdint>
+
+/// isIntegerSuffix - Return true if S is empty or one of the C integer
+/// suffixes: an optional u/U before or after l, L, ll or LL.
+static inline bool isIntegerSuffix(llvm::StringRef S) {
+  bool SawU = S.consume_front("u") || S.consume_front("U");
+  if (!S.consume_front("ll") && !S.consume_front("LL"))
+    S.consume_front("l") || S.consume_front("L");
+  if (!SawU)
+    S.consume_front("u") || S.consume_front("U");
+  return S.empty();
+}
+
+/// parseNumber - Convert Text, the complete spelling of a numeric literal, into
+/// Val.  Returns false if Text is not a well-formed literal.
+static inline bool parseNumber(llvm::StringRef Text, double &Val) {
+  const char *P = Text.begin(), *E = Text.end();
+
+  if (Text.size() > 2 && P[0] == '0' && (P[1] == 'x' || P[1] == 'X')) {
+    P += 2;
+    uint64_t Mantissa = 0;
+    const char *Digits = P;
+    bool Overflow = false;
+    for (unsigned D; P != E && (D = llvm::hexDigitValue(*P)) != -1U; ++P) {
+      Overflow |= Mantissa >> 60 != 0;
+      Mantissa = Mantissa << 4 | D;
+    }
+    if (P == Digits || !isIntegerSuffix(llvm::StringRef(P, E - P)))
+      return false;
+    if (!Overflow) {
+      Val = (double)Mantissa;
+      return true;
+    }
+    llvm::SmallString<32> HexFloat(Text.begin(), P);
+    HexFloat += "p0";
+    llvm::APFloat F(llvm::APFloat::IEEEdouble());
+    llvm::consumeError(
+        F.convertFromString(HexFloat, llvm::APFloat::rmNearestTiesToEven)
+            .takeError());
+    Val = F.convertToDouble();
+    return true;
+  }
+
+  // Accumulate up to 19 significant digits; any more send us to APFloat.
+  uint64_t Mantissa = 0;
+  int Exp10 = 0;
+  unsigned NumDigits = 0, NumSignificant = 0;
+  bool Exact = true;
+  auto addDigit = [&](char C, bool Fraction) {
+    ++NumDigits;
+    if (Mantissa == 0 && C == '0') {
+      Exp10 -= Fraction;
+      return;
+    }
+    if (NumSignificant == 19) {
+      Exact = false;
+      Exp10 += !Fraction;
+      return;
+    }
+    Mantissa = Mantissa * 10 + (C - '0');
+    ++NumSignificant;
+    Exp10 -= Fraction;
+  };
+
+  for (; P != E && *P >= '0' && *P <= '9'; ++P)
+    addDigit(*P, false);
+  bool IsInteger = true;
+  if (P != E && *P == '.') {
+    IsInteger = false;
+    for (++P; P != E && *P >= '0' && *P <= '9'; ++P)
+      addDigit(*P, true);
+  }
+  if (NumDigits == 0)
+    return false;
+
+  const char *MantissaEnd = P;
+  if (P != E && (*P == 'e' || *P == 'E')) {
+    IsInteger = false;
+    ++P;
+    bool Neg = false;
+    if (P != E && (*P == '+' || *P == '-'))
+      Neg = *P++ == '-';
+    if (P == E || *P < '0' || *P > '9')
+      return false;
+    int Exp = 0;
+    for (; P != E && *P >= '0' && *P <= '9'; ++P)
+      Exp = Exp < 100000 ? Exp * 10 + (*P - '0') : Exp;
+    Exp10 += Neg ? -Exp : Exp;
+  }
+
+  llvm::StringRef Suffix(P, E - P);
+  if (IsInteger ? !isIntegerSuffix(Suffix) : !Suffix.empty())
+    return false;
+
+  static const double Pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                 1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                 1e18, 1e19, 1e20, 1e21, 1e22};
+  if (Mantissa == 0) {
+    Val = 0.0;
+    return true;
+  }
+  if (Exact && Mantissa <= (uint64_t(1) << 53) && Exp10 >= -22 &&
+      Exp10 <= 22) {
+    Val = Exp10 < 0 ? (double)Mantissa / Pow10[-Exp10]
+                    : (double)Mantissa * Pow10[Exp10];
+    return true;
+  }
+
+  llvm::APFloat F(llvm::APFloat::IEEEdouble());
+  llvm::StringRef Literal(Text.begin(), (IsInteger ? MantissaEnd : P) -
+                                            Text.begin());
+  llvm::consumeError(
+      F.convertFromString(Literal, llvm::APFloat::rmNearestTiesToEven)
+          .takeError());
+  Val = F.convertToDouble();
+  return true;
+}
+
+#endif // DIV_NUMBER_HH
@@ -0,0 +1,260 @@
+//===- objcache.hh - Compiled modules kept on disk --------------*- C++ -*-===//
+//
+// Optimizing and compiling a module costs far more than generating its IR, and
+// a program's definitions mostly come out the same from one run to the next.
+// The object cache keeps each module's object file in a directory, under a
+// hash of the module's IR and of everything else that goes into its code: the
+// optimization level, the target and its features, and the version of LLVM.
+// When a module's hash is found there, the object is loaded and neither the
+// optimizer nor the code generator runs.
+//
+// Every object file is named llvmcache-<hash>, as LLVM's cache pruning
+// expects.  When the directory outgrows its limit, the files used least
+// recently are removed.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_OBJCACHE_HH
+#define DIV_OBJCACHE_HH
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/// ObjectCacheStats - What the cache has done this session.
+struct ObjectCacheStats {
+  unsigned Hits = 0;
+  unsigned Misses = 0;
+  unsigned Stores = 0;
+  unsigned Evictions = 0;
+  uint64_t Files = 0; // In the directory, as of the last scan plus stores.
+  uint64_t Bytes = 0;
+};
+
+/// DivObjectCache - An object file cache in a directory, shared by every run
+/// that uses the same one.
+///
+/// A module is looked up with lookup() before it is optimized, since the
+/// optimized IR cannot be had without running the optimizer.  The hash is
+/// left in the module as named metadata, from where the compiler's calls to
+/// getObject and notifyObjectCompiled pick it up.  A module without it, one
+/// that was never looked up, is neither loaded from the cache nor stored.
+class DivObjectCache : public llvm::ObjectCache {
+  std::string Dir;
+  uint64_t MaxBytes;
+  /// Salt - Everything but the IR that the object depends on.
+  std::string Salt;
+
+  std::mutex Lock; // Guards Loaded, Files and Bytes.
+  /// Loaded - Objects found by lookup(), waiting for getObject.
+  llvm::StringMap<std::unique_ptr<llvm::MemoryBuffer>> Loaded;
+  uint64_t Files = 0, Bytes = 0;
+
+  std::atomic<unsigned> Hits{0}, Misses{0}, Stores{0}, Evictions{0};
+
+  static constexpr const char *KeyMD = "div.object.cache.key";
+
+  DivObjectCache(std::string Dir, uint64_t MaxBytes, std::string Salt)
+      : Dir(std::move(Dir)), MaxBytes(MaxBytes), Salt(std::move(Salt)) {}
+
+public:
+  /// create - Open the cache in Dir, creating the directory if need be, and
+  /// bring it within MaxBytes, or with 0, leave its size unlimited.  Salt
+  /// should describe the target and the options code is generated with.
+  static llvm::Expected<std::unique_ptr<DivObjectCache>>
+  create(llvm::StringRef Dir, uint64_t MaxBytes, llvm::StringRef Salt) {
+    if (std::error_code EC = llvm::sys::fs::create_directories(Dir))
+      return llvm::createStringError(EC, "cannot create cache directory '" +
+                                             Dir + "': " + EC.message());
+    std::unique_ptr<DivObjectCache> Cache(new DivObjectCache(
+        Dir.str(), MaxBytes,
+        (Salt + "\nLLVM " + LLVM_VERSION_STRING).str()));
+    Cache->prune();
+    return std::move(Cache);
+  }
+
+  /// lookup - Hash M and tag it with the hash.  If its object is cached,
+  /// load it, ready for the compiler to ask for, and return true: M need
+  /// not be optimized.
+  bool lookup(llvm::Module &M) {
+    std::string Key = hash(M);
+    llvm::LLVMContext &Ctx = M.getContext();
+    M.getOrInsertNamedMetadata(KeyMD)->addOperand(
+        llvm::MDNode::get(Ctx, llvm::MDString::get(Ctx, Key)));
+
+    std::string Path = getPath(Key);
+    auto Obj = llvm::MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                           /*RequiresNullTerminator=*/false);
+    if (!Obj) {
+      ++Misses;
+      return false;
+    }
+    // Pruning goes by the time each file was last used.
+    int FD;
+    if (!llvm::sys::fs::openFileForWrite(Path, FD,
+                                         llvm::sys::fs::CD_OpenExisting)) {
+      llvm::sys::fs::setLastAccessAndModificationTime(
+          FD, std::chrono::system_clock::now());
+      llvm::sys::Process::SafelyCloseFileDescriptor(FD);
+    }
+    ++Hits;
+    std::lock_guard<std::mutex> Guard(Lock);
+    Loaded[Key] = std::move(*Obj);
+    return true;
+  }
+
+  std::unique_ptr<llvm::MemoryBuffer>
+  getObject(const llvm::Module *M) override {
+    std::string Key = getKey(*M);
+    if (Key.empty())
+      return nullptr;
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto It = Loaded.find(Key);
+    if (It == Loaded.end())
+      return nullptr;
+    std::unique_ptr<llvm::MemoryBuffer> Obj = std::move(It->second);
+    Loaded.erase(It);
+    return Obj;
+  }
+
+  void notifyObjectCompiled(const llvm::Module *M,
+                            llvm::MemoryBufferRef Obj) override {
+    std::string Key = getKey(*M);
+    if (Key.empty())
+      return;
+
+    // Write to a temporary file and rename it into place, so that another
+    // run never sees a partial object.
+    llvm::SmallString<128> Model(Dir);
+    llvm::sys::path::append(Model, "tmp-%%%%%%%%.o");
+    auto Temp = llvm::sys::fs::TempFile::create(Model);
+    if (!Temp) {
+      llvm::consumeError(Temp.takeError());
+      return;
+    }
+    {
+      llvm::raw_fd_ostream OS(Temp->FD, /*shouldClose=*/false);
+      OS << Obj.getBuffer();
+    }
+    if (llvm::Error Err = Temp->keep(getPath(Key))) {
+      llvm::consumeError(std::move(Err));
+      llvm::consumeError(Temp->discard());
+      return;
+    }
+    ++Stores;
+
+    bool Full;
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      ++Files;
+      Bytes += Obj.getBufferSize();
+      Full = MaxBytes && Bytes > MaxBytes;
+    }
+    if (Full)
+      prune();
+  }
+
+  ObjectCacheStats getStats() {
+    ObjectCacheStats S;
+    S.Hits = Hits;
+    S.Misses = Misses;
+    S.Stores = Stores;
+    S.Evictions = Evictions;
+    std::lock_guard<std::mutex> Guard(Lock);
+    S.Files = Files;
+    S.Bytes = Bytes;
+    return S;
+  }
+
+  const std::string &getDirectory() const { return Dir; }
+
+private:
+  std::string getPath(llvm::StringRef Key) const {
+    llvm::SmallString<128> Path(Dir);
+    llvm::sys::path::append(Path, "llvmcache-" + Key);
+    return std::string(Path);
+  }
+
+  /// hash - The SHA-1 of M's bitcode and the salt, in hex.
+  std::string hash(const llvm::Module &M) const {
+    llvm::SmallVector<char, 0> Bitcode;
+    llvm::raw_svector_ostream OS(Bitcode);
+    llvm::WriteBitcodeToFile(M, OS);
+
+    llvm::SHA1 Hasher;
+    Hasher.update(Salt);
+    Hasher.update(llvm::StringRef(Bitcode.data(), Bitcode.size()));
+    return llvm::toHex(Hasher.final(), /*LowerCase=*/true);
+  }
+
+  static std::string getKey(const llvm::Module &M) {
+    llvm::NamedMDNode *MD = M.getNamedMetadata(KeyMD);
+    if (!MD || MD->getNumOperands() == 0)
+      return "";
+    auto *S = llvm::cast<llvm::MDString>(MD->getOperand(0)->getOperand(0));
+    return S->getString().str();
+  }
+
+  /// scan - Count the objects in the directory and their size.
+  void scan(uint64_t &NumFiles, uint64_t &NumBytes) const {
+    NumFiles = NumBytes = 0;
+    std::error_code EC;
+    for (llvm::sys::fs::directory_iterator I(Dir, EC), E; I != E && !EC;
+         I.increment(EC)) {
+      if (!llvm::sys::path::filename(I->path()).startswith("llvmcache-"))
+        continue;
+      auto Status = I->status();
+      if (!Status)
+        continue;
+      ++NumFiles;
+      NumBytes += Status->getSize();
+    }
+  }
+
+  /// prune - Bring the directory within its limit, removing the objects used
+  /// least recently.  It is cut to three quarters of the limit, so that it is
+  /// not scanned again on the very next store.  Objects are removed only to
+  /// make room, never for their age.
+  void prune() {
+    uint64_t FilesBefore, BytesBefore, FilesAfter, BytesAfter;
+    scan(FilesBefore, BytesBefore);
+    if (MaxBytes && BytesBefore > MaxBytes) {
+      llvm::CachePruningPolicy Policy;
+      Policy.Interval = std::chrono::seconds(0);
+      Policy.Expiration = std::chrono::seconds(0);
+      Policy.MaxSizeBytes = MaxBytes / 4 * 3;
+      llvm::pruneCache(Dir, Policy);
+      scan(FilesAfter, BytesAfter);
+      if (FilesBefore > FilesAfter)
+        Evictions += FilesBefore - FilesAfter;
+    } else {
+      FilesAfter = FilesBefore;
+      BytesAfter = BytesBefore;
+    }
+    std::lock_guard<std::mutex> Guard(Lock);
+    Files = FilesAfter;
+    Bytes = BytesAfter;
+  }
+};
+
+#endif // DIV_OBJCACHE_HH
@@ -0,0 +1,127 @@
+//===- operators.hh - Binary operator table ---------------------*- C++ -*-===//
+//
+// The precedence and properties of every binary operator, indexed directly by
+// the operator's character.  Each entry is a single atomic word, so parser
+// threads can look operators up without taking a lock while another thread
+// registers one that has just been defined.
+//
+// When a file is parsed in parallel, every operator definition is registered
+// before any parsing starts, tagged with where it was defined.  A parser then
+// only sees the operators defined before the item it is parsing, just as it
+// would have parsing the file from the top.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_OPERATORS_HH
+#define DIV_OPERATORS_HH
+
+#include <atomic>
+#include <cstdint>
+
+/// OperatorFlag - Properties of a binary operator.
+enum OperatorFlag : uint8_t {
+  OF_Builtin = 1 << 0,      // Lowered to instructions by the code generator.
+  OF_UserDefined = 1 << 1,  // Defined with 'def binary'; a call to binaryX.
+  OF_Inlinable = 1 << 2,    // Cheap enough to expand at every use.
+  OF_ShortCircuit = 1 << 3, // Evaluates its right operand only when needed.
+  OF_RightAssoc = 1 << 4,   // "a op b op c" groups as "a op (b op c)".
+};
+
+/// OperatorInfo - One entry of the table.  A zero precedence means the
+/// character is not a binary operator.
+struct OperatorInfo {
+  uint8_t Precedence = 0;
+  uint8_t Flags = 0;
+  /// VisibleFrom - Items starting at or after this source offset see the
+  /// operator: one past the offset of its definition, or zero for builtins
+  /// and operators defined as the program runs.
+  uint64_t VisibleFrom = 0;
+
+  bool isBinaryOp() const { return Precedence != 0; }
+  bool isBuiltin() const { return Flags & OF_Builtin; }
+  bool isUserDefined() const { return Flags & OF_UserDefined; }
+  bool isInlinable() const { return Flags & OF_Inlinable; }
+  bool isShortCircuit() const { return Flags & OF_ShortCircuit; }
+  bool isRightAssoc() const { return Flags & OF_RightAssoc; }
+};
+
+/// OperatorTable - A dense, 256-entry operator table.  Lookups are a single
+/// load.  Registration compares and swaps the one entry it changes, so a
+/// user-defined operator can never overwrite a builtin, even under a race.
+class OperatorTable {
+  std::atomic<uint64_t> Entries[256];
+
+  static uint64_t pack(OperatorInfo Info) {
+    return Info.Precedence | Info.Flags << 8 | Info.VisibleFrom << 16;
+  }
+  static OperatorInfo unpack(uint64_t E) {
+    OperatorInfo Info;
+    Info.Precedence = E & 0xff;
+    Info.Flags = (E >> 8) & 0xff;
+    Info.VisibleFrom = E >> 16;
+    return Info;
+  }
+
+public:
+  OperatorTable() {
+    for (auto &E : Entries)
+      E.store(0, std::memory_order_relaxed);
+  }
+
+  /// lookup - The entry for Tok as seen from an item starting at offset At.
+  /// Tok may be any token; only characters can be operators.
+  OperatorInfo lookup(int Tok, uint64_t At = UINT64_MAX) const {
+    if (Tok < 0 || Tok > 255)
+      return OperatorInfo();
+    OperatorInfo Info = unpack(Entries[Tok].load(std::memory_order_acquire));
+    return Info.VisibleFrom <= At ? Info : OperatorInfo();
+  }
+
+  /// getPrecedence - The precedence of binary operator Tok, or -1 if it is not
+  /// one.
+  int getPrecedence(int Tok, uint64_t At = UINT64_MAX) const {
+    OperatorInfo Info = lookup(Tok, At);
+    return Info.isBinaryOp() ? Info.Precedence : -1;
+  }
+
+  /// addBuiltin - Install an operator the code generator knows how to lower.
+  void addBuiltin(char Op, unsigned Prec, uint8_t Flags = OF_Inlinable) {
+    OperatorInfo Info;
+    Info.Precedence = Prec;
+    Info.Flags = Flags | OF_Builtin;
+    Entries[(unsigned char)Op].store(pack(Info), std::memory_order_release);
+  }
+
+  /// define - Register, or re-register, a user-defined operator.  Returns
+  /// false, leaving the table alone, if Op is a builtin.
+  bool define(char Op, unsigned Prec, uint8_t Flags = 0,
+              uint64_t VisibleFrom = 0) {
+    OperatorInfo Info;
+    Info.Precedence = Prec;
+    Info.Flags = Flags | OF_UserDefined;
+    Info.VisibleFrom = VisibleFrom;
+    std::atomic<uint64_t> &E = Entries[(unsigned char)Op];
+    uint64_t Old = E.load(std::memory_order_relaxed);
+    do {
+      if (unpack(Old).isBuiltin())
+        return false;
+    } while (!E.compare_exchange_weak(Old, pack(Info),
+                                      std::memory_order_release,
+                                      std::memory_order_relaxed));
+    return true;
+  }
+
+  /// undefine - Remove a user-defined operator, e.g. once its definition has
+  /// failed to compile.  Builtins stay.
+  void undefine(char Op) {
+    std::atomic<uint64_t> &E = Entries[(unsigned char)Op];
+    uint64_t Old = E.load(std::memory_order_relaxed);
+    do {
+      if (!unpack(Old).isUserDefined())
+        return;
+    } while (!E.compare_exchange_weak(Old, 0, std::memory_order_release,
+                                      std::memory_order_relaxed));
+  }
+};
+
+#endif // DIV_OPERATORS_HH
@@ -0,0 +1,106 @@
+//===- optimize.hh - The optimization pipeline ------------------*- C++ -*-===//
+//
+// The passes run over each module before it is compiled to machine code, on
+// the new pass manager.  The levels follow clang's: -O0 runs only what code
+// generation needs, -O1 promotes variables to registers and cleans up, -O2 adds
+// GVN, loop and vectorization passes and -O3 lets the inliner and the loop
+// unroller go further still.
+//
+// Under LLVM's own -time-passes, each pass's time is added up over every
+// module the session optimizes, for printPassTimes to report at the end.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_OPTIMIZE_HH
+#define DIV_OPTIMIZE_HH
+
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Target/TargetMachine.h"
+#include "timing.hh"
+#include <mutex>
+
+/// getOptimizationLevel - The pass builder's name for level 0 to 3.
+static inline llvm::OptimizationLevel getOptimizationLevel(unsigned Level) {
+  switch (Level) {
+  case 0:
+    return llvm::OptimizationLevel::O0;
+  case 1:
+    return llvm::OptimizationLevel::O1;
+  case 2:
+    return llvm::OptimizationLevel::O2;
+  default:
+    return llvm::OptimizationLevel::O3;
+  }
+}
+
+/// getPassTimes - The session's pass timings under -time-passes.  The
+/// handler is not thread-safe, so PassTimesLock must be held while it times
+/// a pipeline.
+static inline llvm::TimePassesHandler &getPassTimes() {
+  static llvm::TimePassesHandler PassTimes(/*Enabled=*/true);
+  return PassTimes;
+}
+static std::mutex PassTimesLock;
+
+/// printPassTimes - Under -time-passes, report the optimizer's pass timings
+/// and the code generator's, which run on the legacy pass manager and are
+/// kept apart.
+static inline void printPassTimes() {
+  if (!llvm::TimePassesIsEnabled)
+    return;
+  getPassTimes().print();
+  llvm::reportAndResetTimings();
+}
+
+/// optimizeModule - Run the level Level pipeline over M.  TM, if given,
+/// supplies the target's cost model, which the vectorizers and the unroller
+/// need to do anything useful.  Unless CallGraphProfile is false, a module
+/// with profile counts gets a call graph profile for the static linker to
+/// order functions by, in a section JITLink cannot link.
+static inline void optimizeModule(llvm::Module &M, unsigned Level,
+                                  llvm::TargetMachine *TM,
+                                  bool CallGraphProfile = true) {
+  PhaseScope Timing(PhaseOptimize);
+  llvm::OptimizationLevel OL = getOptimizationLevel(Level);
+
+  // The pass builder leaves the loop and SLP vectorizers off unless asked;
+  // clang turns them on from -O2.
+  llvm::PipelineTuningOptions PTO;
+  PTO.LoopInterleaving = Level >= 2;
+  PTO.LoopVectorization = Level >= 2;
+  PTO.SLPVectorization = Level >= 2;
+  PTO.CallGraphProfile = CallGraphProfile;
+
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+
+  // Pipelines are timed one at a time, so -time-passes serializes them.
+  std::unique_lock<std::mutex> PassTiming;
+  llvm::PassInstrumentationCallbacks PIC;
+  if (llvm::TimePassesIsEnabled) {
+    PassTiming = std::unique_lock<std::mutex>(PassTimesLock);
+    getPassTimes().registerCallbacks(PIC);
+  }
+
+  llvm::PassBuilder PB(TM, PTO, llvm::None, &PIC);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  llvm::ModulePassManager MPM = OL == llvm::OptimizationLevel::O0
+                                    ? PB.buildO0DefaultPipeline(OL)
+                                    : PB.buildPerModuleDefaultPipeline(OL);
+  MPM.run(M, MAM);
+}
+
+#endif // DIV_OPTIMIZE_HH
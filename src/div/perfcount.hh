@@ -0,0 +1,90 @@
+//===- perfcount.hh - Hardware and kernel event counters --------*- C++ -*-===//
+//
+// Counts of events such as TLB misses and page faults, read from the kernel's
+// perf events interface.  Counting starts when the counter is opened and
+// takes in the threads this one goes on to create.  Where the interface is
+// missing, or forbidden, or the machine does not count the event, the counter
+// is simply unavailable.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_PERFCOUNT_HH
+#define DIV_PERFCOUNT_HH
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/// PerfCounter - One event, counted in user mode for this thread and those
+/// it creates after the counter is opened.
+class PerfCounter {
+  int FD = -1;
+
+public:
+  PerfCounter() = default;
+  PerfCounter(const PerfCounter &) = delete;
+  PerfCounter &operator=(const PerfCounter &) = delete;
+  ~PerfCounter() { close(); }
+
+#ifdef __linux__
+  /// open - Start counting the event given by Type and Config, as for
+  /// perf_event_open.  Returns whether the counter is available.
+  bool open(uint32_t Type, uint64_t Config) {
+    close();
+    perf_event_attr Attr;
+    memset(&Attr, 0, sizeof(Attr));
+    Attr.size = sizeof(Attr);
+    Attr.type = Type;
+    Attr.config = Config;
+    Attr.exclude_kernel = 1;
+    Attr.exclude_hv = 1;
+    Attr.inherit = 1;
+    FD = syscall(SYS_perf_event_open, &Attr, 0, -1, -1, 0);
+    return FD >= 0;
+  }
+
+  /// openITLBMisses - Count misses in the instruction TLB.
+  bool openITLBMisses() {
+    return open(PERF_TYPE_HW_CACHE,
+                PERF_COUNT_HW_CACHE_ITLB |
+                    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  }
+
+  /// openPageFaults - Count page faults, which the kernel counts in
+  /// software, and so is nearly always able to.
+  bool openPageFaults() {
+    return open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+  }
+
+  /// read - The count so far, or 0 if the counter is unavailable.  With
+  /// inherit set, a counter's children are only added in as they exit.
+  uint64_t read() const {
+    uint64_t Count = 0;
+    if (FD < 0 || ::read(FD, &Count, sizeof(Count)) != sizeof(Count))
+      return 0;
+    return Count;
+  }
+
+  void close() {
+    if (FD >= 0)
+      ::close(FD);
+    FD = -1;
+  }
+#else
+  bool open(uint32_t, uint64_t) { return false; }
+  bool openITLBMisses() { return false; }
+  bool openPageFaults() { return false; }
+  uint64_t read() const { return 0; }
+  void close() {}
+#endif
+
+  bool isAvailable() const { return FD >= 0; }
+};
+
+#endif // DIV_PERFCOUNT_HH
@@ -0,0 +1,492 @@
+//===- perfjit.hh - JIT'd code for Linux perf -------------------*- C++ -*-===//
+//
+// perf finds the code it samples through the files it was mapped from, and
+// JIT'd code was mapped from none: it shows up as [unknown].  Two files fill
+// the gap, both written as each object is linked.
+//
+// The perf map, /tmp/perf-<pid>.map, names each function's address range,
+// one line per function.  perf report reads it as it is.
+//
+// The jitdump file, jit-<pid>.dump in $JITDUMPDIR or /tmp, records each
+// function's code as well, with its line table when the code was compiled
+// with -g, and the time it was loaded, so that code loaded at an address
+// freed by other code is told apart.  It is mapped executable, which puts it
+// in the profile, for `perf inject --jit` to turn into an ELF file for each
+// function; the profile has to be recorded with `perf record -k mono` for
+// the times to match.
+//
+// Either can be turned on and off while the JIT runs.  Off, the listener
+// RuntimeDyld calls and the plugin JITLink calls each test a flag per
+// object, and nothing else; code linked while off is left out.
+//
+// The same functions and line tables can go into a JITSymbolTable, for
+// profiling from within the process.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_PERFJIT_HH
+#define DIV_PERFJIT_HH
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/BinaryFormat/ELF.h"
+#include "llvm/DebugInfo/DWARF/DWARFContext.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include <atomic>
+#include <map>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/// PerfJITOutput - The files PerfJITWriter can write, as bits.
+enum PerfJITOutput : unsigned {
+  PerfMap = 1,
+  PerfJITDump = 2,
+};
+
+/// PerfJITLine - A line table entry: the code from Offset bytes into a
+/// function on came from Line of File.
+struct PerfJITLine {
+  uint64_t Offset;
+  uint32_t Line;
+  std::string File;
+};
+
+/// PerfJITWriter - Writes the perf map and the jitdump file.  There is one
+/// per process, from get(), since both files are named after the process and
+/// each must be written from the start only once.
+class PerfJITWriter {
+  std::mutex Lock; // Guards everything but Outputs.
+  std::atomic<unsigned> Outputs{0};
+  uint32_t Machine;
+  FILE *Map = nullptr;
+  FILE *Dump = nullptr;
+  uint64_t CodeIndex = 0;
+
+  // The jitdump format, version 1, as perf's jitdump-specification.txt
+  // describes it.
+  enum : uint32_t {
+    JITDumpMagic = 0x4A695444, // "JiTD"
+    JITCodeLoad = 0,
+    JITCodeDebugInfo = 2,
+  };
+  struct JITDumpHeader {
+    uint32_t Magic, Version, TotalSize, ELFMachine, Pad, Pid;
+    uint64_t Timestamp, Flags;
+  };
+  struct JITDumpRecord {
+    uint32_t Id, TotalSize;
+    uint64_t Timestamp;
+  };
+  struct JITDumpCodeLoad {
+    JITDumpRecord Prefix;
+    uint32_t Pid, Tid;
+    uint64_t VMA, CodeAddr, CodeSize, CodeIndex;
+  };
+  struct JITDumpDebugInfo {
+    JITDumpRecord Prefix;
+    uint64_t CodeAddr, NumEntries;
+  };
+  struct JITDumpDebugEntry {
+    uint64_t Addr;
+    uint32_t Line, Discriminator;
+  };
+
+  PerfJITWriter() {
+    switch (llvm::Triple(llvm::sys::getProcessTriple()).getArch()) {
+    case llvm::Triple::x86_64:
+      Machine = llvm::ELF::EM_X86_64;
+      break;
+    case llvm::Triple::x86:
+      Machine = llvm::ELF::EM_386;
+      break;
+    case llvm::Triple::aarch64:
+      Machine = llvm::ELF::EM_AARCH64;
+      break;
+    default:
+      Machine = llvm::ELF::EM_NONE;
+      break;
+    }
+  }
+
+public:
+  PerfJITWriter(const PerfJITWriter &) = delete;
+  PerfJITWriter &operator=(const PerfJITWriter &) = delete;
+
+  /// get - The writer.  It is never destroyed, nor its files closed, since
+  /// code can still be linked on other threads as the process exits; every
+  /// record is flushed as it is written.
+  static PerfJITWriter &get() {
+    static PerfJITWriter *Writer = new PerfJITWriter;
+    return *Writer;
+  }
+
+  /// getOutputs - The files being written, as PerfJITOutput bits.
+  unsigned getOutputs() const { return Outputs; }
+
+  /// setOutputs - Write the files NewOutputs asks for from now on, and stop
+  /// writing the rest.  Each file is created when first asked for and left
+  /// open, so that turning it on again carries on where it left off.
+  llvm::Error setOutputs(unsigned NewOutputs) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if ((NewOutputs & PerfMap) && !Map) {
+      std::string Path = "/tmp/perf-" + std::to_string(getPid()) + ".map";
+      Map = fopen(Path.c_str(), "w");
+      if (!Map)
+        return llvm::createStringError(
+            std::error_code(errno, std::generic_category()),
+            "cannot open '" + Path + "'");
+    }
+    if ((NewOutputs & PerfJITDump) && !Dump)
+      if (llvm::Error Err = openJITDump())
+        return Err;
+    Outputs = NewOutputs;
+    return llvm::Error::success();
+  }
+
+  /// notifyCode - Record that the function Name is at Addr, Size bytes of
+  /// Code, generated from Lines.
+  void notifyCode(llvm::StringRef Name, uint64_t Addr, uint64_t Size,
+                  const void *Code, llvm::ArrayRef<PerfJITLine> Lines) {
+    unsigned Out = Outputs;
+    if (!Out || !Size)
+      return;
+    std::lock_guard<std::mutex> Guard(Lock);
+    if ((Out & PerfMap) && Map) {
+      fprintf(Map, "%" PRIx64 " %" PRIx64 " %.*s\n", Addr, Size,
+              (int)Name.size(), Name.data());
+      fflush(Map);
+    }
+    if ((Out & PerfJITDump) && Dump) {
+      // A function's line table has to come before its code.
+      if (!Lines.empty())
+        writeDebugInfo(Addr, Lines);
+      writeCodeLoad(Name, Addr, Size, Code);
+      fflush(Dump);
+    }
+  }
+
+private:
+  static uint32_t getPid() { return llvm::sys::Process::getProcessId(); }
+
+  /// getTimestamp - CLOCK_MONOTONIC, the clock perf record -k mono uses.
+  static uint64_t getTimestamp() {
+    timespec TS;
+    clock_gettime(CLOCK_MONOTONIC, &TS);
+    return uint64_t(TS.tv_sec) * 1000000000 + TS.tv_nsec;
+  }
+
+  llvm::Error openJITDump() {
+#ifdef __linux__
+    const char *Dir = getenv("JITDUMPDIR");
+    llvm::SmallString<128> Path(Dir && *Dir ? Dir : "/tmp");
+    llvm::sys::path::append(Path, "jit-" + std::to_string(getPid()) + ".dump");
+    int FD = open(Path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+    if (FD < 0)
+      return llvm::createStringError(
+          std::error_code(errno, std::generic_category()),
+          "cannot open '" + Path + "'");
+
+    // perf only notices the file if it is mapped executable.
+    if (mmap(nullptr, llvm::sys::Process::getPageSizeEstimate(),
+             PROT_READ | PROT_EXEC, MAP_PRIVATE, FD, 0) == MAP_FAILED) {
+      std::error_code EC(errno, std::generic_category());
+      close(FD);
+      return llvm::createStringError(EC, "cannot map '" + Path + "'");
+    }
+    Dump = fdopen(FD, "w");
+
+    JITDumpHeader Header = {JITDumpMagic,   1, sizeof(JITDumpHeader),
+                            Machine,        0, getPid(),
+                            getTimestamp(), 0};
+    fwrite(&Header, sizeof(Header), 1, Dump);
+    fflush(Dump);
+    return llvm::Error::success();
+#else
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "jitdump files are only for Linux");
+#endif
+  }
+
+  void writeCodeLoad(llvm::StringRef Name, uint64_t Addr, uint64_t Size,
+                     const void *Code) {
+#ifdef __linux__
+    JITDumpCodeLoad Record;
+    Record.Prefix.Id = JITCodeLoad;
+    Record.Prefix.TotalSize = sizeof(Record) + Name.size() + 1 + Size;
+    Record.Prefix.Timestamp = getTimestamp();
+    Record.Pid = getPid();
+    Record.Tid = syscall(SYS_gettid);
+    Record.VMA = Record.CodeAddr = Addr;
+    Record.CodeSize = Size;
+    Record.CodeIndex = CodeIndex++;
+    fwrite(&Record, sizeof(Record), 1, Dump);
+    fwrite(Name.data(), 1, Name.size(), Dump);
+    fputc(0, Dump);
+    fwrite(Code, 1, Size, Dump);
+#endif
+  }
+
+  void writeDebugInfo(uint64_t Addr, llvm::ArrayRef<PerfJITLine> Lines) {
+    JITDumpDebugInfo Record;
+    Record.Prefix.Id = JITCodeDebugInfo;
+    Record.Prefix.TotalSize = sizeof(Record);
+    for (const PerfJITLine &L : Lines)
+      Record.Prefix.TotalSize += sizeof(JITDumpDebugEntry) + L.File.size() + 1;
+    Record.Prefix.Timestamp = getTimestamp();
+    Record.CodeAddr = Addr;
+    Record.NumEntries = Lines.size();
+    fwrite(&Record, sizeof(Record), 1, Dump);
+    for (const PerfJITLine &L : Lines) {
+      JITDumpDebugEntry Entry = {Addr + L.Offset, L.Line, 0};
+      fwrite(&Entry, sizeof(Entry), 1, Dump);
+      fwrite(L.File.c_str(), 1, L.File.size() + 1, Dump);
+    }
+  }
+};
+
+/// JITSymbolTable - The JIT'd functions by address, once enabled, for looking
+/// program counters up in.  A function stays until other code is linked over
+/// it, so the address of code that has been freed gives whichever function
+/// was there last.
+class JITSymbolTable {
+  struct Function {
+    std::string Name;
+    uint64_t Size;
+    std::vector<PerfJITLine> Lines;
+  };
+
+  std::mutex Lock; // Guards Functions.
+  std::map<uint64_t, Function> Functions;
+  std::atomic<bool> Enabled{false};
+
+public:
+  void enable() { Enabled = true; }
+  bool isEnabled() const { return Enabled; }
+
+  void add(llvm::StringRef Name, uint64_t Addr, uint64_t Size,
+           llvm::ArrayRef<PerfJITLine> Lines) {
+    if (!Enabled || !Size)
+      return;
+    std::lock_guard<std::mutex> Guard(Lock);
+    // Drop whatever was at the addresses before.
+    auto It = Functions.lower_bound(Addr);
+    if (It != Functions.begin() &&
+        std::prev(It)->first + std::prev(It)->second.Size > Addr)
+      --It;
+    while (It != Functions.end() && It->first < Addr + Size)
+      It = Functions.erase(It);
+    Functions[Addr] = {Name.str(), Size, Lines.vec()};
+  }
+
+  /// lookup - Set Name to the function whose code PC is in, and Line and
+  /// File to the source of that code if it has a line table, and return
+  /// true; or return false if PC is not in JIT'd code.
+  bool lookup(uint64_t PC, std::string &Name, unsigned &Line,
+              std::string &File) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto It = Functions.upper_bound(PC);
+    if (It == Functions.begin())
+      return false;
+    --It;
+    if (PC >= It->first + It->second.Size)
+      return false;
+    Name = It->second.Name;
+    Line = 0;
+    File.clear();
+    uint64_t Offset = PC - It->first;
+    for (const PerfJITLine &L : It->second.Lines) {
+      if (L.Offset > Offset)
+        break;
+      if (L.Line) {
+        Line = L.Line;
+        File = L.File;
+      }
+    }
+    return true;
+  }
+};
+
+/// forEachFunction - Call Fn with the name, address, size and line table of
+/// each function defined in Obj, the line table only if WithLines.  Obj may
+/// be linked, as RuntimeDyld's object for debuggers is, or not, in which case
+/// each address is an offset into its section.
+static inline void forEachFunction(
+    const llvm::object::ObjectFile &Obj, bool WithLines,
+    llvm::function_ref<void(llvm::StringRef, uint64_t, uint64_t,
+                            llvm::ArrayRef<PerfJITLine>)>
+        Fn) {
+  std::unique_ptr<llvm::DWARFContext> DWARF;
+  if (WithLines)
+    DWARF = llvm::DWARFContext::create(Obj);
+  llvm::DILineInfoSpecifier Spec(
+      llvm::DILineInfoSpecifier::FileLineInfoKind::AbsoluteFilePath,
+      llvm::DINameKind::None);
+
+  std::vector<PerfJITLine> Lines;
+  for (const auto &P : llvm::object::computeSymbolSizes(Obj)) {
+    llvm::object::SymbolRef Sym = P.first;
+    auto Type = Sym.getType();
+    auto Name = Sym.getName();
+    auto Addr = Sym.getAddress();
+    auto Section = Sym.getSection();
+    if (!Type || !Name || !Addr || !Section ||
+        *Type != llvm::object::SymbolRef::ST_Function ||
+        *Section == Obj.section_end()) {
+      llvm::consumeError(Type.takeError());
+      llvm::consumeError(Name.takeError());
+      llvm::consumeError(Addr.takeError());
+      llvm::consumeError(Section.takeError());
+      continue;
+    }
+
+    Lines.clear();
+    if (DWARF)
+      for (const auto &Entry : DWARF->getLineInfoForAddressRange(
+               {*Addr, (*Section)->getIndex()}, P.second, Spec))
+        Lines.push_back({Entry.first - *Addr, Entry.second.Line,
+                         Entry.second.FileName});
+    Fn(*Name, *Addr, P.second, Lines);
+  }
+}
+
+/// PerfJITEventListener - Tells the writer and the symbol table about the
+/// functions of each object RuntimeDyld loads.
+class PerfJITEventListener : public llvm::JITEventListener {
+  PerfJITWriter &Writer;
+  JITSymbolTable &Symbols;
+
+public:
+  PerfJITEventListener(PerfJITWriter &Writer, JITSymbolTable &Symbols)
+      : Writer(Writer), Symbols(Symbols) {}
+
+  void notifyObjectLoaded(
+      ObjectKey K, const llvm::object::ObjectFile &Obj,
+      const llvm::RuntimeDyld::LoadedObjectInfo &L) override {
+    unsigned Outputs = Writer.getOutputs();
+    if (!Outputs && !Symbols.isEnabled())
+      return;
+    // The object for debuggers has every section at its load address.
+    auto DebugObj = L.getObjectForDebug(Obj);
+    const llvm::object::ObjectFile *Linked =
+        DebugObj.getBinary() ? DebugObj.getBinary() : &Obj;
+    forEachFunction(*Linked, (Outputs & PerfJITDump) || Symbols.isEnabled(),
+                    [&](llvm::StringRef Name, uint64_t Addr, uint64_t Size,
+                        llvm::ArrayRef<PerfJITLine> Lines) {
+                      Writer.notifyCode(Name, Addr, Size,
+                                        (const void *)(uintptr_t)Addr, Lines);
+                      Symbols.add(Name, Addr, Size, Lines);
+                    });
+  }
+};
+
+/// PerfJITPlugin - Tells the writer and the symbol table about the functions
+/// of each object JITLink links, once they are at their final addresses.
+/// Line tables are read from the object before it is linked and kept until
+/// then.
+class PerfJITPlugin : public llvm::orc::ObjectLinkingLayer::Plugin {
+  PerfJITWriter &Writer;
+  JITSymbolTable &Symbols;
+  std::mutex Lock; // Guards PendingLines.
+  llvm::DenseMap<llvm::orc::MaterializationResponsibility *,
+                 llvm::StringMap<std::vector<PerfJITLine>>>
+      PendingLines;
+
+public:
+  PerfJITPlugin(PerfJITWriter &Writer, JITSymbolTable &Symbols)
+      : Writer(Writer), Symbols(Symbols) {}
+
+  void notifyMaterializing(llvm::orc::MaterializationResponsibility &MR,
+                           llvm::jitlink::LinkGraph &G,
+                           llvm::jitlink::JITLinkContext &Ctx,
+                           llvm::MemoryBufferRef InputObject) override {
+    if (!((Writer.getOutputs() & PerfJITDump) || Symbols.isEnabled()) ||
+        !InputObject.getBufferSize())
+      return;
+    auto Obj = llvm::object::ObjectFile::createObjectFile(InputObject);
+    if (!Obj)
+      return llvm::consumeError(Obj.takeError());
+    llvm::StringMap<std::vector<PerfJITLine>> Lines;
+    forEachFunction(**Obj, true,
+                    [&](llvm::StringRef Name, uint64_t, uint64_t,
+                        llvm::ArrayRef<PerfJITLine> FnLines) {
+                      if (!FnLines.empty())
+                        Lines[Name] = FnLines.vec();
+                    });
+    std::lock_guard<std::mutex> Guard(Lock);
+    PendingLines[&MR] = std::move(Lines);
+  }
+
+  void modifyPassConfig(llvm::orc::MaterializationResponsibility &MR,
+                        llvm::jitlink::LinkGraph &G,
+                        llvm::jitlink::PassConfiguration &Config) override {
+    if (!Writer.getOutputs() && !Symbols.isEnabled())
+      return;
+    Config.PostFixupPasses.push_back(
+        [this, &MR](llvm::jitlink::LinkGraph &G) -> llvm::Error {
+          llvm::StringMap<std::vector<PerfJITLine>> Lines = takeLines(MR);
+          for (llvm::jitlink::Symbol *Sym : G.defined_symbols()) {
+            if (!Sym->hasName() || !Sym->isCallable() ||
+                Sym->getBlock().isZeroFill())
+              continue;
+            auto It = Lines.find(Sym->getName());
+            llvm::ArrayRef<PerfJITLine> SymLines;
+            if (It != Lines.end())
+              SymLines = It->second;
+            uint64_t Addr = Sym->getAddress().getValue();
+            Writer.notifyCode(Sym->getName(), Addr, Sym->getSize(),
+                              Sym->getSymbolContent().data(), SymLines);
+            Symbols.add(Sym->getName(), Addr, Sym->getSize(), SymLines);
+          }
+          return llvm::Error::success();
+        });
+  }
+
+  llvm::Error
+  notifyFailed(llvm::orc::MaterializationResponsibility &MR) override {
+    takeLines(MR);
+    return llvm::Error::success();
+  }
+  llvm::Error notifyRemovingResources(llvm::orc::ResourceKey K) override {
+    return llvm::Error::success();
+  }
+  void notifyTransferringResources(llvm::orc::ResourceKey DstKey,
+                                   llvm::orc::ResourceKey SrcKey) override {}
+
+private:
+  llvm::StringMap<std::vector<PerfJITLine>>
+  takeLines(llvm::orc::MaterializationResponsibility &MR) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto It = PendingLines.find(&MR);
+    if (It == PendingLines.end())
+      return {};
+    llvm::StringMap<std::vector<PerfJITLine>> Lines = std::move(It->second);
+    PendingLines.erase(It);
+    return Lines;
+  }
+};
+
+#endif // DIV_PERFJIT_HH
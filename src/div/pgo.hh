@@ -0,0 +1,304 @@
+//===- pgo.hh - Counts for profile-guided optimization ----------*- C++ -*-===//
+//
+// Code can be made to count, for every function, how often it is entered,
+// how often each conditional branch goes each way and how often each call
+// is made.  The counts then go back into the IR as an entry count and
+// branch weights, which block placement, inlining and loop unrolling all
+// take into account, and into a profile summary, which tells them what is
+// hot.  In tiered mode the baseline code counts and the optimized code is
+// given its counts; the counts can also be written to a file, to optimize
+// with on the next run.
+//
+// A function's branches and calls are numbered in the order they appear in
+// its IR as first generated.  A hash of that IR goes with the counts, so
+// counts taken from different code are never applied.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_PGO_HH
+#define DIV_PGO_HH
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// FunctionProfile - One function's counts: its entry count, then the
+/// times each conditional branch was taken and not taken, then the times
+/// each call was made.
+struct FunctionProfile {
+  uint64_t Hash = 0;
+  unsigned NumBranches = 0;
+  unsigned NumCalls = 0;
+  /// Counts - Bumped by instrumented code without synchronization; a lost
+  /// update now and then hardly changes a weight.  Never resized.
+  std::unique_ptr<uint64_t[]> Counts;
+
+  unsigned getNumCounts() const { return 1 + 2 * NumBranches + NumCalls; }
+};
+
+/// ProfileData - The counts of every function, by name.
+class ProfileData {
+  std::mutex Lock;
+  llvm::StringMap<FunctionProfile *> Functions;
+  // Every profile made, kept for as long as any code might count into it.
+  std::vector<std::unique_ptr<FunctionProfile>> Profiles;
+
+  /// Sites - A function's conditional branches and calls, in order.
+  struct Sites {
+    llvm::SmallVector<llvm::BranchInst *, 8> Branches;
+    llvm::SmallVector<llvm::CallBase *, 8> Calls;
+    uint64_t Hash = 0xcbf29ce484222325; // FNV-1a.
+  };
+
+  /// getSites - Number F's branches and calls and hash its instructions,
+  /// leaving out debug info, which -g adds and takes away.  The hash takes in
+  /// comparison predicates, callee names and floating-point constants, so
+  /// that `x < 1` and `x > 2`, or calls to f and g, do not share counts.
+  static Sites getSites(llvm::Function &F) {
+    Sites S;
+    auto mix = [&](uint64_t V) {
+      S.Hash = (S.Hash ^ V) * 0x100000001b3;
+    };
+    for (llvm::BasicBlock &BB : F) {
+      mix(~0ull);
+      for (llvm::Instruction &I : BB) {
+        if (llvm::isa<llvm::DbgInfoIntrinsic>(I))
+          continue;
+        mix(I.getOpcode());
+        mix(I.getNumOperands());
+        if (auto *Cmp = llvm::dyn_cast<llvm::CmpInst>(&I))
+          mix(Cmp->getPredicate());
+        for (llvm::Value *Op : I.operands()) {
+          if (auto *C = llvm::dyn_cast<llvm::ConstantFP>(Op))
+            mix(C->getValueAPF().bitcastToAPInt().getZExtValue());
+          else if (auto *Callee = llvm::dyn_cast<llvm::Function>(Op))
+            for (char Ch : Callee->getName())
+              mix((unsigned char)Ch);
+        }
+        if (auto *Br = llvm::dyn_cast<llvm::BranchInst>(&I))
+          if (Br->isConditional())
+            S.Branches.push_back(Br);
+        if (auto *Call = llvm::dyn_cast<llvm::CallBase>(&I))
+          if (!llvm::isa<llvm::IntrinsicInst>(Call))
+            S.Calls.push_back(Call);
+      }
+    }
+    return S;
+  }
+
+  /// getProfile - The profile of the function Name with the sites S, made
+  /// afresh if there is none or if it counted different code.
+  FunctionProfile &getProfile(llvm::StringRef Name, const Sites &S) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    FunctionProfile *&P = Functions[Name];
+    if (P && P->Hash == S.Hash && P->NumBranches == S.Branches.size() &&
+        P->NumCalls == S.Calls.size())
+      return *P;
+    Profiles.push_back(std::make_unique<FunctionProfile>());
+    P = Profiles.back().get();
+    P->Hash = S.Hash;
+    P->NumBranches = S.Branches.size();
+    P->NumCalls = S.Calls.size();
+    P->Counts.reset(new uint64_t[P->getNumCounts()]());
+    return *P;
+  }
+
+  /// findProfile - The profile of F, called Name, if there is one for its
+  /// code and it ever ran.
+  const FunctionProfile *findProfile(llvm::StringRef Name, const Sites &S) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto It = Functions.find(Name);
+    if (It == Functions.end())
+      return nullptr;
+    const FunctionProfile *P = It->second;
+    if (P->Hash != S.Hash || P->NumBranches != S.Branches.size() ||
+        P->NumCalls != S.Calls.size() || !P->Counts[0])
+      return nullptr;
+    return P;
+  }
+
+  static void emitIncrement(llvm::IRBuilder<> &B, llvm::Value *Ptr) {
+    llvm::Type *I64 = B.getInt64Ty();
+    B.CreateStore(B.CreateAdd(B.CreateLoad(I64, Ptr), B.getInt64(1)), Ptr);
+  }
+
+  static llvm::Value *getCounter(llvm::IRBuilder<> &B, uint64_t *Counter) {
+    return llvm::ConstantExpr::getIntToPtr(B.getInt64((uintptr_t)Counter),
+                                           B.getInt64Ty()->getPointerTo());
+  }
+
+  /// getWeight - Count as a branch weight, which has 32 bits, after
+  /// dividing by Scale.
+  static uint32_t getWeight(uint64_t Count, uint64_t Scale) {
+    return (uint32_t)std::min<uint64_t>(Count / Scale, UINT32_MAX);
+  }
+
+public:
+  /// instrument - Make F, the definition of Name, count into its profile.
+  /// Counts already taken from the same code, as in a file read, go on
+  /// being added to.  The counters' addresses are built into the code.
+  void instrument(llvm::Function &F, llvm::StringRef Name) {
+    Sites S = getSites(F);
+    FunctionProfile &P = getProfile(Name, S);
+    llvm::IRBuilder<> B(F.getContext());
+    uint64_t *Counts = P.Counts.get();
+
+    for (unsigned I = 0, E = S.Branches.size(); I != E; ++I) {
+      llvm::BranchInst *Br = S.Branches[I];
+      B.SetInsertPoint(Br);
+      emitIncrement(B, B.CreateSelect(Br->getCondition(),
+                                      getCounter(B, &Counts[1 + 2 * I]),
+                                      getCounter(B, &Counts[2 + 2 * I])));
+    }
+    for (unsigned I = 0, E = S.Calls.size(); I != E; ++I) {
+      B.SetInsertPoint(S.Calls[I]);
+      emitIncrement(B, getCounter(B, &Counts[1 + 2 * S.Branches.size() + I]));
+    }
+
+    // Count entries after the allocas, which must stay in the entry block.
+    llvm::BasicBlock::iterator I = F.getEntryBlock().begin();
+    while (llvm::isa<llvm::AllocaInst>(I))
+      ++I;
+    B.SetInsertPoint(&*I);
+    emitIncrement(B, getCounter(B, &Counts[0]));
+  }
+
+  /// annotate - Give F, the definition of Name, not yet instrumented, the
+  /// entry count and branch weights in its profile, and the count of each
+  /// call on the call, as sample profiles have it.  Returns false, leaving
+  /// F alone, if there are no counts for its code.
+  bool annotate(llvm::Function &F, llvm::StringRef Name) {
+    Sites S = getSites(F);
+    const FunctionProfile *P = findProfile(Name, S);
+    if (!P)
+      return false;
+    const uint64_t *Counts = P->Counts.get();
+    F.setEntryCount(Counts[0]);
+
+    // Weights keep their ratios when scaled down to fit.
+    uint64_t Max = *std::max_element(Counts, Counts + P->getNumCounts());
+    uint64_t Scale = Max / UINT32_MAX + 1;
+    llvm::MDBuilder MDB(F.getContext());
+    for (unsigned I = 0, E = S.Branches.size(); I != E; ++I) {
+      uint64_t Taken = Counts[1 + 2 * I], NotTaken = Counts[2 + 2 * I];
+      if (Taken || NotTaken)
+        S.Branches[I]->setMetadata(
+            llvm::LLVMContext::MD_prof,
+            MDB.createBranchWeights(getWeight(Taken, Scale),
+                                    getWeight(NotTaken, Scale)));
+    }
+    for (unsigned I = 0, E = S.Calls.size(); I != E; ++I)
+      S.Calls[I]->setMetadata(
+          llvm::LLVMContext::MD_prof,
+          MDB.createBranchWeights(
+              {getWeight(Counts[1 + 2 * S.Branches.size() + I], Scale)}));
+    return true;
+  }
+
+  /// setSummary - Give M a summary of every count so far, against which
+  /// the optimizer decides what is hot and what is cold.
+  void setSummary(llvm::Module &M) {
+    llvm::InstrProfSummaryBuilder Builder(
+        llvm::ProfileSummaryBuilder::DefaultCutoffs);
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      for (const auto &E : Functions) {
+        const FunctionProfile &P = *E.getValue();
+        Builder.addRecord(llvm::InstrProfRecord(std::vector<uint64_t>(
+            P.Counts.get(), P.Counts.get() + P.getNumCounts())));
+      }
+    }
+    M.setProfileSummary(Builder.getSummary()->getMD(M.getContext()),
+                        llvm::ProfileSummary::PSK_Instr);
+  }
+
+  /// read - Read the profiles in the file Path, as written by write,
+  /// replacing any of the same names.
+  llvm::Error read(llvm::StringRef Path) {
+    auto Buf = llvm::MemoryBuffer::getFile(Path);
+    if (!Buf)
+      return llvm::createStringError(Buf.getError(), "cannot read '" + Path +
+                                                         "': " +
+                                                         Buf.getError()
+                                                             .message());
+    auto malformed = [&](size_t Line) {
+      return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                     Path + ":" + llvm::Twine(Line) +
+                                         ": malformed profile");
+    };
+    llvm::SmallVector<llvm::StringRef, 0> Lines;
+    (*Buf)->getBuffer().split(Lines, '\n', -1, false);
+    for (size_t L = 0; L != Lines.size(); ++L) {
+      if (Lines[L].startswith("#"))
+        continue;
+      // name hash branches calls, then a line of counts.
+      llvm::SmallVector<llvm::StringRef, 4> Head;
+      Lines[L].split(Head, ' ', -1, false);
+      Sites S;
+      unsigned NumBranches, NumCalls;
+      if (Head.size() != 4 || Head[1].getAsInteger(16, S.Hash) ||
+          Head[2].getAsInteger(10, NumBranches) ||
+          Head[3].getAsInteger(10, NumCalls) || L + 1 == Lines.size())
+        return malformed(L + 1);
+      S.Branches.resize(NumBranches);
+      S.Calls.resize(NumCalls);
+      FunctionProfile &P = getProfile(Head[0], S);
+
+      llvm::SmallVector<llvm::StringRef, 0> Counts;
+      Lines[++L].split(Counts, ' ', -1, false);
+      if (Counts.size() != P.getNumCounts())
+        return malformed(L + 1);
+      for (unsigned I = 0, E = Counts.size(); I != E; ++I)
+        if (Counts[I].getAsInteger(10, P.Counts[I]))
+          return malformed(L + 1);
+    }
+    return llvm::Error::success();
+  }
+
+  /// write - Write the profile of every function that ran to the file Path.
+  llvm::Error write(llvm::StringRef Path) {
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_Text);
+    if (EC)
+      return llvm::createStringError(EC, "cannot open '" + Path +
+                                             "': " + EC.message());
+    OS << "# div profile: name, hash, branches and calls, then the entry "
+          "count,\n# each branch's taken and not-taken counts and each "
+          "call's count\n";
+    std::lock_guard<std::mutex> Guard(Lock);
+    for (const auto &E : Functions) {
+      const FunctionProfile &P = *E.getValue();
+      if (!P.Counts[0])
+        continue;
+      OS << E.getKey() << ' ' << llvm::format_hex_no_prefix(P.Hash, 16) << ' '
+         << P.NumBranches << ' ' << P.NumCalls << '\n';
+      for (unsigned I = 0, N = P.getNumCounts(); I != N; ++I)
+        OS << (I ? " " : "") << P.Counts[I];
+      OS << '\n';
+    }
+    return llvm::Error::success();
+  }
+};
+
+#endif // DIV_PGO_HH
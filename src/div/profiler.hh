@@ -0,0 +1,307 @@
+//===- profiler.hh - Sampling profiler for JIT'd code -----------*- C++ -*-===//
+//
+// A profiler for where perf cannot be had, as in most containers.  An
+// ITIMER_PROF timer sends SIGPROF every so much CPU time, and the signal
+// handler records the program counter of whichever thread it interrupts.
+// On the thread that started the profiler it walks the frame pointers too,
+// which JIT'd code keeps when asked to, for the return address of each
+// frame; the walk stops at the first frame pointer outside the stack, since
+// code built without frame pointers leaves anything in it.
+//
+// The handler only copies addresses into a buffer set aside in advance.
+// They are looked up once the profiler stops: in the JIT's symbol table, for
+// JIT'd code and its source lines, and otherwise with dladdr.  The results
+// are a flat profile, by function and by source line, and a folded-stack
+// file, one line per distinct stack, for flamegraph.pl or speedscope.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_PROFILER_HH
+#define DIV_PROFILER_HH
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Demangle/Demangle.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "perfjit.hh"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#define DIV_PROFILER 1
+#include <dlfcn.h>
+#include <link.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#endif
+
+/// SamplingProfiler - Samples every thread's program counter, and the main
+/// thread's stack, on a CPU-time timer.  One can run at a time.
+class SamplingProfiler {
+  static constexpr unsigned MaxDepth = 128;
+
+  /// Buffer - Each sample, as its depth and then its addresses, innermost
+  /// first.  Used may run past Capacity once it is full, and the first
+  /// sample that did not fit leaves EndOfSamples where it would have gone.
+  std::unique_ptr<uint64_t[]> Buffer;
+  size_t Capacity;
+  std::atomic<size_t> Used{0};
+  std::atomic<uint64_t> Dropped{0};
+  static constexpr uint64_t EndOfSamples = ~uint64_t(0);
+  unsigned IntervalUs = 0;
+  JITSymbolTable &Symbols;
+
+  static std::atomic<SamplingProfiler *> &getActive() {
+    static std::atomic<SamplingProfiler *> Active{nullptr};
+    return Active;
+  }
+
+  /// StackTop - The top of the stack the profiler walks, that of the thread
+  /// it was started on; 0 on every other thread.
+  static uintptr_t &getStackTop() {
+    static thread_local uintptr_t StackTop = 0;
+    return StackTop;
+  }
+
+public:
+  /// SamplingProfiler - Ready to take samples until BufferWords addresses
+  /// and depths have been recorded, looking JIT'd code up in Symbols.
+  SamplingProfiler(JITSymbolTable &Symbols, size_t BufferWords = 8 << 20)
+      : Buffer(new uint64_t[BufferWords]), Capacity(BufferWords),
+        Symbols(Symbols) {}
+  ~SamplingProfiler() { stop(); }
+
+  SamplingProfiler(const SamplingProfiler &) = delete;
+  SamplingProfiler &operator=(const SamplingProfiler &) = delete;
+
+  /// start - Take a sample every IntervalUs microseconds of CPU time.  Stacks
+  /// are walked on this thread up to the frame of the caller.
+  llvm::Error start(unsigned Interval) {
+#ifdef DIV_PROFILER
+    SamplingProfiler *None = nullptr;
+    if (!getActive().compare_exchange_strong(None, this))
+      return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                     "a profiler is already running");
+    IntervalUs = std::max(Interval, 1u);
+    getStackTop() = (uintptr_t)__builtin_frame_address(0);
+
+    struct sigaction Action;
+    memset(&Action, 0, sizeof(Action));
+    Action.sa_sigaction = handleSignal;
+    Action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&Action.sa_mask);
+    itimerval Timer;
+    Timer.it_interval.tv_sec = IntervalUs / 1000000;
+    Timer.it_interval.tv_usec = IntervalUs % 1000000;
+    Timer.it_value = Timer.it_interval;
+    if (sigaction(SIGPROF, &Action, nullptr) ||
+        setitimer(ITIMER_PROF, &Timer, nullptr)) {
+      getActive() = nullptr;
+      return llvm::createStringError(
+          std::error_code(errno, std::generic_category()),
+          "cannot start the profiling timer");
+    }
+    return llvm::Error::success();
+#else
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "the profiler is only for Linux on "
+                                   "x86-64 and AArch64");
+#endif
+  }
+
+  /// stop - Stop taking samples.  Signals already on their way are ignored.
+  void stop() {
+#ifdef DIV_PROFILER
+    if (getActive() != this)
+      return;
+    itimerval Timer;
+    memset(&Timer, 0, sizeof(Timer));
+    setitimer(ITIMER_PROF, &Timer, nullptr);
+    getActive() = nullptr;
+#endif
+  }
+
+  /// report - Print a flat profile of the Top functions and lines to OS, and
+  /// write every distinct stack, outermost frame first, with its count, to
+  /// Folded.
+  void report(FILE *OS, llvm::raw_ostream *Folded, size_t Top = 20) {
+    stop();
+    llvm::DenseMap<uint64_t, unsigned> FrameIndex;
+    std::vector<Frame> Frames;
+    auto getFrame = [&](uint64_t Addr) -> unsigned {
+      auto Ins = FrameIndex.insert({Addr, Frames.size()});
+      if (Ins.second)
+        Frames.push_back(lookup(Addr));
+      return Ins.first->second;
+    };
+
+    llvm::StringMap<std::pair<uint64_t, uint64_t>> ByFunction; // Self, total.
+    std::map<std::pair<std::string, unsigned>, uint64_t> ByLine;
+    std::map<std::string, uint64_t> Stacks;
+    size_t End = std::min<size_t>(Used, Capacity);
+    uint64_t NumSamples = 0;
+    llvm::SmallVector<unsigned, 32> Stack;
+    for (size_t I = 0; I < End && Buffer[I] != EndOfSamples;
+         I += Buffer[I] + 1) {
+      ++NumSamples;
+      Stack.clear();
+      // A return address is just after the call, which may be on another
+      // line, or even in another function, if the call was the last thing
+      // in one.
+      for (uint64_t J = 0, N = Buffer[I]; J != N; ++J)
+        Stack.push_back(getFrame(Buffer[I + 1 + J] - (J != 0)));
+
+      const Frame &Leaf = Frames[Stack.front()];
+      ++ByFunction[Leaf.Function].first;
+      if (Leaf.Line)
+        ++ByLine[{Leaf.Function + " " + Leaf.File, Leaf.Line}];
+      llvm::StringMap<bool> Seen;
+      for (unsigned F : Stack)
+        if (Seen.insert({Frames[F].Function, true}).second)
+          ++ByFunction[Frames[F].Function].second;
+
+      std::string Path;
+      for (unsigned F : llvm::reverse(Stack))
+        Path += (Path.empty() ? "" : ";") + Frames[F].Function;
+      ++Stacks[Path];
+    }
+
+    fprintf(OS,
+            "profile: %llu samples, one per %.3f ms of CPU time, %llu "
+            "dropped\n",
+            (unsigned long long)NumSamples, IntervalUs / 1000.0,
+            (unsigned long long)Dropped);
+    if (!NumSamples)
+      return;
+
+    std::vector<std::pair<std::string, std::pair<uint64_t, uint64_t>>> Fns;
+    for (const auto &E : ByFunction)
+      Fns.push_back({E.getKey().str(), E.getValue()});
+    std::stable_sort(Fns.begin(), Fns.end(), [](const auto &A, const auto &B) {
+      return A.second.first > B.second.first ||
+             (A.second.first == B.second.first &&
+              A.second.second > B.second.second);
+    });
+    fprintf(OS, "  %7s %7s %8s %8s  %s\n", "self", "total", "self", "total",
+            "function");
+    for (size_t I = 0; I != Fns.size() && I != Top; ++I)
+      fprintf(OS, "  %6.2f%% %6.2f%% %8llu %8llu  %s\n",
+              100.0 * Fns[I].second.first / NumSamples,
+              100.0 * Fns[I].second.second / NumSamples,
+              (unsigned long long)Fns[I].second.first,
+              (unsigned long long)Fns[I].second.second, Fns[I].first.c_str());
+
+    std::vector<std::pair<uint64_t, std::pair<std::string, unsigned>>> Lines;
+    for (const auto &E : ByLine)
+      Lines.push_back({E.second, E.first});
+    std::stable_sort(Lines.begin(), Lines.end(),
+                     [](const auto &A, const auto &B) {
+                       return A.first > B.first;
+                     });
+    if (!Lines.empty())
+      fprintf(OS, "  %7s %8s  %s\n", "self", "self", "function file:line");
+    for (size_t I = 0; I != Lines.size() && I != Top; ++I)
+      fprintf(OS, "  %6.2f%% %8llu  %s:%u\n",
+              100.0 * Lines[I].first / NumSamples,
+              (unsigned long long)Lines[I].first,
+              Lines[I].second.first.c_str(), Lines[I].second.second);
+
+    if (Folded)
+      for (const auto &E : Stacks)
+        *Folded << E.first << ' ' << E.second << '\n';
+  }
+
+private:
+  /// Frame - What an address was found to be.
+  struct Frame {
+    std::string Function;
+    std::string File;
+    unsigned Line = 0;
+  };
+
+  Frame lookup(uint64_t Addr) {
+    Frame F;
+    if (Symbols.lookup(Addr, F.Function, F.Line, F.File)) {
+      F.File = llvm::sys::path::filename(F.File).str();
+      return F;
+    }
+#ifdef DIV_PROFILER
+    // Static functions have no dynamic symbol, and dladdr gives the nearest
+    // one before them instead, so the symbol's size is checked.
+    Dl_info Info;
+    const ElfW(Sym) *Sym = nullptr;
+    if (dladdr1((void *)(uintptr_t)Addr, &Info, (void **)&Sym,
+                RTLD_DL_SYMENT)) {
+      if (Info.dli_sname && Sym &&
+          Addr < (uintptr_t)Info.dli_saddr + Sym->st_size) {
+        F.Function = llvm::demangle(Info.dli_sname);
+        return F;
+      }
+      if (Info.dli_fname) {
+        F.Function = ("[" + llvm::sys::path::filename(Info.dli_fname) + "]")
+                         .str();
+        return F;
+      }
+    }
+#endif
+    F.Function = "[unknown]";
+    return F;
+  }
+
+#ifdef DIV_PROFILER
+  static void handleSignal(int, siginfo_t *, void *Context) {
+    SamplingProfiler *P = getActive();
+    if (!P)
+      return;
+    int SavedErrno = errno;
+    const mcontext_t &MC = ((ucontext_t *)Context)->uc_mcontext;
+#if defined(__x86_64__)
+    uintptr_t PC = MC.gregs[REG_RIP], FP = MC.gregs[REG_RBP],
+              SP = MC.gregs[REG_RSP];
+#else
+    uintptr_t PC = MC.pc, FP = MC.regs[29], SP = MC.sp;
+#endif
+    uint64_t Stack[MaxDepth];
+    unsigned N = 0;
+    Stack[N++] = PC;
+    // Each frame holds the caller's frame pointer and then the return
+    // address.  Frames get older, and so higher, all the way up the stack.
+    uintptr_t Top = getStackTop();
+    while (N != MaxDepth && FP >= SP && FP % sizeof(uintptr_t) == 0 &&
+           FP + 2 * sizeof(uintptr_t) <= Top) {
+      uintptr_t Next = ((uintptr_t *)FP)[0], Ret = ((uintptr_t *)FP)[1];
+      if (!Ret)
+        break;
+      Stack[N++] = Ret;
+      if (Next <= FP)
+        break;
+      FP = Next;
+    }
+
+    size_t At = P->Used.fetch_add(N + 1);
+    if (At + N + 1 > P->Capacity) {
+      if (At < P->Capacity)
+        P->Buffer[At] = EndOfSamples;
+      ++P->Dropped;
+    } else {
+      P->Buffer[At] = N;
+      memcpy(&P->Buffer[At + 1], Stack, N * sizeof(uint64_t));
+    }
+    errno = SavedErrno;
+  }
+#endif
+};
+
+#endif // DIV_PROFILER_HH
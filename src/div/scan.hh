@@ -0,0 +1,194 @@
+//===- scan.hh - Vectorized character scanning for the lexer ----*- C++ -*-===//
+//
+// The lexer spends most of its time finding where a run of whitespace, an
+// identifier, a number or a comment ends.  The scanners here classify 16 bytes
+// at a time with SSE2 (32 with AVX2 when the compiler targets it) and fall back
+// to a locale-independent table lookup for the tail of the buffer.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_SCAN_HH
+#define DIV_SCAN_HH
+
+#include "llvm/Support/MathExtras.h"
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define DIV_SCAN_VECTOR 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define DIV_SCAN_VECTOR 1
+#endif
+
+/// CharClass - Bits of the character classification table.
+enum CharClass : uint8_t {
+  CC_Space = 1 << 0, // ' ', \t, \n, \v, \f, \r
+  CC_Alpha = 1 << 1, // [a-zA-Z]
+  CC_Digit = 1 << 2, // [0-9]
+  CC_Dot = 1 << 3,   // '.'
+  CC_EOL = 1 << 4,   // \n, \r
+};
+
+struct CharClassTable {
+  uint8_t Bits[256];
+
+  constexpr CharClassTable() : Bits() {
+    for (int C = 0; C != 256; ++C) {
+      uint8_t B = 0;
+      if (C == ' ' || (C >= '\t' && C <= '\r'))
+        B |= CC_Space;
+      if ((C >= 'a' && C <= 'z') || (C >= 'A' && C <= 'Z'))
+        B |= CC_Alpha;
+      if (C >= '0' && C <= '9')
+        B |= CC_Digit;
+      if (C == '.')
+        B |= CC_Dot;
+      if (C == '\n' || C == '\r')
+        B |= CC_EOL;
+      Bits[C] = B;
+    }
+  }
+};
+
+static constexpr CharClassTable CharClasses;
+
+static inline bool isCharClass(int C, uint8_t Class) {
+  return C >= 0 && (CharClasses.Bits[C & 0xff] & Class);
+}
+
+/// UseVectorScan - Cleared to force the scalar scanners, for comparing the two.
+static bool UseVectorScan = true;
+
+#if defined(__AVX2__)
+typedef __m256i ScanVec;
+enum { ScanWidth = 32 };
+static inline ScanVec scanLoad(const char *P) {
+  return _mm256_loadu_si256((const __m256i *)P);
+}
+static inline ScanVec scanSplat(char C) { return _mm256_set1_epi8(C); }
+static inline ScanVec scanEq(ScanVec A, ScanVec B) {
+  return _mm256_cmpeq_epi8(A, B);
+}
+static inline ScanVec scanOr(ScanVec A, ScanVec B) {
+  return _mm256_or_si256(A, B);
+}
+static inline ScanVec scanSub(ScanVec A, ScanVec B) {
+  return _mm256_sub_epi8(A, B);
+}
+static inline ScanVec scanMinU(ScanVec A, ScanVec B) {
+  return _mm256_min_epu8(A, B);
+}
+static inline uint32_t scanMask(ScanVec A) {
+  return (uint32_t)_mm256_movemask_epi8(A);
+}
+#elif defined(__SSE2__)
+typedef __m128i ScanVec;
+enum { ScanWidth = 16 };
+static inline ScanVec scanLoad(const char *P) {
+  return _mm_loadu_si128((const __m128i *)P);
+}
+static inline ScanVec scanSplat(char C) { return _mm_set1_epi8(C); }
+static inline ScanVec scanEq(ScanVec A, ScanVec B) {
+  return _mm_cmpeq_epi8(A, B);
+}
+static inline ScanVec scanOr(ScanVec A, ScanVec B) {
+  return _mm_or_si128(A, B);
+}
+static inline ScanVec scanSub(ScanVec A, ScanVec B) {
+  return _mm_sub_epi8(A, B);
+}
+static inline ScanVec scanMinU(ScanVec A, ScanVec B) {
+  return _mm_min_epu8(A, B);
+}
+static inline uint32_t scanMask(ScanVec A) {
+  return (uint32_t)_mm_movemask_epi8(A);
+}
+#endif
+
+#ifdef DIV_SCAN_VECTOR
+/// scanInRange - Lanes of X holding a byte in [Lo, Lo+Len], as an unsigned
+/// compare: X - Lo <= Len  <=>  min(X - Lo, Len) == X - Lo.
+static inline ScanVec scanInRange(ScanVec X, char Lo, char Len) {
+  ScanVec D = scanSub(X, scanSplat(Lo));
+  return scanEq(scanMinU(D, scanSplat(Len)), D);
+}
+
+static inline uint32_t scanSpaceMask(ScanVec X) {
+  return scanMask(
+      scanOr(scanEq(X, scanSplat(' ')), scanInRange(X, '\t', '\r' - '\t')));
+}
+
+static inline uint32_t scanIdentMask(ScanVec X) {
+  ScanVec Lower = scanOr(X, scanSplat(0x20));
+  return scanMask(
+      scanOr(scanInRange(Lower, 'a', 'z' - 'a'), scanInRange(X, '0', 9)));
+}
+
+static inline uint32_t scanNumberMask(ScanVec X) {
+  return scanIdentMask(X) | scanMask(scanEq(X, scanSplat('.')));
+}
+
+static inline uint32_t scanCommentMask(ScanVec X) {
+  return ~scanMask(
+      scanOr(scanEq(X, scanSplat('\n')), scanEq(X, scanSplat('\r'))));
+}
+
+/// scanVector - Return the first character in [P, E) that MaskFn does not
+/// select, or the start of the final partial vector if every full vector
+/// matched.
+template <uint32_t (*MaskFn)(ScanVec)>
+static inline const char *scanVector(const char *P, const char *E) {
+  const uint32_t Full = ScanWidth == 32 ? ~0u : (1u << ScanWidth) - 1;
+  for (; E - P >= ScanWidth; P += ScanWidth) {
+    uint32_t Stop = ~MaskFn(scanLoad(P)) & Full;
+    if (Stop)
+      return P + llvm::countTrailingZeros(Stop);
+  }
+  return P;
+}
+#endif
+
+/// scanTail - Scalar scan: return the first character in [P, E) whose class
+/// does not intersect Class (or, with Invert, does), or E.
+static inline const char *scanTail(const char *P, const char *E,
+                                   uint8_t Class, bool Invert = false) {
+  while (P != E && isCharClass((unsigned char)*P, Class) != Invert)
+    ++P;
+  return P;
+}
+
+#ifdef DIV_SCAN_VECTOR
+#define DIV_SCAN(MaskFn, P, E)                                                 \
+  if (UseVectorScan)                                                           \
+    P = scanVector<MaskFn>(P, E);
+#else
+#define DIV_SCAN(MaskFn, P, E)
+#endif
+
+/// scanSpace - Skip whitespace.
+static inline const char *scanSpace(const char *P, const char *E) {
+  DIV_SCAN(scanSpaceMask, P, E)
+  return scanTail(P, E, CC_Space);
+}
+
+/// scanIdentifier - Skip the tail of an identifier: [a-zA-Z0-9]*.
+static inline const char *scanIdentifier(const char *P, const char *E) {
+  DIV_SCAN(scanIdentMask, P, E)
+  return scanTail(P, E, CC_Alpha | CC_Digit);
+}
+
+/// scanNumber - Skip the rest of a numeric literal's spelling: [0-9a-zA-Z.]*.
+/// Whether that spelling is a well-formed number is up to parseNumber.
+static inline const char *scanNumber(const char *P, const char *E) {
+  DIV_SCAN(scanNumberMask, P, E)
+  return scanTail(P, E, CC_Alpha | CC_Digit | CC_Dot);
+}
+
+/// scanComment - Skip to the end of the current line.
+static inline const char *scanComment(const char *P, const char *E) {
+  DIV_SCAN(scanCommentMask, P, E)
+  return scanTail(P, E, CC_EOL, /*Invert=*/true);
+}
+
+#endif // DIV_SCAN_HH
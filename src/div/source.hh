@@ -0,0 +1,146 @@
+//===- source.hh - Source buffers for the Div lexer -------------*- C++ -*-===//
+//
+// Holds the text the lexer reads from.  Input files are mapped into memory in
+// one piece; standard input is read in large chunks as the lexer runs dry, so
+// an interactive session still sees each line as soon as it is typed.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_SOURCE_HH
+#define DIV_SOURCE_HH
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// SourceBuffer - A contiguous view of the program text.  The text is always
+/// followed by a '\0' so scanning loops can stop on it without a bounds check.
+/// Tokens are handed out as offsets or StringRef slices into the buffer; a
+/// call to fill() may move the text, so slices must not be held across it.
+class SourceBuffer {
+  std::string Name;
+
+  /// File - The mapped input file, when reading from one.
+  std::unique_ptr<llvm::MemoryBuffer> File;
+
+  /// Data - Everything read so far from a stream, plus the trailing '\0'.
+  std::vector<char> Data;
+
+  const char *Start = "";
+  size_t Size = 0;
+
+  /// Stream - The handle still being read, or kInvalidFile once the input is
+  /// exhausted (or was never a stream).
+  llvm::sys::fs::file_t Stream = llvm::sys::fs::kInvalidFile;
+
+  /// LineStarts - Offsets of the first character of each line, built lazily up
+  /// to ScannedTo the first time a location is asked for.
+  std::vector<size_t> LineStarts = {0};
+  size_t ScannedTo = 0;
+
+  SourceBuffer(llvm::StringRef Name) : Name(Name) {}
+
+public:
+  enum { ChunkSize = 1 << 16 };
+
+  static llvm::Expected<std::unique_ptr<SourceBuffer>>
+  getFile(llvm::StringRef Path) {
+    auto MB = llvm::errorOrToExpected(llvm::MemoryBuffer::getFile(
+        Path, /*IsText=*/false, /*RequiresNullTerminator=*/true));
+    if (!MB)
+      return MB.takeError();
+    std::unique_ptr<SourceBuffer> SB(new SourceBuffer(Path));
+    SB->File = std::move(*MB);
+    SB->Start = SB->File->getBufferStart();
+    SB->Size = SB->File->getBufferSize();
+    return std::move(SB);
+  }
+
+  /// getMemBuffer - A buffer holding a copy of Text, e.g. a generated program.
+  static std::unique_ptr<SourceBuffer> getMemBuffer(llvm::StringRef Text,
+                                                    llvm::StringRef Name) {
+    std::unique_ptr<SourceBuffer> SB(new SourceBuffer(Name));
+    SB->File = llvm::MemoryBuffer::getMemBufferCopy(Text, Name);
+    SB->Start = SB->File->getBufferStart();
+    SB->Size = SB->File->getBufferSize();
+    return SB;
+  }
+
+  static std::unique_ptr<SourceBuffer> getSTDIN() {
+    std::unique_ptr<SourceBuffer> SB(new SourceBuffer("<stdin>"));
+    SB->Stream = llvm::sys::fs::getStdinHandle();
+    SB->Data.push_back('\0');
+    SB->Start = SB->Data.data();
+    return SB;
+  }
+
+  llvm::StringRef getName() const { return Name; }
+  const char *begin() const { return Start; }
+  const char *end() const { return Start + Size; }
+  size_t size() const { return Size; }
+
+  llvm::StringRef slice(size_t B, size_t E) const {
+    return llvm::StringRef(Start + B, E - B);
+  }
+
+  /// fill - Append the next chunk of input to the buffer.  Returns false once
+  /// there is nothing more to read, or the input cannot be read, which is
+  /// reported on stderr.  A read cut short by a signal is retried.
+  /// Invalidates pointers into the buffer.
+  bool fill() {
+    if (Stream == llvm::sys::fs::kInvalidFile)
+      return false;
+
+    Data.resize(Size + ChunkSize + 1);
+    size_t N = 0;
+    for (;;) {
+      auto Read = llvm::sys::fs::readNativeFile(
+          Stream, llvm::makeMutableArrayRef(Data.data() + Size, ChunkSize));
+      if (Read) {
+        N = *Read;
+        break;
+      }
+      std::error_code EC = llvm::errorToErrorCode(Read.takeError());
+      if (EC == std::errc::interrupted)
+        continue;
+      fprintf(stderr, "Error: cannot read %s: %s\n", Name.c_str(),
+              EC.message().c_str());
+      break;
+    }
+
+    Size += N;
+    Data.resize(Size + 1);
+    Data[Size] = '\0';
+    Start = Data.data();
+
+    if (N == 0)
+      Stream = llvm::sys::fs::kInvalidFile;
+    return N != 0;
+  }
+
+  /// getLineAndColumn - Map an offset to a 1-based line and column.
+  std::pair<unsigned, unsigned> getLineAndColumn(size_t Offset) {
+    if (Offset >= ScannedTo) {
+      const char *P = Start + ScannedTo, *E = Start + Size;
+      while (const char *NL =
+                 static_cast<const char *>(memchr(P, '\n', E - P))) {
+        LineStarts.push_back(NL + 1 - Start);
+        P = NL + 1;
+      }
+      ScannedTo = Size;
+    }
+    auto It = std::upper_bound(LineStarts.begin(), LineStarts.end(), Offset);
+    unsigned Line = It - LineStarts.begin();
+    return {Line, unsigned(Offset - *(It - 1) + 1)};
+  }
+};
+
+#endif // DIV_SOURCE_HH
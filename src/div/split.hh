@@ -0,0 +1,101 @@
+//===- split.hh - Splitting source text at top-level items ------*- C++ -*-===//
+//
+// Finds the places where a file can be cut into pieces that parse on their
+// own, and the binary operator definitions that change how the pieces after
+// them parse.  Neither needs a full lex: 'def' and 'extern' only ever start a
+// top-level item, so any occurrence of either as a token of its own, outside a
+// comment, is a place to cut.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_SPLIT_HH
+#define DIV_SPLIT_HH
+
+#include "number.hh"
+#include "scan.hh"
+#include "llvm/ADT/StringRef.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <vector>
+
+/// OperatorDefinition - A 'def binary' found by findOperatorDefinitions.
+struct OperatorDefinition {
+  size_t At; // Offset of the 'def'.
+  char Op;
+  unsigned Precedence;
+};
+
+/// isKeywordAt - Whether Word occurs at offset At of Text as a token of its
+/// own, and not inside a comment.
+static inline bool isKeywordAt(llvm::StringRef Text, size_t At,
+                               llvm::StringRef Word) {
+  if (!Text.substr(At).startswith(Word))
+    return false;
+  // A letter, digit or '.' on either side makes it part of a longer
+  // identifier or number.
+  const uint8_t TokenChars = CC_Alpha | CC_Digit | CC_Dot;
+  if (At && isCharClass((unsigned char)Text[At - 1], TokenChars))
+    return false;
+  size_t End = At + Word.size();
+  if (End < Text.size() &&
+      isCharClass((unsigned char)Text[End], CC_Alpha | CC_Digit))
+    return false;
+
+  size_t LineStart = Text.find_last_of("\n\r", At);
+  LineStart = LineStart == llvm::StringRef::npos ? 0 : LineStart + 1;
+  return !memchr(Text.data() + LineStart, '#', At - LineStart);
+}
+
+/// findItemStart - The offset of the first 'def' or 'extern' that starts an
+/// item at or after From, or Text.size() if there is none.
+static inline size_t findItemStart(llvm::StringRef Text, size_t From) {
+  while (From < Text.size()) {
+    size_t Def = Text.find("def", From), Extern = Text.find("extern", From);
+    size_t At = std::min(Def, Extern);
+    if (At == llvm::StringRef::npos)
+      break;
+    if (isKeywordAt(Text, At, At == Def ? "def" : "extern"))
+      return At;
+    From = At + 1;
+  }
+  return Text.size();
+}
+
+/// findOperatorDefinitions - Every 'def binary' in Text, in source order.
+/// Definitions the parser would reject are left out.
+static inline std::vector<OperatorDefinition>
+findOperatorDefinitions(llvm::StringRef Text) {
+  std::vector<OperatorDefinition> Defs;
+  const char *E = Text.end();
+  for (size_t At = Text.find("binary"); At != llvm::StringRef::npos;
+       At = Text.find("binary", At + 1)) {
+    if (!isKeywordAt(Text, At, "binary"))
+      continue;
+    size_t Def = Text.substr(0, At).rtrim().size();
+    if (Def < 3 || !isKeywordAt(Text, Def - 3, "def"))
+      continue;
+
+    // The operator is the next character the lexer would return as itself.
+    const char *P = scanSpace(Text.data() + At + 6, E);
+    if (P == E || !isascii(*P) || *P == '#' ||
+        isCharClass((unsigned char)*P, CC_Alpha | CC_Digit | CC_Dot))
+      continue;
+    char Op = *P;
+
+    unsigned Precedence = 30;
+    P = scanSpace(P + 1, E);
+    if (P != E && isCharClass((unsigned char)*P, CC_Digit | CC_Dot)) {
+      const char *NumEnd = scanNumber(P, E);
+      double Val;
+      if (!parseNumber(llvm::StringRef(P, NumEnd - P), Val) || Val < 1 ||
+          Val > 100)
+        continue;
+      Precedence = (unsigned)Val;
+    }
+    Defs.push_back({Def - 3, Op, Precedence});
+  }
+  return Defs;
+}
+
+#endif // DIV_SPLIT_HH
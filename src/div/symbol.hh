@@ -0,0 +1,80 @@
+//===- symbol.hh - Interned identifiers -------------------------*- C++ -*-===//
+//
+// Every identifier the lexer sees is interned once and referred to by a small
+// integer from then on, so the parser, AST and code generator can key their
+// tables on integers instead of hashing and comparing strings again.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_SYMBOL_HH
+#define DIV_SYMBOL_HH
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include <mutex>
+#include <vector>
+
+typedef unsigned SymbolID;
+
+/// SymbolTable - Maps identifier spellings to dense SymbolIDs and back.  The
+/// spellings are copied into the table, so the names it hands out stay valid
+/// for its whole lifetime.
+class SymbolTable {
+  llvm::StringMap<SymbolID, llvm::BumpPtrAllocator> IDs;
+  std::vector<llvm::StringRef> Names;
+  std::mutex Lock;
+
+public:
+  /// intern - Return the ID for Name, assigning the next one if it is new.
+  SymbolID intern(llvm::StringRef Name) {
+    auto Ins = IDs.try_emplace(Name, Names.size());
+    if (Ins.second)
+      Names.push_back(Ins.first->getKey());
+    return Ins.first->second;
+  }
+
+  /// intern - Intern the spelling of an operator function, e.g. "binary|".
+  SymbolID intern(llvm::StringRef Prefix, char Op) {
+    llvm::SmallString<8> Name(Prefix);
+    Name.push_back(Op);
+    return intern(Name);
+  }
+
+  /// internShared - intern() for use while other threads are interning into
+  /// the table too.  Nothing may call getName() until they have finished.
+  SymbolID internShared(llvm::StringRef Name) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    return intern(Name);
+  }
+
+  llvm::StringRef getName(SymbolID ID) const { return Names[ID]; }
+  size_t size() const { return Names.size(); }
+};
+
+/// SymbolCache - One thread's view of a SymbolTable that several threads are
+/// interning into at once.  A name the thread has seen before resolves from
+/// the cache; only the first sighting of each takes the table's lock.
+class SymbolCache {
+  SymbolTable &Table;
+  llvm::StringMap<SymbolID> Cache;
+
+public:
+  explicit SymbolCache(SymbolTable &Table) : Table(Table) {}
+
+  SymbolID intern(llvm::StringRef Name) {
+    auto Ins = Cache.try_emplace(Name, 0);
+    if (Ins.second)
+      Ins.first->second = Table.internShared(Name);
+    return Ins.first->second;
+  }
+
+  SymbolID intern(llvm::StringRef Prefix, char Op) {
+    llvm::SmallString<8> Name(Prefix);
+    Name.push_back(Op);
+    return intern(Name);
+  }
+};
+
+#endif // DIV_SYMBOL_HH
@@ -0,0 +1,103 @@
+//===- tiering.hh - Counters and renaming for tiered compilation -*- C++ -*-===//
+//
+// In tiered mode a function is first compiled quickly and without
+// optimization, with a counter bumped on entry and on every loop back-edge.
+// When the counter reaches a threshold the baseline code calls back into the
+// JIT, which recompiles the function with full optimization on another thread
+// and swaps it in behind the stub every call goes through.
+//
+// These are the IR-level pieces: renaming a definition so that calls to it,
+// even from its own body, keep going through the stub, and adding the
+// counters.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_TIERING_HH
+#define DIV_TIERING_HH
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include <cstdint>
+
+/// renameDefinition - Rename F, a definition, to NewName, and leave behind a
+/// declaration with its old name for every call to it to use instead.  That
+/// includes recursive calls, so that they too pick up whichever code the
+/// old name is bound to.
+static inline llvm::Function *renameDefinition(llvm::Function &F,
+                                               const llvm::Twine &NewName) {
+  llvm::Function *Decl =
+      llvm::Function::Create(F.getFunctionType(), F.getLinkage(), "",
+                             F.getParent());
+  F.replaceAllUsesWith(Decl);
+  Decl->takeName(&F);
+  F.setName(NewName);
+  return &F;
+}
+
+/// TierUpHook - What instrumented code calls, once, when its counter reaches
+/// the threshold.  Arg is the one given to instrumentForTiering.
+typedef void (*TierUpHook)(void *Arg);
+
+/// emitCount - Bump *Counter before I, and when it reaches Threshold, call
+/// Hook(Arg) in a block of its own, marked cold.
+static inline void emitCount(llvm::Instruction *I, uint64_t *Counter,
+                             uint64_t Threshold, TierUpHook Hook, void *Arg) {
+  llvm::IRBuilder<> B(I);
+  llvm::LLVMContext &Ctx = B.getContext();
+  llvm::Type *I64 = B.getInt64Ty();
+  llvm::Type *I8Ptr = B.getInt8PtrTy();
+
+  // The counter is host memory, bumped without a lock: a lost update now and
+  // then only delays promotion.
+  llvm::Value *Ptr = llvm::ConstantExpr::getIntToPtr(
+      B.getInt64((uintptr_t)Counter), I64->getPointerTo());
+  llvm::Value *Count = B.CreateAdd(B.CreateLoad(I64, Ptr), B.getInt64(1));
+  B.CreateStore(Count, Ptr);
+  llvm::Value *Hot = B.CreateICmpEQ(Count, B.getInt64(Threshold));
+
+  llvm::MDNode *Weights = llvm::MDBuilder(Ctx).createBranchWeights(1, 1 << 20);
+  llvm::Instruction *Then =
+      llvm::SplitBlockAndInsertIfThen(Hot, I, false, Weights);
+  B.SetInsertPoint(Then);
+  llvm::FunctionType *HookTy =
+      llvm::FunctionType::get(B.getVoidTy(), {I8Ptr}, false);
+  llvm::Value *HookPtr = llvm::ConstantExpr::getIntToPtr(
+      B.getInt64((uintptr_t)Hook), HookTy->getPointerTo());
+  llvm::Value *ArgPtr =
+      llvm::ConstantExpr::getIntToPtr(B.getInt64((uintptr_t)Arg), I8Ptr);
+  B.CreateCall(HookTy, HookPtr, {ArgPtr});
+}
+
+/// instrumentForTiering - Count entries to F and the back-edges of its
+/// loops in *Counter, calling Hook(Arg) when the count reaches Threshold.
+static inline void instrumentForTiering(llvm::Function &F, uint64_t *Counter,
+                                        uint64_t Threshold, TierUpHook Hook,
+                                        void *Arg) {
+  // A block ending in a branch to a block that dominates it closes a loop.
+  llvm::DominatorTree DT(F);
+  llvm::SmallVector<llvm::BasicBlock *, 8> Latches;
+  for (llvm::BasicBlock &BB : F)
+    for (llvm::BasicBlock *Succ : llvm::successors(&BB))
+      if (DT.dominates(Succ, &BB)) {
+        Latches.push_back(&BB);
+        break;
+      }
+
+  for (llvm::BasicBlock *Latch : Latches)
+    emitCount(Latch->getTerminator(), Counter, Threshold, Hook, Arg);
+
+  // Count entries after the allocas, which must stay in the entry block.
+  llvm::BasicBlock::iterator I = F.getEntryBlock().begin();
+  while (llvm::isa<llvm::AllocaInst>(I))
+    ++I;
+  emitCount(&*I, Counter, Threshold, Hook, Arg);
+}
+
+#endif // DIV_TIERING_HH
@@ -0,0 +1,345 @@
+//===- timing.hh - Where compile time goes ----------------------*- C++ -*-===//
+//
+// Phase timers for everything between reading a top-level item and running
+// it: lexing, parsing, generating IR, verifying it, optimizing, generating
+// machine code, linking and looking symbols up, and then running the code.
+//
+// A PhaseScope times the phase it names from its construction to its
+// destruction.  Scopes nest, and time is charged to the innermost phase only,
+// so no time is counted twice.  Lexing is too fine-grained for a scope per
+// token; the parser charges each token with chargeLexing instead, and lexing
+// is counted in tokens.  Each phase is also charged to the top-level item
+// being handled when it runs, whichever thread it runs on: code for a
+// definition is generated when something first looks it up, and so is
+// charged to that.  With compile threads, the phases add up to more than the
+// wall time, and a phase finishing on another thread as the results are read
+// may be missed.
+//
+// With timing off, as it is unless enabled, a scope costs a test of a flag.
+// The results can be printed as a table, or written out as JSON or as a
+// Chrome trace-event file, for chrome://tracing or Perfetto.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_TIMING_HH
+#define DIV_TIMING_HH
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Phase - What compile time is spent on.
+enum Phase {
+  PhaseLex,
+  PhaseParse,
+  PhaseCodegen,
+  PhaseVerify,
+  PhaseOptimize,
+  PhaseMachineCodegen,
+  PhaseLink,
+  PhaseLookup,
+  PhaseRun,
+  NumPhases
+};
+
+static inline const char *getPhaseName(Phase P) {
+  static const char *const Names[NumPhases] = {
+      "lex", "parse", "codegen", "verify", "optimize",
+      "mc",  "link",  "lookup",  "run"};
+  return Names[P];
+}
+
+typedef std::chrono::steady_clock PhaseClock;
+
+/// PhaseTimes - Nanoseconds and occurrences per phase.
+struct PhaseTimes {
+  uint64_t Nanos[NumPhases] = {};
+  uint64_t Count[NumPhases] = {};
+
+  uint64_t getTotal() const {
+    uint64_t Total = 0;
+    for (uint64_t N : Nanos)
+      Total += N;
+    return Total;
+  }
+};
+
+/// TimedItem - A top-level item and the time charged to it.
+struct TimedItem {
+  std::string Kind; // "def", "extern" or "expr".
+  std::string Name;
+  unsigned Line = 0;
+  PhaseClock::time_point Start, End;
+  PhaseTimes Times;
+};
+
+/// TraceEvent - A phase's span, for the trace file.
+struct TraceEvent {
+  Phase P;
+  int Item;
+  unsigned Thread;
+  PhaseClock::time_point Start, End;
+};
+
+/// PhaseTimer - The session's timings.  There is one, TheTimer.
+class PhaseTimer {
+  std::mutex Lock; // Guards everything below but Enabled and CurrentItem.
+  PhaseTimes Session;
+  std::vector<TimedItem> Items;
+  std::vector<TraceEvent> Events;
+  std::vector<std::thread::id> Threads;
+  PhaseClock::time_point Begin = PhaseClock::now();
+
+public:
+  bool Enabled = false;
+  /// Tracing - Keep every span for writeTrace, not just the totals.
+  bool Tracing = false;
+  /// CurrentItem - The index of the item being handled, or -1 outside any.
+  std::atomic<int> CurrentItem{-1};
+
+  /// beginItem - Start charging time to a new top-level item.
+  void beginItem(llvm::StringRef Kind, unsigned Line) {
+    if (!Enabled)
+      return;
+    std::lock_guard<std::mutex> Guard(Lock);
+    Items.emplace_back();
+    Items.back().Kind = Kind.str();
+    Items.back().Line = Line;
+    Items.back().Start = PhaseClock::now();
+    CurrentItem = Items.size() - 1;
+  }
+
+  void nameItem(llvm::StringRef Name) {
+    if (!Enabled || CurrentItem < 0)
+      return;
+    std::lock_guard<std::mutex> Guard(Lock);
+    Items[CurrentItem].Name = Name.str();
+  }
+
+  void endItem() {
+    if (!Enabled || CurrentItem < 0)
+      return;
+    std::lock_guard<std::mutex> Guard(Lock);
+    Items[CurrentItem].End = PhaseClock::now();
+    CurrentItem = -1;
+  }
+
+  /// charge - Add Nanos spent on P, from Start to End on this thread, to the
+  /// session and the current item.
+  void charge(Phase P, uint64_t Nanos, uint64_t Count,
+              PhaseClock::time_point Start, PhaseClock::time_point End) {
+    int Item = CurrentItem;
+    std::lock_guard<std::mutex> Guard(Lock);
+    Session.Nanos[P] += Nanos;
+    Session.Count[P] += Count;
+    if (Item >= 0) {
+      Items[Item].Times.Nanos[P] += Nanos;
+      Items[Item].Times.Count[P] += Count;
+    }
+    if (Tracing && Start != End)
+      Events.push_back({P, Item, getThreadIndex(), Start, End});
+  }
+
+  /// printTable - The session's totals, then the Slowest items that took
+  /// longest.
+  void printTable(FILE *OS, size_t Slowest = 10) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    uint64_t Total = Session.getTotal();
+    fprintf(OS, "phase times: %zu items, %.1f ms wall\n", Items.size(),
+            toMillis(PhaseClock::now() - Begin));
+    fprintf(OS, "  %-10s %12s %7s %10s\n", "phase", "time (ms)", "%",
+            "count");
+    for (unsigned P = 0; P != NumPhases; ++P)
+      fprintf(OS, "  %-10s %12.3f %6.1f%% %10llu\n", getPhaseName(Phase(P)),
+              Session.Nanos[P] / 1e6,
+              Total ? 100.0 * Session.Nanos[P] / Total : 0.0,
+              (unsigned long long)Session.Count[P]);
+    fprintf(OS, "  %-10s %12.3f\n", "total", Total / 1e6);
+
+    std::vector<const TimedItem *> Sorted;
+    for (const TimedItem &I : Items)
+      Sorted.push_back(&I);
+    std::stable_sort(Sorted.begin(), Sorted.end(),
+                     [](const TimedItem *A, const TimedItem *B) {
+                       return A->Times.getTotal() > B->Times.getTotal();
+                     });
+    if (Sorted.size() > Slowest)
+      Sorted.resize(Slowest);
+    if (Sorted.empty())
+      return;
+
+    fprintf(OS, "slowest items (ms):\n  %-6s %-16s %5s %9s", "kind", "name",
+            "line", "total");
+    for (unsigned P = 0; P != NumPhases; ++P)
+      fprintf(OS, " %8s", getPhaseName(Phase(P)));
+    fprintf(OS, "\n");
+    for (const TimedItem *I : Sorted) {
+      fprintf(OS, "  %-6s %-16s %5u %9.3f", I->Kind.c_str(), I->Name.c_str(),
+              I->Line, I->Times.getTotal() / 1e6);
+      for (unsigned P = 0; P != NumPhases; ++P)
+        fprintf(OS, " %8.3f", I->Times.Nanos[P] / 1e6);
+      fprintf(OS, "\n");
+    }
+  }
+
+  /// writeJSON - The session's totals and every item's, in milliseconds.
+  void writeJSON(llvm::raw_ostream &OS) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    llvm::json::OStream J(OS, 2);
+    J.object([&] {
+      J.attribute("wall_ms", toMillis(PhaseClock::now() - Begin));
+      J.attributeObject("session", [&] { writeTimes(J, Session); });
+      J.attributeArray("items", [&] {
+        for (const TimedItem &I : Items)
+          J.object([&] {
+            J.attribute("kind", I.Kind);
+            J.attribute("name", I.Name);
+            J.attribute("line", I.Line);
+            J.attribute("start_ms", toMillis(I.Start - Begin));
+            J.attributeObject("phases", [&] { writeTimes(J, I.Times); });
+          });
+      });
+    });
+    OS << "\n";
+  }
+
+  /// writeTrace - Every item and phase as a complete ("X") event of the
+  /// Chrome trace-event format, items on the thread that handled them and
+  /// phases on the threads they ran on.
+  void writeTrace(llvm::raw_ostream &OS) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto Micros = [&](PhaseClock::time_point T) {
+      return std::chrono::duration<double, std::micro>(T - Begin).count();
+    };
+    llvm::json::OStream J(OS);
+    J.object([&] {
+      J.attributeArray("traceEvents", [&] {
+        for (const TimedItem &I : Items)
+          J.object([&] {
+            J.attribute("name", I.Kind + " " + I.Name);
+            J.attribute("cat", "item");
+            J.attribute("ph", "X");
+            J.attribute("pid", 1);
+            J.attribute("tid", 0);
+            J.attribute("ts", Micros(I.Start));
+            J.attribute("dur", Micros(I.End) - Micros(I.Start));
+            J.attributeObject("args", [&] { J.attribute("line", I.Line); });
+          });
+        for (const TraceEvent &E : Events)
+          J.object([&] {
+            J.attribute("name", getPhaseName(E.P));
+            J.attribute("cat", "phase");
+            J.attribute("ph", "X");
+            J.attribute("pid", 1);
+            J.attribute("tid", E.Thread);
+            J.attribute("ts", Micros(E.Start));
+            J.attribute("dur", Micros(E.End) - Micros(E.Start));
+            J.attributeObject("args", [&] { J.attribute("item", E.Item); });
+          });
+      });
+      J.attribute("displayTimeUnit", "ms");
+    });
+    OS << "\n";
+  }
+
+private:
+  static double toMillis(PhaseClock::duration D) {
+    return std::chrono::duration<double, std::milli>(D).count();
+  }
+
+  static void writeTimes(llvm::json::OStream &J, const PhaseTimes &T) {
+    for (unsigned P = 0; P != NumPhases; ++P)
+      J.attribute(getPhaseName(Phase(P)), T.Nanos[P] / 1e6);
+    J.attribute("total", T.getTotal() / 1e6);
+  }
+
+  /// getThreadIndex - A small number for this thread: 0 for the first to
+  /// charge anything, which is the main one.  Lock must be held.
+  unsigned getThreadIndex() {
+    std::thread::id Id = std::this_thread::get_id();
+    auto It = llvm::find(Threads, Id);
+    if (It != Threads.end())
+      return It - Threads.begin();
+    Threads.push_back(Id);
+    return Threads.size() - 1;
+  }
+};
+
+static PhaseTimer TheTimer;
+
+/// PhaseScope - Charges the time from its construction to its destruction,
+/// less that of the scopes nested in it, to a phase.
+class PhaseScope {
+  Phase P;
+  bool Active;
+  PhaseScope *Parent;
+  PhaseClock::time_point Start, Resumed;
+  uint64_t Nanos = 0;
+
+  /// Innermost - The innermost scope open on this thread.  Lexing - The time
+  /// chargeLexing has set aside from it, and the tokens lexed in that time.
+  static PhaseScope *&getInnermost() {
+    static thread_local PhaseScope *Innermost = nullptr;
+    return Innermost;
+  }
+  struct Lexing {
+    uint64_t Nanos = 0, Tokens = 0;
+  };
+  static Lexing &getLexing() {
+    static thread_local Lexing L;
+    return L;
+  }
+
+public:
+  explicit PhaseScope(Phase P) : P(P), Active(TheTimer.Enabled) {
+    if (!Active)
+      return;
+    Start = Resumed = PhaseClock::now();
+    Parent = getInnermost();
+    if (Parent)
+      Parent->Nanos += (Start - Parent->Resumed).count();
+    getInnermost() = this;
+  }
+
+  ~PhaseScope() {
+    if (!Active)
+      return;
+    PhaseClock::time_point End = PhaseClock::now();
+    Nanos += (End - Resumed).count();
+    Lexing &L = getLexing();
+    uint64_t LexNanos = std::min(L.Nanos, Nanos);
+    if (L.Tokens)
+      TheTimer.charge(PhaseLex, LexNanos, L.Tokens, End, End);
+    L = Lexing();
+    TheTimer.charge(P, Nanos - LexNanos, 1, Start, End);
+    getInnermost() = Parent;
+    if (Parent)
+      Parent->Resumed = End;
+  }
+
+  PhaseScope(const PhaseScope &) = delete;
+  PhaseScope &operator=(const PhaseScope &) = delete;
+
+  /// chargeLexing - Charge Nanos spent lexing a token to lexing rather than
+  /// to the innermost scope, if there is one.
+  static void chargeLexing(uint64_t Nanos) {
+    if (!getInnermost()) {
+      PhaseClock::time_point Now = PhaseClock::now();
+      return TheTimer.charge(PhaseLex, Nanos, 1, Now, Now);
+    }
+    getLexing().Nanos += Nanos;
+    ++getLexing().Tokens;
+  }
+};
+
+#endif // DIV_TIMING_HH
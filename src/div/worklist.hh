@@ -0,0 +1,81 @@
+//===- worklist.hh - Code generation without recursion ----------*- C++ -*-===//
+//
+// Generating code for an expression by recursing into its operands takes a C++
+// stack frame per level, so a machine-generated formula some hundred thousand
+// operators deep overflows the stack.  Here each node's code generator is
+// instead a step function: it runs until it needs the value of an operand, and
+// hands the operand back to the driver rather than calling into it.  The
+// driver keeps the suspended nodes on a stack of its own, on the heap, and
+// resumes each with the value of the operand it asked for.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DIV_WORKLIST_HH
+#define DIV_WORKLIST_HH
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+#include <cstddef>
+
+/// CodegenFrame - A node whose code is being generated.  Its step function
+/// keeps whatever it needs from one operand to the next in the spare fields.
+template <typename Expr> struct CodegenFrame {
+  Expr E;
+  unsigned Stage = 0; // How far the step function has got; 0 on entry.
+  unsigned Index = 0; // The argument or variable being generated.
+  size_t Saved = 0;   // Where this node's entries in Values or Bindings start.
+  llvm::Value *Vals[2] = {};
+  llvm::BasicBlock *Blocks[3] = {};
+  llvm::AllocaInst *Allocas[2] = {};
+
+  explicit CodegenFrame(Expr E) : E(E) {}
+};
+
+/// CodegenStep - What a step function returns: an operand to generate code for
+/// next, after which the node is resumed with the operand's value, or else the
+/// node's own value, which is null on error.
+template <typename Expr> struct CodegenStep {
+  Expr Operand;
+  llvm::Value *Result;
+
+  CodegenStep(llvm::Value *Result) : Operand(nullptr), Result(Result) {}
+  static CodegenStep visit(Expr Operand) {
+    CodegenStep S(nullptr);
+    S.Operand = Operand;
+    return S;
+  }
+};
+
+/// CodegenStack - The suspended nodes, innermost last, and what they have set
+/// aside: the values of the call arguments generated so far, and the bindings
+/// that var/in expressions shadow.
+template <typename Expr> struct CodegenStack {
+  llvm::SmallVector<CodegenFrame<Expr>, 32> Frames;
+  llvm::SmallVector<llvm::Value *, 16> Values;
+  llvm::SmallVector<llvm::AllocaInst *, 16> Bindings;
+};
+
+/// runCodegen - Generate code for Root and return its value.  Step(S, F, V)
+/// advances the node in frame F, passing V, the value of the operand it last
+/// asked for, or null when the node is first entered.
+template <typename Expr, typename StepFn>
+llvm::Value *runCodegen(Expr Root, StepFn Step) {
+  CodegenStack<Expr> S;
+  S.Frames.emplace_back(Root);
+  llvm::Value *V = nullptr;
+  while (true) {
+    CodegenStep<Expr> Next = Step(S, S.Frames.back(), V);
+    if (Next.Operand) {
+      S.Frames.emplace_back(Next.Operand);
+      V = nullptr;
+      continue;
+    }
+    S.Frames.pop_back();
+    if (S.Frames.empty())
+      return Next.Result;
+    V = Next.Result;
+  }
+}
+
+#endif // DIV_WORKLIST_HH
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Run test/exprs.div with compile threads, again and again, with each linker:
+# an expression must not run before the functions it calls are linked, nor
+# be freed while a compile thread is still linking it.
+#
+# Under -jitlink this works around a limitation of LLVM 14's ORC: a symbol
+# is only made to wait for the symbols its own lookup had to wait for.  With
+# compile threads, the function an object calls may already have been given
+# an address on another thread, but not be linked yet, so nothing waits for
+# it, and the caller is marked ready and can run into unwritten code.  With
+# no compile threads each link finishes before the next starts.  DivJIT's
+# LinkReferencesPlugin records what each object refers to, and
+# DivJIT::lookup waits for those.  Without it, this crashes even with one
+# compile thread:
+#
+#   def f(x) x+1;
+#   def g(x) f(x);
+#   g(5);
+#
+#   $ div -jitlink -jit-threads=1 gf.div
+#   Segmentation fault
+#
+# Usage: test/jit-threads.sh <div binary> [runs]
+
+DIV=${1:-dist/div}
+RUNS=${2:-20}
+DIR=$(dirname "$0")
+EXPECTED=8
+OUT=$(mktemp)
+trap 'rm -f "$OUT"' EXIT
+
+status=0
+for flags in "-jit-threads=2" "-jit-threads=4" "-jitlink -jit-threads=2" \
+             "-jitlink -jit-threads=4"; do
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    i=$((i + 1))
+    "$DIV" $flags "$DIR/exprs.div" > "$OUT" 2>&1
+    code=$?
+    evaluated=$(grep -c "Evaluated to" "$OUT")
+    if [ $code -ne 0 ] || [ "$evaluated" -ne $EXPECTED ] ||
+       grep -q "defunct\|error" "$OUT"; then
+      echo "FAIL: $flags run $i: exit $code," \
+           "$evaluated of $EXPECTED expressions evaluated"
+      grep "defunct\|error" "$OUT"
+      status=1
+    fi
+  done
+done
+[ $status -eq 0 ] && echo "PASS: $RUNS runs each, 2 and 4 compile threads, both linkers"
+exit $status
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Run test/exprs.div under -tiered with a low threshold, with each linker, so
+# that functions are promoted while the program runs and as it exits.  Every
+# promotion must link, and none may be left behind to fail at exit.
+#
+# Usage: test/tiered.sh <div binary> [runs]
+
+DIV=${1:-dist/div}
+RUNS=${2:-10}
+DIR=$(dirname "$0")
+EXPECTED=8
+OUT=$(mktemp)
+trap 'rm -f "$OUT"' EXIT
+
+status=0
+for flags in "-tiered" "-tiered -jitlink" "-tiered -jitlink -jit-threads=2"; do
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    i=$((i + 1))
+    "$DIV" $flags -tier-threshold=10 "$DIR/exprs.div" > "$OUT" 2>&1
+    code=$?
+    evaluated=$(grep -c "Evaluated to" "$OUT")
+    if [ $code -ne 0 ] || [ "$evaluated" -ne $EXPECTED ] ||
+       grep -q "error" "$OUT"; then
+      echo "FAIL: $flags run $i: exit $code," \
+           "$evaluated of $EXPECTED expressions evaluated"
+      grep "error" "$OUT"
+      status=1
+    fi
+  done
+done
+[ $status -eq 0 ] && echo "PASS: $RUNS runs each, tiered, both linkers"
+exit $status